@@ -0,0 +1,235 @@
+// Copyright (c) 2012, Sergey Zolotarev
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met: 
+//
+// 1. Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer. 
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution. 
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// // LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// Compares the SSE2 string functions from simd.cpp with scalar versions of
+// the stock natives (as found in amxstring.c) on unpacked strings of a few
+// different lengths. This is not part of the plugin, build it by hand:
+//
+//   g++ -O2 -msse2 -Wno-attributes -I. -Iamx -DHAVE_STDINT_H bench/strings.cpp simd.cpp -o strings
+//
+// and run it with no arguments.
+
+#include <cctype>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <vector>
+
+#include "amx/amx.h"
+#include "simd.h"
+
+namespace {
+
+const int kIterations = 2000000;
+
+inline cell *GetAddress(AMX *amx, cell address) {
+	return reinterpret_cast<cell*>(amx->data + address);
+}
+
+// The natives only look at amx->data, so the header can be left empty.
+struct Machine {
+	AMX amx;
+	AMX_HEADER hdr;
+	std::vector<cell> data;
+
+	explicit Machine(std::size_t cells) : data(cells + 4) {
+		std::memset(&amx, 0, sizeof(amx));
+		std::memset(&hdr, 0, sizeof(hdr));
+		amx.base = reinterpret_cast<unsigned char*>(&hdr);
+		amx.data = reinterpret_cast<unsigned char*>(&data[0]);
+	}
+
+	cell *At(cell address) {
+		return GetAddress(&amx, address);
+	}
+
+	void Store(cell address, const char *string, std::size_t length) {
+		cell *dest = At(address);
+		for (std::size_t i = 0; i < length; i++) {
+			dest[i] = string[i];
+		}
+		dest[length] = 0;
+	}
+};
+
+int Length(const cell *string) {
+	int length = 0;
+	while (string[length] != 0) {
+		length++;
+	}
+	return length;
+}
+
+cell Compare(const cell *string1, const cell *string2, bool ignorecase, int length, int offset1) {
+	cell c1 = 0, c2 = 0;
+	for (int index = 0; index < length; index++) {
+		c1 = string1[index + offset1];
+		c2 = string2[index];
+		if (ignorecase) {
+			c1 = std::toupper(c1);
+			c2 = std::toupper(c2);
+		}
+		if (c1 != c2) {
+			break;
+		}
+	}
+	return c1 - c2;
+}
+
+// Scalar counterparts of the stock natives, unpacked strings only.
+
+cell AMX_NATIVE_CALL n_strlen(AMX *amx, cell *params) {
+	return Length(GetAddress(amx, params[1]));
+}
+
+cell AMX_NATIVE_CALL n_strcmp(AMX *amx, cell *params) {
+	const cell *string1 = GetAddress(amx, params[1]);
+	const cell *string2 = GetAddress(amx, params[2]);
+	int length1 = Length(string1);
+	int length2 = Length(string2);
+	int length = length1 < length2 ? length1 : length2;
+	if (length > params[4]) {
+		length = params[4];
+	}
+	if (length == 0) {
+		return 0;
+	}
+	cell result = Compare(string1, string2, params[3] != 0, length, 0);
+	if (result == 0 && length != params[4]) {
+		result = length1 - length2;
+	}
+	return result;
+}
+
+cell AMX_NATIVE_CALL n_strfind(AMX *amx, cell *params) {
+	const cell *string = GetAddress(amx, params[1]);
+	const cell *sub = GetAddress(amx, params[2]);
+	int length = Length(string);
+	int sublength = Length(sub);
+	if (sublength == 0) {
+		return -1;
+	}
+	for (int offset = params[4]; offset <= length - sublength; offset++) {
+		if (Compare(string, sub, params[3] != 0, sublength, offset) == 0) {
+			return offset;
+		}
+	}
+	return -1;
+}
+
+cell AMX_NATIVE_CALL n_strcat(AMX *amx, cell *params) {
+	cell *dest = GetAddress(amx, params[1]);
+	const cell *source = GetAddress(amx, params[2]);
+	int length = Length(dest);
+	int i = 0;
+	for (; source[i] != 0 && length + i < params[3] - 1; i++) {
+		dest[length + i] = source[i];
+	}
+	dest[length + i] = 0;
+	return length + i;
+}
+
+cell AMX_NATIVE_CALL n_strmid(AMX *amx, cell *params) {
+	cell *dest = GetAddress(amx, params[1]);
+	const cell *source = GetAddress(amx, params[2]);
+	int length = Length(source);
+	cell start = params[3];
+	cell end = params[4] < length ? params[4] : length;
+	int i = 0;
+	for (; start + i < end && i < params[5] - 1; i++) {
+		dest[i] = source[start + i];
+	}
+	dest[i] = 0;
+	return i;
+}
+
+typedef cell (*SimdFunction)(AMX *amx, cell *params, AMX_NATIVE native);
+
+// Some natives modify their destination, so "reset" restores it before each
+// call (for both versions alike).
+struct Test {
+	const char *name;
+	AMX_NATIVE native;
+	SimdFunction simd;
+	cell params[6];
+	cell reset;
+};
+
+double Time(Machine &m, const Test &test, bool simd, cell &result) {
+	cell params[6];
+	std::clock_t start = std::clock();
+	for (int i = 0; i < kIterations; i++) {
+		std::memcpy(params, test.params, sizeof(params));
+		if (test.reset >= 0) {
+			*m.At(test.reset) = 0;
+		}
+		result = simd ? test.simd(&m.amx, params, test.native)
+		              : test.native(&m.amx, params);
+	}
+	return static_cast<double>(std::clock() - start) / CLOCKS_PER_SEC;
+}
+
+} // anonymous namespace
+
+int main() {
+	static const int lengths[] = {8, 32, 128};
+
+	std::printf("%-8s %6s %12s %12s %8s\n", "native", "length", "stock (s)", "simd (s)", "speedup");
+	for (std::size_t l = 0; l < sizeof(lengths) / sizeof(*lengths); l++) {
+		int n = lengths[l];
+		std::vector<char> text(n);
+		for (int i = 0; i < n; i++) {
+			text[i] = 'a' + i % 26;
+		}
+
+		// Layout (cell offsets): string at 0, its copy at 1 * stride,
+		// the last 4 characters at 2 * stride, a buffer at 3 * stride.
+		cell stride = (n + 4) * sizeof(cell);
+		Machine m(4 * (n + 4));
+		m.Store(0, &text[0], n);
+		m.Store(stride, &text[0], n);
+		m.Store(2 * stride, &text[n - 4], 4);
+
+		const Test tests[] = {
+			{"strlen",  n_strlen,  jit::StrLen,  {1 * sizeof(cell), 0}, -1},
+			{"strcmp",  n_strcmp,  jit::StrCmp,  {4 * sizeof(cell), 0, stride, 1, n}, -1},
+			{"strfind", n_strfind, jit::StrFind, {4 * sizeof(cell), 0, 2 * stride, 0, 0}, -1},
+			{"strcat",  n_strcat,  jit::StrCat,  {3 * sizeof(cell), 3 * stride, 0, n + 4}, 3 * stride},
+			{"strmid",  n_strmid,  jit::StrMid,  {5 * sizeof(cell), 3 * stride, 0, 1, n - 1, n + 4}, -1}
+		};
+
+		for (std::size_t t = 0; t < sizeof(tests) / sizeof(*tests); t++) {
+			cell stock_result, simd_result;
+			double stock = Time(m, tests[t], false, stock_result);
+			double simd = Time(m, tests[t], true, simd_result);
+			if (stock_result != simd_result) {
+				std::printf("%s: results differ (%d vs %d)\n", tests[t].name, 
+				            static_cast<int>(stock_result), static_cast<int>(simd_result));
+				return 1;
+			}
+			std::printf("%-8s %6d %12.3f %12.3f %7.2fx\n", tests[t].name, n, stock, simd, 
+			            simd > 0 ? stock / simd : 0.0);
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,176 @@
+// Copyright (c) 2012, Sergey Zolotarev
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met: 
+//
+// 1. Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer. 
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution. 
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// // LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include <cstddef>
+
+#include "format.h"
+
+namespace {
+
+inline unsigned char *GetAmxData(AMX *amx) {
+	AMX_HEADER *hdr = reinterpret_cast<AMX_HEADER*>(amx->base);
+	return amx->data != 0 ? amx->data : amx->base + hdr->dat;
+}
+
+inline cell *GetAddress(AMX *amx, cell address) {
+	return reinterpret_cast<cell*>(GetAmxData(amx) + address);
+}
+
+// Copy at most (end - dest) cells from source to dest and return the new dest.
+inline cell *Append(cell *dest, cell *end, const cell *source, std::size_t length) {
+	for (std::size_t i = 0; i < length && dest < end; i++) {
+		*dest++ = source[i];
+	}
+	return dest;
+}
+
+} // anonymous namespace
+
+namespace jit {
+
+FormatPlan::FormatPlan()
+	: num_args_(0)
+{
+}
+
+bool FormatPlan::Parse(const cell *format) {
+	if (static_cast<ucell>(*format) > static_cast<ucell>(UNPACKEDMAX)) {
+		return false;
+	}
+
+	segments_.clear();
+	text_.clear();
+	num_args_ = 0;
+
+	for (const cell *c = format; *c != 0; c++) {
+		if (*c == '%') {
+			Segment segment = {SEGMENT_TEXT, 0, 0};
+			switch (*++c) {
+				case 'd':
+				case 'i':
+					segment.type = SEGMENT_INTEGER;
+					break;
+				case 's':
+					segment.type = SEGMENT_STRING;
+					break;
+				case '%':
+					// "%%" is a literal percent sign.
+					break;
+				default:
+					// Flags, width, precision, floats, etc.
+					return false;
+			}
+			if (segment.type != SEGMENT_TEXT) {
+				segments_.push_back(segment);
+				num_args_++;
+				continue;
+			}
+		}
+		if (segments_.empty() || segments_.back().type != SEGMENT_TEXT) {
+			Segment segment = {SEGMENT_TEXT, text_.size(), 0};
+			segments_.push_back(segment);
+		}
+		text_.push_back(*c);
+		segments_.back().length++;
+	}
+
+	return true;
+}
+
+cell FormatPlan::Execute(AMX *amx, cell *params, AMX_NATIVE native) const {
+	int num_params = params[0] / sizeof(cell);
+	if (num_params < 3 + num_args_ || params[2] <= 0) {
+		return native(amx, params);
+	}
+
+	cell *dest = GetAddress(amx, params[1]);
+	cell *end = dest + params[2] - 1;
+
+	// Check string arguments first: packed strings and strings that overlap
+	// with the destination buffer are left to the native.
+	int arg = 4;
+	for (std::vector<Segment>::const_iterator it = segments_.begin(); 
+			it != segments_.end(); ++it) 
+	{
+		if (it->type == SEGMENT_TEXT) {
+			continue;
+		}
+		if (it->type == SEGMENT_STRING) {
+			const cell *string = GetAddress(amx, params[arg]);
+			if (static_cast<ucell>(*string) > static_cast<ucell>(UNPACKEDMAX)) {
+				return native(amx, params);
+			}
+			const cell *string_end = string;
+			while (*string_end != 0) {
+				string_end++;
+			}
+			if (string <= end && dest <= string_end) {
+				return native(amx, params);
+			}
+		}
+		arg++;
+	}
+
+	cell *out = dest;
+	arg = 4;
+	for (std::vector<Segment>::const_iterator it = segments_.begin(); 
+			it != segments_.end(); ++it) 
+	{
+		switch (it->type) {
+			case SEGMENT_TEXT:
+				out = Append(out, end, &text_[it->offset], it->length);
+				break;
+			case SEGMENT_INTEGER: {
+				cell value = *GetAddress(amx, params[arg++]);
+				cell digits[16];
+				cell *first = digits + sizeof(digits) / sizeof(digits[0]);
+				ucell abs_value = value < 0 ? 0u - static_cast<ucell>(value) : value;
+				do {
+					*--first = '0' + abs_value % 10;
+					abs_value /= 10;
+				} while (abs_value != 0);
+				if (value < 0) {
+					*--first = '-';
+				}
+				out = Append(out, end, first, digits + sizeof(digits) / sizeof(digits[0]) - first);
+				break;
+			}
+			case SEGMENT_STRING: {
+				const cell *string = GetAddress(amx, params[arg++]);
+				while (*string != 0 && out < end) {
+					*out++ = *string++;
+				}
+				break;
+			}
+		}
+	}
+
+	*out = 0;
+	return 1;
+}
+
+cell FormatWithPlan(AMX *amx, cell *params, const FormatPlan *plan, AMX_NATIVE native) {
+	return plan->Execute(amx, params, native);
+}
+
+} // namespace jit
@@ -0,0 +1,78 @@
+// Copyright (c) 2012, Sergey Zolotarev
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met: 
+//
+// 1. Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer. 
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution. 
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// // LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#ifndef FORMAT_H
+#define FORMAT_H
+
+#include <cstddef>
+#include <vector>
+
+#include "amx/amx.h"
+
+namespace jit {
+
+// A pre-parsed format() format string. The JIT builds one for every format()
+// call whose format string is a literal that is never modified, so that the
+// string doesn't need to be parsed again on every call.
+//
+// Only plain text and %d, %i, %s and %% are supported, everything else makes
+// Parse() fail and the JIT calls the real format() instead.
+class FormatPlan {
+public:
+	FormatPlan();
+
+	// Parse an unpacked format string. Returns false if the string contains
+	// something that the plan can't reproduce exactly.
+	bool Parse(const cell *format);
+
+	// Get number of arguments consumed by conversions.
+	inline int GetNumArgs() const { return num_args_; }
+
+	// Do the same thing as format() would do with the same params. Calls the
+	// native for arguments that it can't handle (e.g. packed strings).
+	cell Execute(AMX *amx, cell *params, AMX_NATIVE native) const;
+
+private:
+	enum SegmentType {
+		SEGMENT_TEXT,
+		SEGMENT_INTEGER,
+		SEGMENT_STRING
+	};
+
+	struct Segment {
+		SegmentType type;
+		std::size_t offset; // offset into text_ (SEGMENT_TEXT only)
+		std::size_t length; // length of text (SEGMENT_TEXT only)
+	};
+
+	std::vector<Segment> segments_;
+	std::vector<cell> text_;
+	int num_args_;
+};
+
+// Called from JIT code in place of format().
+cell FormatWithPlan(AMX *amx, cell *params, const FormatPlan *plan, AMX_NATIVE native);
+
+} // namespace jit
+
+#endif // !FORMAT_H
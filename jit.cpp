@@ -21,9 +21,11 @@
 // (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
 // SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
+#include <algorithm>
 #include <cassert>
 #include <cstddef>
 #include <cstring>
+#include <limits>
 #include <map>
 #include <memory>
 #include <string>
@@ -32,6 +34,7 @@
 #include <AsmJit/MemoryManager.h>
 
 #include "jit.h"
+#include "simd.h"
 #include "amx/amx.h"
 
 #if defined _WIN32 || defined WIN32 || defined __WIN32__
@@ -40,6 +43,18 @@
 	#define OS_LINUX
 #endif
 
+#if defined OS_WIN32
+	#if !defined NOMINMAX
+		#define NOMINMAX
+	#endif
+	#include <windows.h>
+#else
+	#include <pthread.h>
+	#include <signal.h>
+	#include <unistd.h>
+	#include <sys/mman.h>
+#endif
+
 #if defined _MSC_VER
 	#define COMPILER_MSVC
 #elif defined __GNUC__
@@ -55,6 +70,9 @@
 	#if !defined STDCALL
 		#define STDCALL __stdcall
 	#endif
+	#if !defined THREAD_LOCAL
+		#define THREAD_LOCAL __declspec(thread)
+	#endif
 #elif defined COMPILER_GCC
 	#if !defined CDECL
 		#define CDECL __attribute__((cdecl))
@@ -62,8 +80,67 @@
 	#if !defined STDCALL
 		#define STDCALL __attribute__((stdcall))
 	#endif
+	#if !defined THREAD_LOCAL
+		#define THREAD_LOCAL __thread
+	#endif
 #endif
 
+// Maximum size of memory blocks that MOVS, CMPS and FILL handle with 
+// unrolled code, without and with SSE2.
+static const cell kMaxUnrolled = 64;
+static const cell kMaxUnrolledSSE = 256;
+
+// Maximum number of globals speculated code treats as constants, and how
+// many times it may be compiled before generic code is used for good.
+static const std::size_t kMaxSpeculatedGlobals = 32;
+static const int kMaxSpeculationRounds = 4;
+
+// Number of times a loop header is reached before the loop is traced, 
+// maximum length of a trace and how deep calls are inlined into it.
+static const cell kTraceThreshold = 1000;
+static const std::size_t kMaxTraceLength = 2000;
+static const std::size_t kMaxTraceInlineDepth = 4;
+
+// Maximum size of a function (in instructions) that may be cloned.
+static const std::size_t kMaxCloneSize = 200;
+
+// Memoized functions take at most this many arguments, and each has a cache
+// of 2^kMemoCacheBits entries.
+static const int kMaxMemoArgs = 4;
+static const int kMemoCacheBits = 8;
+static const std::size_t kMemoEntrySize = 8;
+
+// Size of the guard region below each JIT stack. A single push can't skip
+// over it, and neither can the frame of a function with local arrays of up
+// to this size. Compiled code handles SIGSEGV on a stack of its own.
+static const std::size_t kStackGuardSize = 64 * 1024;
+static const std::size_t kSignalStackSize = 64 * 1024;
+
+// Larger frames could step over the guard region, so STACK probes every
+// kStackProbeSize bytes of them on the way down.
+static const cell kStackProbeSize = 4096;
+
+// Natives that write a zero-terminated string to one of their arguments
+// without reading it first, and the argument that holds the size of the
+// buffer in cells. Only natives marked "whole" write every cell up to that
+// size, so only for them zeroing the buffer beforehand is redundant. The
+// ones listed here stop at the terminator and scripts may rely on the rest
+// of the buffer being zero.
+static const struct {
+	const char *name;
+	int arg;      // argument index, starting from 1
+	int size_arg; // same
+	bool whole;
+} string_writers[] = {
+	{"format",                1, 2, false},
+	{"valstr",                1, 0, false},
+	{"GetPlayerName",         2, 3, false},
+	{"GetPlayerIp",           2, 3, false},
+	{"GetWeaponName",         2, 3, false},
+	{"GetPVarString",         3, 4, false},
+	{"GetServerVarAsString",  2, 3, false}
+};
+
 static cell GetPublicAddress(AMX *amx, cell index) {
 	AMX_HEADER *hdr = reinterpret_cast<AMX_HEADER*>(amx->base);
 
@@ -79,6 +156,32 @@ static cell GetPublicAddress(AMX *amx, cell index) {
 	return publics[index].address;
 }
 
+static const char *GetPublicName(AMX *amx, cell index) {
+	AMX_HEADER *hdr = reinterpret_cast<AMX_HEADER*>(amx->base);
+
+	AMX_FUNCSTUBNT *publics = reinterpret_cast<AMX_FUNCSTUBNT*>(amx->base + hdr->publics);
+	int num_publics = (hdr->natives - hdr->publics) / hdr->defsize;
+
+	if (index < 0 || index >= num_publics) {
+		return 0;
+	}
+	return reinterpret_cast<char*>(amx->base + publics[index].nameofs);
+}
+
+static bool IsPublicVariable(AMX *amx, cell address) {
+	AMX_HEADER *hdr = reinterpret_cast<AMX_HEADER*>(amx->base);
+
+	AMX_FUNCSTUBNT *pubvars = reinterpret_cast<AMX_FUNCSTUBNT*>(amx->base + hdr->pubvars);
+	int num_pubvars = (hdr->tags - hdr->pubvars) / hdr->defsize;
+
+	for (int i = 0; i < num_pubvars; i++) {
+		if (pubvars[i].address == address) {
+			return true;
+		}
+	}
+	return false;
+}
+
 static cell GetNativeAddress(AMX *amx, int index) {
 	AMX_HEADER *hdr = reinterpret_cast<AMX_HEADER*>(amx->base);
 
@@ -117,376 +220,406 @@ static int GetNativeIndex(AMX *amx, cell address) {
 	return -1;
 }
 
+static std::string GetSysreqNativeName(AMX *amx, const jit::AmxInstruction &instr) {
+	const char *name = 0;
+	switch (instr.GetOpcode()) {
+		case jit::OP_SYSREQ_C:
+			name = GetNativeName(amx, instr.GetOperand());
+			break;
+		case jit::OP_SYSREQ_D:
+			name = GetNativeName(amx, GetNativeIndex(amx, instr.GetOperand()));
+			break;
+		default:
+			break;
+	}
+	return name != 0 ? name : "";
+}
+
+static cell GetSysreqNativeAddress(AMX *amx, const jit::AmxInstruction &instr) {
+	switch (instr.GetOpcode()) {
+		case jit::OP_SYSREQ_C:
+			return GetNativeAddress(amx, instr.GetOperand());
+		case jit::OP_SYSREQ_D:
+			return instr.GetOperand();
+		default:
+			return 0;
+	}
+}
+
 static void STDCALL Jump(jit::Jitter *jitter, cell ip, void *stack_ptr) {
 	jitter->Jump(ip, stack_ptr);
 }
 
+static void STDCALL InvalidateGlobals(jit::Jitter *jitter, cell address, cell size) {
+	jitter->InvalidateGlobals(address, size);
+}
+
+static void STDCALL RevalidateGlobals(jit::Jitter *jitter) {
+	jitter->RevalidateGlobals();
+}
+
+static void *STDCALL GetResumeAddress(jit::Jitter *jitter, cell cip) {
+	return jitter->GetResumeAddress(cip);
+}
+
+static void *STDCALL EnterTrace(jit::Jitter *jitter, cell header) {
+	return jitter->EnterTrace(header);
+}
+
 namespace jit {
 
-#define OVERRIDE_NATIVE(name) \
-	do { native_overrides_[#name] = &Jitter::native_##name; } while (false);
+namespace {
 
-Jitter::Jitter(AMX *amx, cell *opcode_list) 
-	: amx_(amx)
-	, opcode_list_(opcode_list)
-	, halt_esp_(0)
-	, halt_ebp_(0)
-	, code_map_(0)
-	, label_map_(0)
-{
-	if (!stack_.IsReady()) {
-		stack_.Allocate(1 << 20); // stack is 1 MB by default
-	}
+// Conditions, all signed.
+enum Condition {
+	COND_EQ,
+	COND_NE,
+	COND_LT,
+	COND_LE,
+	COND_GT,
+	COND_GE
+};
 
-	// Register native overrides
-	OVERRIDE_NATIVE(float);
-	OVERRIDE_NATIVE(floatabs);
-	OVERRIDE_NATIVE(floatadd);
-	OVERRIDE_NATIVE(floatsub);
-	OVERRIDE_NATIVE(floatmul);
-	OVERRIDE_NATIVE(floatdiv);
-	OVERRIDE_NATIVE(floatsqroot);
-	OVERRIDE_NATIVE(floatlog);
+// !(a <cond> b) == a <Negate(cond)> b
+inline Condition Negate(Condition cond) {
+	static const Condition negated[] = {COND_NE, COND_EQ, COND_GE, COND_GT, COND_LE, COND_LT};
+	return negated[cond];
 }
 
-void Jitter::Compile(std::FILE *list_stream) {
-	std::vector<AmxInstruction> instrs;
-	ParseCode(0, GetAmxHeader()->dat - GetAmxHeader()->cod, instrs);
+// (a <cond> b) == b <Mirror(cond)> a
+inline Condition Mirror(Condition cond) {
+	static const Condition mirrored[] = {COND_EQ, COND_NE, COND_GT, COND_GE, COND_LT, COND_LE};
+	return mirrored[cond];
+}
 
-	AsmJit::Assembler as;
-	AsmJit::FileLogger logger(list_stream);
-	as.setLogger(&logger);
+// A symbolic value that doesn't depend on other values.
+struct LoopTerm {
+	enum Kind {
+		UNKNOWN,
+		CONSTANT,   // a number or address of a global
+		LOCAL_ADDR, // address of a local: FRM + value
+		SCALAR,     // value of a LOCAL or GLOBAL variable
+		INDEX,      // the loop variable
+		ELEM,       // array[index]
+		ELEM_ADDR   // address of array[index]
+	};
 
-	std::auto_ptr<CodeMap> code_map(new CodeMap);
-	std::auto_ptr<LabelMap> label_map(new LabelMap);
+	LoopTerm(Kind kind = UNKNOWN, LoopOperand operand = LoopOperand())
+		: kind(kind), operand(operand)
+	{}
 
-	for (std::vector<AmxInstruction>::iterator instr_iterator = instrs.begin(); 
-			instr_iterator != instrs.end(); ++instr_iterator) 
-	{
-		AmxInstruction &instr = *instr_iterator;		
+	Kind kind;
+	LoopOperand operand;
+};
 
-		cell cip = reinterpret_cast<cell>(instr.GetIP()) 
-		         - reinterpret_cast<cell>(GetAmxCode());
-		as.bind(Label(as, label_map.get(), cip));
+// Symbolic value of PRI, ALT or a stack cell inside a loop.
+struct LoopValue {
+	enum Kind {
+		TERM,    // lhs
+		COMPARE, // lhs <cond> rhs
+		SUM      // lhs + rhs
+	};
 
-		code_map->insert(std::make_pair(cip, as.getCodeSize()));
+	LoopValue(const LoopTerm &lhs = LoopTerm())
+		: kind(TERM), cond(COND_EQ), lhs(lhs)
+	{}
+	LoopValue(Kind kind, Condition cond, const LoopTerm &lhs, const LoopTerm &rhs)
+		: kind(kind), cond(cond), lhs(lhs), rhs(rhs)
+	{}
 
-		using AsmJit::byte_ptr;
-		using AsmJit::word_ptr;
-		using AsmJit::dword_ptr;
-		using AsmJit::dword_ptr_abs;
-		using AsmJit::eax;
-		using AsmJit::ecx;
-		using AsmJit::edx;
-		using AsmJit::esi;
-		using AsmJit::edi;
-		using AsmJit::ebp;
-		using AsmJit::esp;
-		using AsmJit::ax;
-		using AsmJit::al;
-		using AsmJit::cl;
+	inline bool Is(LoopTerm::Kind term_kind) const 
+		{ return kind == TERM && lhs.kind == term_kind; }
 
-		switch (instr.GetOpcode()) {
-		case OP_LOAD_PRI: // address
-			// PRI = [address]
-			as.mov(eax, dword_ptr_abs(reinterpret_cast<void*>(GetAmxData() + instr.GetOperand())));
+	// Put the loop variable or array element on the left side of a compare.
+	inline void Normalize() {
+		if (kind == COMPARE && (rhs.kind == LoopTerm::INDEX || rhs.kind == LoopTerm::ELEM)) {
+			std::swap(lhs, rhs);
+			cond = Mirror(cond);
+		}
+	}
+
+	Kind kind;
+	Condition cond;
+	LoopTerm lhs;
+	LoopTerm rhs;
+};
+
+// Something a loop does besides computing values.
+struct LoopEffect {
+	enum Kind {
+		STORE_ELEM,   // array[index] = value
+		STORE_SCALAR, // target = value
+		INC_SCALAR,   // target++
+		EXIT          // leave the loop
+	};
+
+	LoopEffect(Kind kind, LoopOperand target, const LoopValue &value, bool guarded)
+		: kind(kind), target(target), value(value), guarded(guarded)
+	{}
+
+	Kind kind;
+	LoopOperand target;
+	LoopValue value;
+	bool guarded; // only done if the branch in the loop body isn't taken
+};
+
+// Symbolically executes straight-line code of a loop.
+class LoopEvaluator {
+public:
+	LoopEvaluator(cell index)
+		: guarded(false)
+		, max_index(std::numeric_limits<cell>::max())
+		, index_(index)
+	{}
+
+	// Returns false if the instruction isn't supported.
+	bool Execute(const AmxInstruction &instr);
+
+	// Get the condition under which a conditional jump is taken.
+	bool GetBranchCondition(const AmxInstruction &instr, LoopValue &cond) const;
+
+	LoopValue pri;
+	LoopValue alt;
+	std::vector<LoopValue> stack;
+
+	std::vector<LoopOperand> reads;       // variables read
+	std::vector<LoopOperand> array_reads; // arrays read
+	std::vector<LoopEffect> effects;
+	bool guarded;                         // add guarded effects
+
+	cell max_index;                       // the smallest BOUNDS operand
+
+private:
+	LoopValue Load(const LoopOperand &operand) {
+		if (operand.type == LoopOperand::LOCAL && operand.value == index_) {
+			return LoopTerm(LoopTerm::INDEX);
+		}
+		reads.push_back(operand);
+		return LoopTerm(LoopTerm::SCALAR, operand);
+	}
+
+	static bool GetArray(const LoopValue &base, LoopOperand &array) {
+		if (base.Is(LoopTerm::CONSTANT)) {
+			array = LoopOperand(LoopOperand::GLOBAL, base.lhs.operand.value);
+		} else if (base.Is(LoopTerm::LOCAL_ADDR)) {
+			array = LoopOperand(LoopOperand::LOCAL, base.lhs.operand.value);
+		} else if (base.Is(LoopTerm::SCALAR) && base.lhs.operand.type == LoopOperand::LOCAL) {
+			array = LoopOperand(LoopOperand::LOCAL_REF, base.lhs.operand.value);
+		} else {
+			return false;
+		}
+		return true;
+	}
+
+	bool Compare(Condition cond, const LoopValue &lhs, const LoopValue &rhs) {
+		if (lhs.kind != LoopValue::TERM || rhs.kind != LoopValue::TERM) {
+			return false;
+		}
+		pri = LoopValue(LoopValue::COMPARE, cond, lhs.lhs, rhs.lhs);
+		return true;
+	}
+
+	bool Store(LoopEffect::Kind kind, const LoopOperand &target, const LoopValue &value) {
+		if (target.type == LoopOperand::LOCAL && target.value == index_) {
+			return false;
+		}
+		effects.push_back(LoopEffect(kind, target, value, guarded));
+		return true;
+	}
+
+	cell index_;
+};
+
+bool LoopEvaluator::Execute(const AmxInstruction &instr) {
+	const LoopOperand local(LoopOperand::LOCAL, instr.GetOperand());
+	const LoopOperand global(LoopOperand::GLOBAL, instr.GetOperand());
+	const LoopTerm constant(LoopTerm::CONSTANT, LoopOperand(LoopOperand::CONSTANT, instr.GetOperand()));
+	const LoopTerm zero(LoopTerm::CONSTANT, LoopOperand(LoopOperand::CONSTANT, 0));
+
+	switch (instr.GetOpcode()) {
+		case OP_LOAD_PRI:
+			pri = Load(global);
 			break;
-		case OP_LOAD_ALT: // address
-			// PRI = [address]
-			as.mov(ecx, dword_ptr_abs(reinterpret_cast<void*>(GetAmxData() + instr.GetOperand())));
+		case OP_LOAD_ALT:
+			alt = Load(global);
 			break;
-		case OP_LOAD_S_PRI: // offset
-			// PRI = [FRM + offset]
-			as.mov(eax, dword_ptr(ebp, instr.GetOperand()));
+		case OP_LOAD_S_PRI:
+			pri = Load(local);
 			break;
-		case OP_LOAD_S_ALT: // offset
-			// ALT = [FRM + offset]
-			as.mov(ecx, dword_ptr(ebp, instr.GetOperand()));
+		case OP_LOAD_S_ALT:
+			alt = Load(local);
 			break;
-		case OP_LREF_PRI: // address
-			// PRI = [ [address] ]
-			as.mov(edx, dword_ptr_abs(reinterpret_cast<void*>(GetAmxData() + instr.GetOperand())));
-			as.mov(eax, dword_ptr(edx, reinterpret_cast<sysint_t>(GetAmxData())));
+		case OP_CONST_PRI:
+			pri = constant;
 			break;
-		case OP_LREF_ALT: // address
-			// ALT = [ [address] ]
-			as.mov(edx, dword_ptr_abs(reinterpret_cast<void*>(GetAmxData() + instr.GetOperand())));
-			as.mov(ecx, dword_ptr(edx, reinterpret_cast<sysint_t>(GetAmxData())));
+		case OP_CONST_ALT:
+			alt = constant;
 			break;
-		case OP_LREF_S_PRI: // offset
-			// PRI = [ [FRM + offset] ]
-			as.mov(edx, dword_ptr(ebp, instr.GetOperand()));
-			as.mov(eax, dword_ptr(edx, reinterpret_cast<sysint_t>(GetAmxData())));
+		case OP_ZERO_PRI:
+			pri = zero;
 			break;
-		case OP_LREF_S_ALT: // offset
-			// PRI = [ [FRM + offset] ]
-			as.mov(edx, dword_ptr(ebp, instr.GetOperand()));
-			as.mov(ecx, dword_ptr(edx, reinterpret_cast<sysint_t>(GetAmxData())));
+		case OP_ZERO_ALT:
+			alt = zero;
 			break;
-		case OP_LOAD_I:
-			// PRI = [PRI] (full cell)
-			as.mov(eax, dword_ptr(eax, reinterpret_cast<sysint_t>(GetAmxData())));
+		case OP_ADDR_PRI:
+			pri = LoopTerm(LoopTerm::LOCAL_ADDR, local);
 			break;
-		case OP_LODB_I: // number
-			// PRI = "number" bytes from [PRI] (read 1/2/4 bytes)
-			switch (instr.GetOperand()) {
-			case 1:
-				as.xor_(eax, eax);
-				as.mov(al, byte_ptr(eax, reinterpret_cast<sysint_t>(GetAmxData())));
-			case 2:
-				as.xor_(eax, eax);
-				as.mov(ax, word_ptr(eax, reinterpret_cast<sysint_t>(GetAmxData())));
-			default:
-				as.mov(eax, dword_ptr(eax, reinterpret_cast<sysint_t>(GetAmxData())));
-			}
+		case OP_ADDR_ALT:
+			alt = LoopTerm(LoopTerm::LOCAL_ADDR, local);
 			break;
-		case OP_CONST_PRI: // value
-			// PRI = value
-			as.mov(eax, instr.GetOperand());
+		case OP_MOVE_PRI:
+			pri = alt;
 			break;
-		case OP_CONST_ALT: // value
-			// ALT = value
-			as.mov(ecx, instr.GetOperand());
+		case OP_MOVE_ALT:
+			alt = pri;
 			break;
-		case OP_ADDR_PRI: // offset
-			// PRI = FRM + offset
-			as.lea(eax, dword_ptr(ebp, instr.GetOperand() - reinterpret_cast<sysint_t>(GetAmxData())));
+		case OP_XCHG:
+			std::swap(pri, alt);
 			break;
-		case OP_ADDR_ALT: // offset
-			// ALT = FRM + offset
-			as.lea(ecx, dword_ptr(ebp, instr.GetOperand() - reinterpret_cast<sysint_t>(GetAmxData())));
+		case OP_PUSH_PRI:
+			stack.push_back(pri);
 			break;
-		case OP_STOR_PRI: // address
-			// [address] = PRI
-			as.mov(dword_ptr_abs(reinterpret_cast<void*>(GetAmxData() + instr.GetOperand())), eax);
+		case OP_PUSH_ALT:
+			stack.push_back(alt);
 			break;
-		case OP_STOR_ALT: // address
-			// [address] = ALT
-			as.mov(dword_ptr_abs(reinterpret_cast<void*>(GetAmxData() + instr.GetOperand())), ecx);
+		case OP_PUSH_C:
+			stack.push_back(constant);
 			break;
-		case OP_STOR_S_PRI: // offset
-			// [FRM + offset] = ALT
-			as.mov(dword_ptr(ebp, instr.GetOperand()), eax);
+		case OP_PUSH:
+			stack.push_back(Load(global));
 			break;
-		case OP_STOR_S_ALT: // offset
-			// [FRM + offset] = ALT
-			as.mov(dword_ptr(ebp, instr.GetOperand()), ecx);
+		case OP_PUSH_S:
+			stack.push_back(Load(local));
 			break;
-		case OP_SREF_PRI: // address
-			// [ [address] ] = PRI
-			as.mov(edx, dword_ptr_abs(reinterpret_cast<void*>(GetAmxData() + instr.GetOperand())));
-			as.mov(dword_ptr(edx, reinterpret_cast<sysint_t>(GetAmxData())), eax);
+		case OP_POP_PRI:
+		case OP_POP_ALT:
+			if (stack.empty()) {
+				return false;
+			}
+			(instr.GetOpcode() == OP_POP_PRI ? pri : alt) = stack.back();
+			stack.pop_back();
 			break;
-		case OP_SREF_ALT: // address
-			// [ [address] ] = ALT
-			as.mov(edx, dword_ptr_abs(reinterpret_cast<void*>(GetAmxData() + instr.GetOperand())));
-			as.mov(dword_ptr(edx, reinterpret_cast<sysint_t>(GetAmxData())), ecx);
+		case OP_BOUNDS:
+			if (!pri.Is(LoopTerm::INDEX)) {
+				return false;
+			}
+			max_index = std::min(max_index, instr.GetOperand());
 			break;
-		case OP_SREF_S_PRI: // offset
-			// [ [FRM + offset] ] = PRI
-			as.mov(edx, dword_ptr(ebp, instr.GetOperand()));
-			as.mov(dword_ptr(edx, reinterpret_cast<sysint_t>(GetAmxData())), eax);
+		case OP_IDXADDR:
+		case OP_LIDX: {
+			LoopOperand array;
+			if (!pri.Is(LoopTerm::INDEX) || !GetArray(alt, array)) {
+				return false;
+			}
+			if (instr.GetOpcode() == OP_LIDX) {
+				pri = LoopTerm(LoopTerm::ELEM, array);
+				array_reads.push_back(array);
+			} else {
+				pri = LoopTerm(LoopTerm::ELEM_ADDR, array);
+			}
 			break;
-		case OP_SREF_S_ALT: // offset
-			// [ [FRM + offset] ] = ALT
-			as.mov(edx, dword_ptr(ebp, instr.GetOperand()));
-			as.mov(dword_ptr(edx, reinterpret_cast<sysint_t>(GetAmxData())), ecx);
+		}
+		case OP_LOAD_I:
+			if (!pri.Is(LoopTerm::ELEM_ADDR)) {
+				return false;
+			}
+			pri = LoopTerm(LoopTerm::ELEM, pri.lhs.operand);
+			array_reads.push_back(pri.lhs.operand);
 			break;
 		case OP_STOR_I:
-			// [ALT] = PRI (full cell)
-			as.mov(dword_ptr(ecx, reinterpret_cast<sysint_t>(GetAmxData())), eax);
+			if (!alt.Is(LoopTerm::ELEM_ADDR)) {
+				return false;
+			}
+			effects.push_back(LoopEffect(LoopEffect::STORE_ELEM, alt.lhs.operand, pri, guarded));
 			break;
-		case OP_STRB_I: // number
-			// "number" bytes at [ALT] = PRI (write 1/2/4 bytes)
-			switch (instr.GetOperand()) {
-			case 1:
-				as.xor_(ecx, ecx);
-				as.mov(byte_ptr(ecx, reinterpret_cast<sysint_t>(GetAmxData())), al);
-			case 2:
-				as.xor_(ecx, ecx);
-				as.mov(word_ptr(ecx, reinterpret_cast<sysint_t>(GetAmxData())), ax);
-			default:
-				as.mov(dword_ptr(ecx, reinterpret_cast<sysint_t>(GetAmxData())), eax);
+		case OP_STOR_PRI:
+			return Store(LoopEffect::STORE_SCALAR, global, pri);
+		case OP_STOR_ALT:
+			return Store(LoopEffect::STORE_SCALAR, global, alt);
+		case OP_STOR_S_PRI:
+			return Store(LoopEffect::STORE_SCALAR, local, pri);
+		case OP_STOR_S_ALT:
+			return Store(LoopEffect::STORE_SCALAR, local, alt);
+		case OP_INC:
+			return Store(LoopEffect::INC_SCALAR, global, LoopValue());
+		case OP_INC_S:
+			return Store(LoopEffect::INC_SCALAR, local, LoopValue());
+		case OP_ADD:
+			if (pri.kind != LoopValue::TERM || alt.kind != LoopValue::TERM) {
+				return false;
 			}
+			pri = LoopValue(LoopValue::SUM, COND_EQ, pri.lhs, alt.lhs);
 			break;
-		case OP_LIDX:
-			// PRI = [ ALT + (PRI x cell size) ]
-			as.mov(eax, dword_ptr(ecx, eax, 2, reinterpret_cast<sysint_t>(GetAmxData())));
-			break;
-		case OP_LIDX_B: // shift
-			// PRI = [ ALT + (PRI << shift) ]
-			as.mov(eax, dword_ptr(ecx, eax, instr.GetOperand(), reinterpret_cast<sysint_t>(GetAmxData())));
-			break;
-		case OP_IDXADDR:
-			// PRI = ALT + (PRI x cell size) (calculate indexed address)
-			as.lea(eax, dword_ptr(ecx, eax, 2));
-			break;
-		case OP_IDXADDR_B: // shift
-			// PRI = ALT + (PRI << shift) (calculate indexed address)
-			as.lea(eax, dword_ptr(ecx, eax, instr.GetOperand()));
-			break;
-		case OP_ALIGN_PRI: // number
-			// Little Endian: PRI ^= cell size - number
-			as.xor_(eax, sizeof(cell) - instr.GetOperand());
-			break;
-		case OP_ALIGN_ALT: // number
-			// Little Endian: ALT ^= cell size - number
-			as.xor_(ecx, sizeof(cell) - instr.GetOperand());
-			break;
-		case OP_LCTRL: // index
-			// PRI is set to the current value of any of the special registers.
-			// The index parameter must be: 0=COD, 1=DAT, 2=HEA,
-			// 3=STP, 4=STK, 5=FRM, 6=CIP (of the next instruction)
-			switch (instr.GetOperand()) {
-			case 0:
-				as.mov(eax, dword_ptr_abs(reinterpret_cast<void*>(&GetAmxHeader()->cod)));
-				break;
-			case 1:
-				as.mov(eax, dword_ptr_abs(reinterpret_cast<void*>(&GetAmxHeader()->dat)));
-				break;
-			case 2:
-				as.mov(eax, dword_ptr_abs(reinterpret_cast<void*>(&GetAmx()->hea)));
-				break;
-			case 4:
-				as.lea(eax, dword_ptr(esp, -reinterpret_cast<sysint_t>(GetAmxData())));
-				break;
-			case 5:
-				as.lea(eax, dword_ptr(ebp, -reinterpret_cast<sysint_t>(GetAmxData())));
-				break;
-			case 6: {
-				if (instr_iterator == instrs.end() - 1) {
-					// Can't get address of next instruction since this one is the last.
-					throw InvalidInstructionError(instr);
-				}
-				AmxInstruction &next_instr = *(instr_iterator + 1);
-				as.mov(eax, reinterpret_cast<sysint_t>(next_instr.GetIP()) 
-				            - reinterpret_cast<sysint_t>(GetAmxCode()));
-				break;
-			}
-			default:
-				throw UnsupportedInstructionError(instr);
+		case OP_EQ:
+			return Compare(COND_EQ, pri, alt);
+		case OP_NEQ:
+			return Compare(COND_NE, pri, alt);
+		case OP_SLESS:
+			return Compare(COND_LT, pri, alt);
+		case OP_SLEQ:
+			return Compare(COND_LE, pri, alt);
+		case OP_SGRTR:
+			return Compare(COND_GT, pri, alt);
+		case OP_SGEQ:
+			return Compare(COND_GE, pri, alt);
+		case OP_EQ_C_PRI:
+			return Compare(COND_EQ, pri, constant);
+		case OP_EQ_C_ALT:
+			return Compare(COND_EQ, alt, constant);
+		default:
+			return false;
+	}
+	return true;
+}
+
+bool LoopEvaluator::GetBranchCondition(const AmxInstruction &instr, LoopValue &cond) const {
+	Condition c;
+	switch (instr.GetOpcode()) {
+		case OP_JZER:
+		case OP_JNZ:
+			if (pri.kind == LoopValue::COMPARE) {
+				cond = pri;
+			} else if (pri.kind == LoopValue::TERM) {
+				cond = LoopValue(LoopValue::COMPARE, COND_NE, pri.lhs, 
+				                 LoopTerm(LoopTerm::CONSTANT, LoopOperand(LoopOperand::CONSTANT, 0)));
+			} else {
+				return false;
 			}
-			break;
-		case OP_SCTRL: // index
-			// set the indexed special registers to the value in PRI.
-			// The index parameter must be: 2=HEA, 4=STK, 5=FRM,
-			// 6=CIP
-			switch (instr.GetOperand()) {
-			case 2:
-				as.mov(dword_ptr_abs(reinterpret_cast<void*>(&amx_->hea)), eax);
-				break;
-			case 4:
-				as.lea(esp, dword_ptr(eax, reinterpret_cast<sysint_t>(GetAmxData())));
-				break;
-			case 5:
-				as.lea(ebp, dword_ptr(eax, reinterpret_cast<sysint_t>(GetAmxData())));
-				break;
-			case 6:
-				as.push(esp);
-				as.push(eax);
-				as.push(reinterpret_cast<sysint_t>(this));
-				as.call(reinterpret_cast<void*>(::Jump));
-				// Didn't jump because of invalid address - exit with error.
-				halt(as, AMX_ERR_INVINSTR);
-				break;
-			default:
-				throw UnsupportedInstructionError(instr);
+			if (instr.GetOpcode() == OP_JZER) {
+				cond.cond = Negate(cond.cond);
 			}
+			return true;
+		case OP_JEQ:
+			c = COND_EQ;
 			break;
-		case OP_MOVE_PRI:
-			// PRI = ALT
-			as.mov(eax, ecx);
-			break;
-		case OP_MOVE_ALT:
-			// ALT = PRI
-			as.mov(ecx, eax);
-			break;
-		case OP_XCHG:
-			// Exchange PRI and_ ALT
-			as.xchg(eax, ecx);
-			break;
-		case OP_PUSH_PRI:
-			// [STK] = PRI, STK = STK - cell size
-			as.push(eax);
-			break;
-		case OP_PUSH_ALT:
-			// [STK] = ALT, STK = STK - cell size
-			as.push(ecx);
-			break;
-		case OP_PUSH_C: // value
-			// [STK] = value, STK = STK - cell size
-			as.push(instr.GetOperand());
-			break;
-		case OP_PUSH: // address
-			// [STK] = [address], STK = STK - cell size
-			as.push(dword_ptr_abs(reinterpret_cast<void*>(instr.GetOperand() + GetAmxData())));
-			break;
-		case OP_PUSH_S: // offset
-			// [STK] = [FRM + offset], STK = STK - cell size
-			as.push(dword_ptr(ebp, instr.GetOperand()));
-			break;
-		case OP_POP_PRI:
-			// STK = STK + cell size, PRI = [STK]
-			as.pop(eax);
-			break;
-		case OP_POP_ALT:
-			// STK = STK + cell size, ALT = [STK]
-			as.pop(ecx);
-			break;
-		case OP_STACK: // value
-			// ALT = STK, STK = STK + value
-			as.lea(ecx, dword_ptr(esp, -reinterpret_cast<sysint_t>(GetAmxData())));
-			as.add(esp, instr.GetOperand());
-			break;
-		case OP_HEAP: // value
-			// ALT = HEA, HEA = HEA + value
-			as.mov(ecx, dword_ptr_abs(reinterpret_cast<void*>(&amx_->hea)));
-			as.add(dword_ptr_abs(reinterpret_cast<void*>(&amx_->hea)), instr.GetOperand());
-			break;
-		case OP_PROC:
-			// [STK] = FRM, STK = STK - cell size, FRM = STK
-			as.push(ebp);
-			as.mov(ebp, esp);
+		case OP_JNEQ:
+			c = COND_NE;
 			break;
-		case OP_RET:
-			// STK = STK + cell size, FRM = [STK],
-			// CIP = [STK], STK = STK + cell size
-			as.pop(ebp);
-			as.ret();
+		case OP_JSLESS:
+			c = COND_LT;
 			break;
-		case OP_RETN:
-			// FRM = [STK], STK = STK + cell size,
-			// CIP = [STK], STK = STK + cell size,
-			// STK = STK + [STK]
-			// The RETN instruction removes a specified number of bytes
-			// from the stack. The value to adjust STK with must be
-			// pushed prior to the call.
-			as.pop(ebp);
-			as.ret();
+		case OP_JSLEQ:
+			c = COND_LE;
 			break;
-		case OP_CALL: { // offset
-			// [STK] = CIP + 5, STK = STK - cell size
-			// CIP = CIP + offset
-			// The CALL instruction jumps to an address after storing the
-			// address of the next sequential instruction on the stack.
-			// The address jumped to is relative to the current CIP,
-			// but the address on the stack is an absolute address.
-			cell fn_addr = instr.GetOperand() - reinterpret_cast<cell>(GetAmxCode());
-			as.call(Label(as, label_map.get(), fn_addr));
-			as.add(esp, dword_ptr(esp));
-			as.add(esp, 4);
+		case OP_JSGRTR:
+			c = COND_GT;
 			break;
-		}
-		case OP_CALL_PRI:
-			// Same as CALL, the address to jump to is in PRI.
-			as.call(eax);
-			as.add(esp, dword_ptr(esp));
-			as.add(esp, 4);
+		case OP_JSGEQ:
+			c = COND_GE;
 			break;
+		default:
+			return false;
+	}
+	if (pri.kind != LoopValue::TERM || alt.kind != LoopValue::TERM) {
+		return false;
+	}
+	cond = LoopValue(LoopValue::COMPARE, c, pri.lhs, alt.lhs);
+	return true;
+}
 
-		case OP_JUMP:
-		case OP_JUMP_PRI:
-		case OP_JZER: 
+inline bool IsConditionalJump(AmxOpcode opcode) {
+	switch (opcode) {
+		case OP_JZER:
 		case OP_JNZ:
 		case OP_JEQ:
 		case OP_JNEQ:
@@ -497,91 +630,1285 @@ void Jitter::Compile(std::FILE *list_stream) {
 		case OP_JSLESS:
 		case OP_JSLEQ:
 		case OP_JSGRTR:
-		case OP_JSGEQ: {
-			cell dest = instr.GetOperand() - reinterpret_cast<cell>(GetAmxCode());
-			AsmJit::Label &L_dest = Label(as, label_map.get(), dest);
-
-			switch (instr.GetOpcode()) {
-				case OP_JUMP: // offset
-					// CIP = CIP + offset (jump to the address relative from
-					// the current position)
-					as.jmp(L_dest);
-					break;
-				case OP_JUMP_PRI:
-					// CIP = PRI (indirect jump)
-					as.push(esp);
-					as.push(eax);
-					as.push(reinterpret_cast<sysint_t>(this));
-					as.call(reinterpret_cast<void*>(::Jump));
-					// Didn't jump because of invalid address - exit with error.
-					halt(as, AMX_ERR_INVINSTR);
-					break;
-				case OP_JZER: // offset
-					// if PRI == 0 then CIP = CIP + offset
-					as.cmp(eax, 0);
-					as.jz(L_dest);
-					break;
-				case OP_JNZ: // offset
-					// if PRI != 0 then CIP = CIP + offset
-					as.cmp(eax, 0);
-					as.jnz(L_dest);
-					break;
-				case OP_JEQ: // offset
-					// if PRI == ALT then CIP = CIP + offset
-					as.cmp(eax, ecx);
-					as.je(L_dest);
-					break;
-				case OP_JNEQ: // offset
-					// if PRI != ALT then CIP = CIP + offset
-					as.cmp(eax, ecx);
-					as.jne(L_dest);
-					break;
-				case OP_JLESS: // offset
-					// if PRI < ALT then CIP = CIP + offset (unsigned)
-					as.cmp(eax, ecx);
-					as.jb(L_dest);
-					break;
-				case OP_JLEQ: // offset
-					// if PRI <= ALT then CIP = CIP + offset (unsigned)
-					as.cmp(eax, ecx);
-					as.jbe(L_dest);
-					break;
-				case OP_JGRTR: // offset
-					// if PRI > ALT then CIP = CIP + offset (unsigned)
-					as.cmp(eax, ecx);
-					as.ja(L_dest);
-					break;
-				case OP_JGEQ: // offset
-					// if PRI >= ALT then CIP = CIP + offset (unsigned)
-					as.cmp(eax, ecx);
-					as.jae(L_dest);
-					break;
-				case OP_JSLESS: // offset
-					// if PRI < ALT then CIP = CIP + offset (signed)
-					as.cmp(eax, ecx);
-					as.jl(L_dest);
-					break;
-				case OP_JSLEQ: // offset
-					// if PRI <= ALT then CIP = CIP + offset (signed)
-					as.cmp(eax, ecx);
-					as.jle(L_dest);
-					break;
-				case OP_JSGRTR: // offset
-					// if PRI > ALT then CIP = CIP + offset (signed)
-					as.cmp(eax, ecx);
-					as.jg(L_dest);
-					break;
-				case OP_JSGEQ: // offset
-					// if PRI >= ALT then CIP = CIP + offset (signed)
-					as.cmp(eax, ecx);
-					as.jge(L_dest);
-					break;
-			}
-			break;
-		}
+		case OP_JSGEQ:
+			return true;
+		default:
+			return false;
+	}
+}
 
-		case OP_SHL:
-			// PRI = PRI << ALT
+// Checks if execution may continue at the next instruction.
+inline bool CanFallThrough(AmxOpcode opcode) {
+	switch (opcode) {
+		case OP_JUMP:
+		case OP_JUMP_PRI:
+		case OP_RET:
+		case OP_RETN:
+		case OP_SWITCH:
+		case OP_CASETBL:
+		case OP_HALT:
+			return false;
+		default:
+			return true;
+	}
+}
+
+// Gets the condition of a conditional jump, for comparing PRI with 0 (JZER
+// and JNZ) or with ALT.
+inline AsmJit::CONDITION GetJumpCondition(AmxOpcode opcode) {
+	switch (opcode) {
+		case OP_JZER:   return AsmJit::C_Z;
+		case OP_JNZ:    return AsmJit::C_NZ;
+		case OP_JEQ:    return AsmJit::C_E;
+		case OP_JNEQ:   return AsmJit::C_NE;
+		case OP_JLESS:  return AsmJit::C_B;
+		case OP_JLEQ:   return AsmJit::C_BE;
+		case OP_JGRTR:  return AsmJit::C_A;
+		case OP_JGEQ:   return AsmJit::C_AE;
+		case OP_JSLESS: return AsmJit::C_L;
+		case OP_JSLEQ:  return AsmJit::C_LE;
+		case OP_JSGRTR: return AsmJit::C_G;
+		case OP_JSGEQ:  return AsmJit::C_GE;
+		default:        return AsmJit::C_NO_CONDITION;
+	}
+}
+
+// Checks if a conditional jump is taken for the given PRI and ALT.
+inline bool IsJumpTaken(AmxOpcode opcode, cell pri, cell alt) {
+	ucell upri = static_cast<ucell>(pri);
+	ucell ualt = static_cast<ucell>(alt);
+	switch (opcode) {
+		case OP_JZER:   return pri == 0;
+		case OP_JNZ:    return pri != 0;
+		case OP_JEQ:    return pri == alt;
+		case OP_JNEQ:   return pri != alt;
+		case OP_JLESS:  return upri < ualt;
+		case OP_JLEQ:   return upri <= ualt;
+		case OP_JGRTR:  return upri > ualt;
+		case OP_JGEQ:   return upri >= ualt;
+		case OP_JSLESS: return pri < alt;
+		case OP_JSLEQ:  return pri <= alt;
+		case OP_JSGRTR: return pri > alt;
+		case OP_JSGEQ:  return pri >= alt;
+		default:        return false;
+	}
+}
+
+// Checks if an instruction may write to the data section or call code that
+// does, so that speculated code must check whether to stop afterwards.
+inline bool MayInvalidate(AmxOpcode opcode) {
+	switch (opcode) {
+		case OP_STOR_PRI:
+		case OP_STOR_ALT:
+		case OP_ZERO:
+		case OP_INC:
+		case OP_DEC:
+		case OP_STOR_I:
+		case OP_STRB_I:
+		case OP_SREF_PRI:
+		case OP_SREF_ALT:
+		case OP_SREF_S_PRI:
+		case OP_SREF_S_ALT:
+		case OP_MOVS:
+		case OP_FILL:
+		case OP_CALL:
+		case OP_CALL_PRI:
+		case OP_SYSREQ_PRI:
+		case OP_SYSREQ_C:
+		case OP_SYSREQ_D:
+			return true;
+		default:
+			return false;
+	}
+}
+
+// Checks if a native is known to never write to AMX memory or call back 
+// into the script.
+inline bool IsReadOnlyNative(const std::string &name) {
+	static const char *natives[] = {
+		"float", "floatabs", "floatadd", "floatsub", "floatmul", "floatdiv",
+		"floatsqroot", "floatlog", "floatpower", "floatround", "floatcmp",
+		"floatfract", "floatsin", "floatcos", "floattan", "strlen", "strcmp",
+		"strfind", "strval", "ispacked", "min", "max", "clamp", "random",
+		"tickcount", "GetTickCount"
+	};
+	for (std::size_t i = 0; i < sizeof(natives) / sizeof(natives[0]); i++) {
+		if (name == natives[i]) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// Checks if a native's result depends only on its arguments, which are
+// passed by value.
+inline bool IsPureNative(const std::string &name) {
+	static const char *natives[] = {
+		"float", "floatabs", "floatadd", "floatsub", "floatmul", "floatdiv",
+		"floatsqroot", "floatlog", "floatpower", "floatround", "floatcmp",
+		"floatfract", "floatsin", "floatcos", "floattan", "min", "max", "clamp"
+	};
+	for (std::size_t i = 0; i < sizeof(natives) / sizeof(natives[0]); i++) {
+		if (name == natives[i]) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// Orders (count, address) pairs by count, highest first.
+struct MoreFrequentFirst {
+	bool operator()(const std::pair<std::size_t, cell> &left, 
+	                const std::pair<std::size_t, cell> &right) const {
+		return left.first > right.first || (left.first == right.first && left.second < right.second);
+	}
+};
+
+// Mixes a cell into an FNV-1a hash.
+inline uint32_t HashCell(uint32_t hash, cell value) {
+	for (std::size_t i = 0; i < sizeof(cell); i++) {
+		hash ^= static_cast<unsigned char>(value >> (i * 8));
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+// Computes the FNV-1a hash of a string.
+inline uint32_t HashString(const char *s) {
+	uint32_t hash = 2166136261u;
+	for (; *s != '\0'; s++) {
+		hash ^= static_cast<unsigned char>(*s);
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+// Joins chain "b" to chain "a" so that function "u" from "a" and function "v"
+// from "b" end up as close to each other as possible. "b" may be reversed.
+void MergeChains(std::vector<std::size_t> &a, const std::vector<std::size_t> &b, 
+                 std::size_t u, std::size_t v) {
+	std::size_t pos_u = std::find(a.begin(), a.end(), u) - a.begin();
+	std::size_t pos_v = std::find(b.begin(), b.end(), v) - b.begin();
+
+	// Distance between u and v for: a + b, a + reversed b, b + a and
+	// reversed b + a.
+	std::size_t distance[4] = {
+		(a.size() - pos_u) + pos_v,
+		(a.size() - pos_u) + (b.size() - 1 - pos_v),
+		(b.size() - pos_v) + pos_u,
+		(pos_v + 1) + pos_u
+	};
+	int best = 0;
+	for (int i = 1; i < 4; i++) {
+		if (distance[i] < distance[best]) {
+			best = i;
+		}
+	}
+
+	std::vector<std::size_t> other(b);
+	if (best == 1 || best == 3) {
+		std::reverse(other.begin(), other.end());
+	}
+	if (best < 2) {
+		a.insert(a.end(), other.begin(), other.end());
+	} else {
+		a.insert(a.begin(), other.begin(), other.end());
+	}
+}
+
+// Orders (weight, index) pairs by weight, heaviest first.
+struct HeavierFirst {
+	template<typename T>
+	bool operator()(const std::pair<uint64_t, T> &left, 
+	                const std::pair<uint64_t, T> &right) const {
+		return left.first > right.first;
+	}
+};
+
+// Assembler that can tell where a label is bound.
+class LabelOffsetAssembler : public AsmJit::Assembler {
+public:
+	sysint_t GetLabelOffset(const AsmJit::Label &label) const {
+		return _labelData[label.getId() & AsmJit::OPERAND_ID_VALUE_MASK].offset;
+	}
+};
+
+// Logger that collects output in a string.
+class StringLogger : public AsmJit::Logger {
+public:
+	StringLogger() {
+		_used = true;
+	}
+
+	virtual void logString(const char *buf, sysuint_t len = static_cast<sysuint_t>(-1)) ASMJIT_NOTHROW {
+		if (len == static_cast<sysuint_t>(-1)) {
+			len = std::strlen(buf);
+		}
+		string_.append(buf, len);
+	}
+
+	const std::string &GetString() const {
+		return string_;
+	}
+
+private:
+	std::string string_;
+};
+
+// Checks if a variable lies within the first "count" cells of an array.
+inline bool IsInArray(const LoopOperand &var, const LoopOperand &array, cell count) {
+	return var.type == array.type 
+	    && var.value >= array.value 
+	    && var.value < array.value + count * static_cast<cell>(sizeof(cell));
+}
+
+// An invariant operand: a constant or a variable.
+inline bool GetInvariant(const LoopTerm &term, LoopOperand &operand) {
+	if (term.kind == LoopTerm::CONSTANT || term.kind == LoopTerm::SCALAR) {
+		operand = term.operand;
+		return true;
+	}
+	return false;
+}
+
+} // anonymous namespace
+
+TargetFeatures TargetFeatures::GetHostFeatures() {
+	static const struct {
+		uint32_t cpu_feature;
+		Feature feature;
+	} features[] = {
+		{AsmJit::CPU_FEATURE_CMOV,   CMOV},
+		{AsmJit::CPU_FEATURE_SSE,    SSE},
+		{AsmJit::CPU_FEATURE_SSE2,   SSE2},
+		{AsmJit::CPU_FEATURE_SSE3,   SSE3},
+		{AsmJit::CPU_FEATURE_SSSE3,  SSSE3},
+		{AsmJit::CPU_FEATURE_SSE4_1, SSE41},
+		{AsmJit::CPU_FEATURE_SSE4_2, SSE42},
+		{AsmJit::CPU_FEATURE_POPCNT, POPCNT},
+		{AsmJit::CPU_FEATURE_LZCNT,  LZCNT},
+		{AsmJit::CPU_FEATURE_AVX,    AVX}
+	};
+	uint32_t cpu_features = AsmJit::getCpuInfo()->features;
+	int flags = 0;
+	for (std::size_t i = 0; i < sizeof(features) / sizeof(features[0]); i++) {
+		if ((cpu_features & features[i].cpu_feature) != 0) {
+			flags |= features[i].feature;
+		}
+	}
+	return TargetFeatures(flags);
+}
+
+bool TargetFeatures::GetBaselineFeatures(const std::string &name, TargetFeatures &features) {
+	// Each level includes all previous ones.
+	static const char *levels[] = {
+		"i386", "i686", "sse", "sse2", "sse3", "ssse3", "sse4.1", "sse4.2", "avx"
+	};
+	static const int level_features[] = {
+		0, CMOV, SSE, SSE2, SSE3, SSSE3, SSE41, SSE42 | POPCNT, AVX
+	};
+	int flags = 0;
+	for (std::size_t i = 0; i < sizeof(levels) / sizeof(levels[0]); i++) {
+		flags |= level_features[i];
+		if (name == levels[i]) {
+			features = TargetFeatures(flags);
+			return true;
+		}
+	}
+	return false;
+}
+
+std::string TargetFeatures::GetNames() const {
+	static const char *names[] = {
+		"cmov", "sse", "sse2", "sse3", "ssse3", "sse4.1", "sse4.2", "popcnt", "lzcnt", "avx"
+	};
+	std::string result;
+	for (std::size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+		if ((features_ & (1 << i)) != 0) {
+			if (!result.empty()) {
+				result.append(" ");
+			}
+			result.append(names[i]);
+		}
+	}
+	return result;
+}
+
+#define OVERRIDE_NATIVE(name) \
+	do { native_overrides_[#name] = &Jitter::native_##name; } while (false);
+
+Jitter::Jitter(AMX *amx, cell *opcode_list) 
+	: amx_(amx)
+	, opcode_list_(opcode_list)
+	, halt_esp_(0)
+	, halt_ebp_(0)
+	, code_(0)
+	, code_map_(0)
+	, label_map_(0)
+	, entry_(0)
+	, has_profile_(false)
+	, profiling_(false)
+	, speculated_min_(0)
+	, speculated_max_(0)
+	, speculative_(false)
+	, deoptimized_(0)
+	, speculation_rounds_(0)
+	, active_calls_(0)
+	, clone_(0)
+	, script_kind_(SCRIPT_UNKNOWN)
+	, serial_(0)
+{
+	BuildNameTable(public_names_, false);
+	BuildNameTable(native_names_, true);
+
+	// Compiled code may call publics through their entries, so these must
+	// stay where they are.
+	AMX_HEADER *hdr = GetAmxHeader();
+	public_entries_.resize((hdr->natives - hdr->publics) / hdr->defsize, 0);
+
+	// Register native overrides
+	OVERRIDE_NATIVE(float);
+	OVERRIDE_NATIVE(floatabs);
+	OVERRIDE_NATIVE(floatadd);
+	OVERRIDE_NATIVE(floatsub);
+	OVERRIDE_NATIVE(floatmul);
+	OVERRIDE_NATIVE(floatdiv);
+	OVERRIDE_NATIVE(floatsqroot);
+	OVERRIDE_NATIVE(floatlog);
+	OVERRIDE_NATIVE(strlen);
+	OVERRIDE_NATIVE(strcmp);
+	OVERRIDE_NATIVE(strfind);
+	OVERRIDE_NATIVE(strcat);
+	OVERRIDE_NATIVE(strmid);
+	OVERRIDE_NATIVE(format);
+	OVERRIDE_NATIVE(funcidx);
+	OVERRIDE_NATIVE(CallLocalFunction);
+	OVERRIDE_NATIVE(CallRemoteFunction);
+
+	AsmJit::AutoLock lock(instances_lock_);
+	serial_ = ++next_serial_;
+	instances_version_++;
+	instances_.push_back(this);
+	remote_cache_.clear();
+}
+
+void Jitter::SetScriptKind(ScriptKind kind) {
+	AsmJit::AutoLock lock(instances_lock_);
+	script_kind_ = kind;
+	remote_cache_.clear();
+}
+
+void Jitter::Compile(std::FILE *list_stream) {
+	std::vector<AmxInstruction> instrs;
+	ParseCode(0, GetAmxHeader()->dat - GetAmxHeader()->cod, instrs);
+	AnalyzeCode(instrs);
+	LayoutCode(instrs);
+	SelectClones(instrs);
+	SelectMemoized(instrs);
+	FindConstantPublics(instrs);
+
+	if (profiling_ || tracing_) {
+		// Counters are allocated before any code refers to them. Traces only
+		// need the branch counters.
+		counters_.clear();
+		block_counters_.clear();
+		call_counters_.clear();
+		branch_counters_.clear();
+		for (std::size_t i = 0; i < instrs.size(); i++) {
+			cell cip = GetInstrAddress(instrs[i]);
+			if (profiling_ && blocks_.find(cip) != blocks_.end()) {
+				block_counters_.insert(std::make_pair(cip, counters_.size()));
+				counters_.push_back(0);
+			}
+			if (profiling_ && instrs[i].GetOpcode() == OP_CALL) {
+				cell callee = instrs[i].GetOperand() - reinterpret_cast<cell>(GetAmxCode());
+				call_counters_.insert(std::make_pair(cip, std::make_pair(callee, counters_.size())));
+				counters_.push_back(0);
+			} else if (IsConditionalJump(instrs[i].GetOpcode())) {
+				if (!profiling_) {
+					std::vector<cell> loops;
+					GetEnclosingLoops(cip, loops);
+					if (loops.empty()) {
+						continue;
+					}
+				}
+				branch_counters_.insert(std::make_pair(cip, counters_.size()));
+				counters_.push_back(0);
+				counters_.push_back(0);
+			}
+		}
+	}
+
+	if (tracing_) {
+		trace_countdowns_.clear();
+		trace_slots_.clear();
+		trace_counters_.clear();
+		for (std::set<cell>::const_iterator it = loop_headers_.begin(); 
+				it != loop_headers_.end(); ++it) {
+			trace_counters_.insert(std::make_pair(*it, trace_countdowns_.size()));
+			trace_countdowns_.push_back(kTraceThreshold);
+			trace_slots_.push_back(0);
+		}
+
+		loop_branches_.assign(trace_countdowns_.size(), std::vector<std::size_t>());
+		branch_loops_left_.clear();
+		branch_count_sites_.clear();
+		if (!profiling_) {
+			for (std::map<cell, std::size_t>::const_iterator it = branch_counters_.begin(); 
+					it != branch_counters_.end(); ++it) {
+				std::vector<cell> loops;
+				GetEnclosingLoops(it->first, loops);
+				for (std::size_t i = 0; i < loops.size(); i++) {
+					loop_branches_[trace_counters_[loops[i]]].push_back(it->second);
+				}
+				branch_loops_left_[it->second] = static_cast<int>(loops.size());
+			}
+		}
+	}
+
+	if (entry_ == 0) {
+		AsmJit::Assembler as;
+		entry_thunk(as);
+		entry_ = as.make();
+	}
+	if (broadcast_ == 0) {
+		AsmJit::Assembler as;
+		broadcast_thunk(as);
+		broadcast_ = as.make();
+	}
+
+	inverted_branches_.clear();
+	Assemble(instrs, list_stream, generic_code_);
+	UseCode(generic_code_);
+}
+
+void Jitter::Assemble(std::vector<AmxInstruction> &instrs, std::FILE *list_stream, 
+                      CompiledCode &result) 
+{
+	// Forward branches are emitted before their targets are known, so the
+	// code is generated twice: first with all branches being long (and with
+	// maximum alignment padding) to find out which of them can be short, then
+	// for real.
+	short_branches_.clear();
+	{
+		LabelOffsetAssembler as;
+		CodeMap code_map;
+		LabelMap label_map;
+		EmitCode(as, instrs, &code_map, &label_map, true);
+
+		for (std::size_t i = 0; i < branches_.size(); i++) {
+			sysint_t start = branches_[i].first;
+			sysint_t target = as.GetLabelOffset(branches_[i].second);
+			// Code between the branch and its target can only shrink.
+			short_branches_.push_back(target > start && target - (start + 2) <= 127);
+		}
+	}
+
+	LabelOffsetAssembler as;
+	StringLogger logger;
+	if (list_stream != 0) {
+		as.setLogger(&logger);
+	}
+
+	std::auto_ptr<CodeMap> code_map(new CodeMap);
+	std::auto_ptr<LabelMap> label_map(new LabelMap);
+	EmitCode(as, instrs, code_map.get(), label_map.get(), false);
+
+	void *code = as.make();
+
+	if (list_stream != 0) {
+		std::fprintf(list_stream, "; Target features: %s\n", GetTargetFeatures().GetNames().c_str());
+		if (has_profile_) {
+			std::fprintf(list_stream, "; Code laid out using profile %08x\n", profile_.GetHash());
+		}
+		if (!clones_.empty()) {
+			std::fprintf(list_stream, "; %d functions cloned for constant arguments\n", 
+				static_cast<int>(clones_.size()));
+		}
+		for (std::size_t i = 0; i < memos_.size(); i++) {
+			std::fprintf(list_stream, "; Function %08x is memoized\n", memos_[i].function);
+		}
+		for (std::size_t i = 0; i < constant_publics_.size(); i++) {
+			if (constant_publics_[i].first) {
+				std::fprintf(list_stream, "; Public %s always returns %d\n", 
+					GetPublicName(amx_, i), constant_publics_[i].second);
+			}
+		}
+		sysint_t size = as.getCodeSize();
+		sysint_t long_size = size + short_branch_savings_;
+		std::fprintf(list_stream, "; Code size: %ld bytes (%ld bytes without short branches, %.1f%% saved)\n\n", 
+			static_cast<long>(size), static_cast<long>(long_size),
+			long_size > 0 ? 100.0 * short_branch_savings_ / long_size : 0.0);
+		std::fwrite(logger.GetString().data(), 1, logger.GetString().size(), list_stream);
+	}
+
+	AddCodeRange(code, as.getCodeSize());
+	KeepFormatPlans(code);
+	KeepBranchCountSites(code);
+	result.code = code;
+	result.code_map = code_map.release();
+	result.label_map = label_map.release();
+}
+
+void Jitter::UseCode(const CompiledCode &code) {
+	code_ = code.code;
+	code_map_ = code.code_map;
+	label_map_ = code.label_map;
+
+	for (std::size_t i = 0; i < public_entries_.size(); i++) {
+		cell address = GetPublicAddress(amx_, i);
+		public_entries_[i] = address != 0 ? GetInstrPtr(address, code_) : 0;
+	}
+}
+
+void Jitter::FreeCode(CompiledCode &code) {
+	if (code.code != 0) {
+		CodeRanges::iterator range = code_ranges_.find(reinterpret_cast<const char*>(code.code));
+		if (range != code_ranges_.end()) {
+			typedef std::multimap<std::size_t, std::pair<char*, sysint_t> >::iterator SiteIterator;
+			for (SiteIterator it = branch_count_sites_.begin(); it != branch_count_sites_.end(); ) {
+				if (it->second.first >= range->first && it->second.first < range->second) {
+					branch_count_sites_.erase(it++);
+				} else {
+					++it;
+				}
+			}
+			code_ranges_.erase(range);
+		}
+		format_plans_.erase(code.code);
+		AsmJit::MemoryManager::getGlobal()->free(code.code);
+	}
+	delete code.code_map;
+	delete code.label_map;
+	code = CompiledCode();
+}
+
+void Jitter::AddCodeRange(const void *code, std::size_t size) {
+	if (code != 0) {
+		const char *start = reinterpret_cast<const char*>(code);
+		code_ranges_[start] = start + size;
+	}
+}
+
+void Jitter::KeepFormatPlans(const void *code) {
+	if (code != 0 && !new_format_plans_.empty()) {
+		std::list<FormatPlan> &plans = format_plans_[code];
+		plans.splice(plans.end(), new_format_plans_);
+	}
+	new_format_plans_.clear();
+}
+
+void Jitter::KeepBranchCountSites(void *code) {
+	if (code != 0) {
+		for (std::size_t i = 0; i < new_branch_count_sites_.size(); i++) {
+			const BranchCountSite &site = new_branch_count_sites_[i];
+			char *start = reinterpret_cast<char*>(code) + site.offset;
+			branch_count_sites_.insert(std::make_pair(site.counter, std::make_pair(start, site.size)));
+		}
+	}
+	new_branch_count_sites_.clear();
+}
+
+void Jitter::RetireBranchCounts(std::size_t loop) {
+	const std::vector<std::size_t> &branches = loop_branches_[loop];
+	for (std::size_t i = 0; i < branches.size(); i++) {
+		if (--branch_loops_left_[branches[i]] > 0) {
+			continue;
+		}
+		// Replace the start of the counting code with a short jump over it.
+		typedef std::multimap<std::size_t, std::pair<char*, sysint_t> >::iterator SiteIterator;
+		std::pair<SiteIterator, SiteIterator> sites = branch_count_sites_.equal_range(branches[i]);
+		for (SiteIterator it = sites.first; it != sites.second; ++it) {
+			unsigned char *start = reinterpret_cast<unsigned char*>(it->second.first);
+			start[0] = 0xEB;
+			start[1] = static_cast<unsigned char>(it->second.second - 2);
+		}
+		branch_count_sites_.erase(sites.first, sites.second);
+	}
+	loop_branches_[loop].clear();
+}
+
+bool Jitter::IsCodeAddress(const void *address) const {
+	const char *p = reinterpret_cast<const char*>(address);
+	CodeRanges::const_iterator it = code_ranges_.upper_bound(p);
+	if (it == code_ranges_.begin()) {
+		return false;
+	}
+	--it;
+	return p < it->second;
+}
+
+void Jitter::EmitCode(AsmJit::Assembler &as, std::vector<AmxInstruction> &instrs, 
+                      CodeMap *code_map, LabelMap *label_map, bool sizing,
+                      const std::vector<TraceStep> *trace) 
+{
+	// Inverted branches are not cleared: every version of the code has the
+	// same layout.
+	sizing_ = sizing;
+	new_format_plans_.clear();
+	new_branch_count_sites_.clear();
+	halt_labels_.clear();
+	deopt_labels_.clear();
+	trace_entries_.clear();
+	trace_exits_.clear();
+	branches_.clear();
+	short_branch_savings_ = 0;
+
+	// Where the previous instruction continues if it doesn't jump, or -1.
+	cell fall_through = -1;
+
+	// Values of PRI and ALT when known within a basic block.
+	bool pri_known = false;
+	bool alt_known = false;
+	cell pri_value = 0;
+	cell alt_value = 0;
+
+	// A trace loops back to its start.
+	AsmJit::Label L_trace = as.newLabel();
+	if (trace != 0) {
+		as.bind(L_trace);
+	}
+
+	// Clones follow the rest of the code, each in original order and with
+	// its own labels. Labels outside of the cloned function are shared.
+	std::vector<std::pair<std::size_t, std::size_t> > clone_order;
+	std::vector<LabelMap> clone_label_maps;
+	LabelMap *code_label_map = label_map;
+	clone_labels_.clear();
+	memo_labels_.clear();
+	clone_ = 0;
+	if (trace == 0) {
+		for (std::size_t i = 0; i < memos_.size(); i++) {
+			memo_labels_.push_back(as.newLabel());
+		}
+		for (std::size_t c = 0; c < clones_.size(); c++) {
+			clone_labels_.push_back(as.newLabel());
+			for (std::size_t i = clones_[c].begin; i < clones_[c].end; i++) {
+				clone_order.push_back(std::make_pair(c, i));
+			}
+		}
+		clone_label_maps.resize(clones_.size());
+	}
+
+	std::size_t length = trace != 0 ? trace->size() : layout_.size() + clone_order.size();
+	for (std::size_t k = 0; k < length; k++) {
+		std::size_t index;
+		if (trace != 0) {
+			index = (*trace)[k].index;
+		} else if (k < layout_.size()) {
+			index = layout_[k];
+		} else {
+			std::size_t c = clone_order[k - layout_.size()].first;
+			index = clone_order[k - layout_.size()].second;
+			if (index == clones_[c].begin) {
+				if (fall_through >= 0) {
+					branch(as, Label(as, label_map, fall_through));
+					fall_through = -1;
+				}
+				clone_ = &clones_[c];
+				cell begin = GetInstrAddress(instrs[clone_->begin]);
+				cell end = clone_->end < instrs.size() 
+				         ? GetInstrAddress(instrs[clone_->end])
+				         : std::numeric_limits<cell>::max();
+				for (LabelMap::const_iterator it = code_label_map->begin(); 
+						it != code_label_map->end(); ++it) {
+					if (it->first.GetAddress() < begin || it->first.GetAddress() >= end) {
+						clone_label_maps[c].insert(*it);
+					}
+				}
+				label_map = &clone_label_maps[c];
+				as.bind(clone_labels_[c]);
+			}
+		}
+		std::vector<AmxInstruction>::iterator instr_iterator = instrs.begin() + index;
+		AmxInstruction &instr = *instr_iterator;		
+
+		cell cip = reinterpret_cast<cell>(instr.GetIP()) 
+		         - reinterpret_cast<cell>(GetAmxCode());
+
+		// Address of the next instruction in the AMX code.
+		cell next_cip = -1;
+		if (instr_iterator + 1 != instrs.end()) {
+			next_cip = GetInstrAddress(*(instr_iterator + 1));
+		}
+
+		if (trace != 0) {
+			// The same instruction may appear more than once.
+			label_map->clear();
+
+			const TraceStep &step = (*trace)[k];
+			if (step.kind == TraceStep::TAKEN || step.kind == TraceStep::NOT_TAKEN) {
+				// Leave the trace if the jump goes the other way, unless it is
+				// known which way it goes.
+				bool uses_alt = instr.GetOpcode() != OP_JZER && instr.GetOpcode() != OP_JNZ;
+				if (pri_known && (alt_known || !uses_alt)) {
+					if (IsJumpTaken(instr.GetOpcode(), pri_value, alt_value) 
+							!= (step.kind == TraceStep::TAKEN)) {
+						branch(as, TraceLabel(as, trace_exits_, step.exit));
+					}
+					continue;
+				}
+			}
+			if (step.kind != TraceStep::NORMAL) {
+				trace_step(as, instr, step);
+				if (step.kind == TraceStep::CALL) {
+					pri_known = false;
+					alt_known = false;
+				}
+				continue;
+			}
+		} else {
+			// The previous instruction may have been moved away from its successor.
+			if (fall_through >= 0 && fall_through != cip) {
+				branch(as, Label(as, label_map, fall_through));
+			}
+			fall_through = next_cip;
+
+			if (((align_flags_ & ALIGN_FUNCTIONS) != 0 && instr.GetOpcode() == OP_PROC)
+					|| ((align_flags_ & ALIGN_LOOPS) != 0 && loop_headers_.find(cip) != loop_headers_.end())) {
+				if (sizing) {
+					// Assume the worst case so that branches can only get shorter.
+					for (int i = 0; i < align_size_ - 1; i++) {
+						as.nop();
+					}
+				} else {
+					as.align(align_size_);
+				}
+			}
+
+			as.bind(Label(as, label_map, cip));
+
+			if (clone_ == 0) {
+				code_map->insert(std::make_pair(cip, as.getCodeSize()));
+
+				std::map<cell, std::size_t>::const_iterator block_counter = block_counters_.find(cip);
+				if (block_counter != block_counters_.end()) {
+					counter(as, block_counter->second);
+				}
+
+				if (!speculative_ && trace_counters_.find(cip) != trace_counters_.end()) {
+					trace_check(as, cip);
+				}
+			}
+
+			if (blocks_.find(cip) != blocks_.end()) {
+				pri_known = false;
+				alt_known = false;
+			}
+
+			std::map<std::size_t, LoopIdiom>::const_iterator loop = loops_.find(index);
+			if (loop != loops_.end() && !MayWriteSpeculated(loop->second)) {
+				array_loop(as, loop->second);
+			}
+
+			if (speculative_) {
+				guard_write(as, instr);
+			}
+		}
+
+		// Address of the instruction emitted after this one.
+		cell next_emitted_cip = -1;
+		if (trace == 0 && k + 1 < layout_.size()) {
+			next_emitted_cip = GetInstrAddress(instrs[layout_[k + 1]]);
+		}
+
+		// Value of a speculated global or a cloned argument.
+		cell known_value = 0;
+
+		using AsmJit::byte_ptr;
+		using AsmJit::word_ptr;
+		using AsmJit::dword_ptr;
+		using AsmJit::dword_ptr_abs;
+		using AsmJit::eax;
+		using AsmJit::ecx;
+		using AsmJit::edx;
+		using AsmJit::esi;
+		using AsmJit::edi;
+		using AsmJit::ebp;
+		using AsmJit::esp;
+		using AsmJit::ax;
+		using AsmJit::al;
+		using AsmJit::cl;
+		using AsmJit::dl;
+		using AsmJit::xmm0;
+
+		switch (instr.GetOpcode()) {
+		case OP_LOAD_PRI: // address
+			// PRI = [address]
+			if (GetSpeculatedValue(instr.GetOperand(), known_value)) {
+				as.mov(eax, known_value);
+				break;
+			}
+			as.mov(eax, dword_ptr_abs(reinterpret_cast<void*>(GetAmxData() + instr.GetOperand())));
+			break;
+		case OP_LOAD_ALT: // address
+			// PRI = [address]
+			if (GetSpeculatedValue(instr.GetOperand(), known_value)) {
+				as.mov(ecx, known_value);
+				break;
+			}
+			as.mov(ecx, dword_ptr_abs(reinterpret_cast<void*>(GetAmxData() + instr.GetOperand())));
+			break;
+		case OP_LOAD_S_PRI: // offset
+			// PRI = [FRM + offset]
+			if (GetClonedArgument(instr.GetOperand(), known_value)) {
+				as.mov(eax, known_value);
+				break;
+			}
+			as.mov(eax, dword_ptr(ebp, instr.GetOperand()));
+			break;
+		case OP_LOAD_S_ALT: // offset
+			// ALT = [FRM + offset]
+			if (GetClonedArgument(instr.GetOperand(), known_value)) {
+				as.mov(ecx, known_value);
+				break;
+			}
+			as.mov(ecx, dword_ptr(ebp, instr.GetOperand()));
+			break;
+		case OP_LREF_PRI: // address
+			// PRI = [ [address] ]
+			as.mov(edx, dword_ptr_abs(reinterpret_cast<void*>(GetAmxData() + instr.GetOperand())));
+			as.mov(eax, dword_ptr(edx, reinterpret_cast<sysint_t>(GetAmxData())));
+			break;
+		case OP_LREF_ALT: // address
+			// ALT = [ [address] ]
+			as.mov(edx, dword_ptr_abs(reinterpret_cast<void*>(GetAmxData() + instr.GetOperand())));
+			as.mov(ecx, dword_ptr(edx, reinterpret_cast<sysint_t>(GetAmxData())));
+			break;
+		case OP_LREF_S_PRI: // offset
+			// PRI = [ [FRM + offset] ]
+			as.mov(edx, dword_ptr(ebp, instr.GetOperand()));
+			as.mov(eax, dword_ptr(edx, reinterpret_cast<sysint_t>(GetAmxData())));
+			break;
+		case OP_LREF_S_ALT: // offset
+			// PRI = [ [FRM + offset] ]
+			as.mov(edx, dword_ptr(ebp, instr.GetOperand()));
+			as.mov(ecx, dword_ptr(edx, reinterpret_cast<sysint_t>(GetAmxData())));
+			break;
+		case OP_LOAD_I:
+			// PRI = [PRI] (full cell)
+			as.mov(eax, dword_ptr(eax, reinterpret_cast<sysint_t>(GetAmxData())));
+			break;
+		case OP_LODB_I: // number
+			// PRI = "number" bytes from [PRI] (read 1/2/4 bytes)
+			switch (instr.GetOperand()) {
+			case 1:
+				as.xor_(eax, eax);
+				as.mov(al, byte_ptr(eax, reinterpret_cast<sysint_t>(GetAmxData())));
+			case 2:
+				as.xor_(eax, eax);
+				as.mov(ax, word_ptr(eax, reinterpret_cast<sysint_t>(GetAmxData())));
+			default:
+				as.mov(eax, dword_ptr(eax, reinterpret_cast<sysint_t>(GetAmxData())));
+			}
+			break;
+		case OP_CONST_PRI: // value
+			// PRI = value
+			as.mov(eax, instr.GetOperand());
+			break;
+		case OP_CONST_ALT: // value
+			// ALT = value
+			as.mov(ecx, instr.GetOperand());
+			break;
+		case OP_ADDR_PRI: // offset
+			// PRI = FRM + offset
+			as.lea(eax, dword_ptr(ebp, instr.GetOperand() - reinterpret_cast<sysint_t>(GetAmxData())));
+			break;
+		case OP_ADDR_ALT: // offset
+			// ALT = FRM + offset
+			as.lea(ecx, dword_ptr(ebp, instr.GetOperand() - reinterpret_cast<sysint_t>(GetAmxData())));
+			break;
+		case OP_STOR_PRI: // address
+			// [address] = PRI
+			as.mov(dword_ptr_abs(reinterpret_cast<void*>(GetAmxData() + instr.GetOperand())), eax);
+			break;
+		case OP_STOR_ALT: // address
+			// [address] = ALT
+			as.mov(dword_ptr_abs(reinterpret_cast<void*>(GetAmxData() + instr.GetOperand())), ecx);
+			break;
+		case OP_STOR_S_PRI: // offset
+			// [FRM + offset] = ALT
+			as.mov(dword_ptr(ebp, instr.GetOperand()), eax);
+			break;
+		case OP_STOR_S_ALT: // offset
+			// [FRM + offset] = ALT
+			as.mov(dword_ptr(ebp, instr.GetOperand()), ecx);
+			break;
+		case OP_SREF_PRI: // address
+			// [ [address] ] = PRI
+			as.mov(edx, dword_ptr_abs(reinterpret_cast<void*>(GetAmxData() + instr.GetOperand())));
+			as.mov(dword_ptr(edx, reinterpret_cast<sysint_t>(GetAmxData())), eax);
+			break;
+		case OP_SREF_ALT: // address
+			// [ [address] ] = ALT
+			as.mov(edx, dword_ptr_abs(reinterpret_cast<void*>(GetAmxData() + instr.GetOperand())));
+			as.mov(dword_ptr(edx, reinterpret_cast<sysint_t>(GetAmxData())), ecx);
+			break;
+		case OP_SREF_S_PRI: // offset
+			// [ [FRM + offset] ] = PRI
+			as.mov(edx, dword_ptr(ebp, instr.GetOperand()));
+			as.mov(dword_ptr(edx, reinterpret_cast<sysint_t>(GetAmxData())), eax);
+			break;
+		case OP_SREF_S_ALT: // offset
+			// [ [FRM + offset] ] = ALT
+			as.mov(edx, dword_ptr(ebp, instr.GetOperand()));
+			as.mov(dword_ptr(edx, reinterpret_cast<sysint_t>(GetAmxData())), ecx);
+			break;
+		case OP_STOR_I:
+			// [ALT] = PRI (full cell)
+			as.mov(dword_ptr(ecx, reinterpret_cast<sysint_t>(GetAmxData())), eax);
+			break;
+		case OP_STRB_I: // number
+			// "number" bytes at [ALT] = PRI (write 1/2/4 bytes)
+			switch (instr.GetOperand()) {
+			case 1:
+				as.xor_(ecx, ecx);
+				as.mov(byte_ptr(ecx, reinterpret_cast<sysint_t>(GetAmxData())), al);
+			case 2:
+				as.xor_(ecx, ecx);
+				as.mov(word_ptr(ecx, reinterpret_cast<sysint_t>(GetAmxData())), ax);
+			default:
+				as.mov(dword_ptr(ecx, reinterpret_cast<sysint_t>(GetAmxData())), eax);
+			}
+			break;
+		case OP_LIDX:
+			// PRI = [ ALT + (PRI x cell size) ]
+			as.mov(eax, dword_ptr(ecx, eax, 2, reinterpret_cast<sysint_t>(GetAmxData())));
+			break;
+		case OP_LIDX_B: // shift
+			// PRI = [ ALT + (PRI << shift) ]
+			as.mov(eax, dword_ptr(ecx, eax, instr.GetOperand(), reinterpret_cast<sysint_t>(GetAmxData())));
+			break;
+		case OP_IDXADDR:
+			// PRI = ALT + (PRI x cell size) (calculate indexed address)
+			as.lea(eax, dword_ptr(ecx, eax, 2));
+			break;
+		case OP_IDXADDR_B: // shift
+			// PRI = ALT + (PRI << shift) (calculate indexed address)
+			as.lea(eax, dword_ptr(ecx, eax, instr.GetOperand()));
+			break;
+		case OP_ALIGN_PRI: // number
+			// Little Endian: PRI ^= cell size - number
+			as.xor_(eax, sizeof(cell) - instr.GetOperand());
+			break;
+		case OP_ALIGN_ALT: // number
+			// Little Endian: ALT ^= cell size - number
+			as.xor_(ecx, sizeof(cell) - instr.GetOperand());
+			break;
+		case OP_LCTRL: // index
+			// PRI is set to the current value of any of the special registers.
+			// The index parameter must be: 0=COD, 1=DAT, 2=HEA,
+			// 3=STP, 4=STK, 5=FRM, 6=CIP (of the next instruction)
+			switch (instr.GetOperand()) {
+			case 0:
+				as.mov(eax, dword_ptr_abs(reinterpret_cast<void*>(&GetAmxHeader()->cod)));
+				break;
+			case 1:
+				as.mov(eax, dword_ptr_abs(reinterpret_cast<void*>(&GetAmxHeader()->dat)));
+				break;
+			case 2:
+				as.mov(eax, dword_ptr_abs(reinterpret_cast<void*>(&GetAmx()->hea)));
+				break;
+			case 4:
+				as.lea(eax, dword_ptr(esp, -reinterpret_cast<sysint_t>(GetAmxData())));
+				break;
+			case 5:
+				as.lea(eax, dword_ptr(ebp, -reinterpret_cast<sysint_t>(GetAmxData())));
+				break;
+			case 6: {
+				if (instr_iterator == instrs.end() - 1) {
+					// Can't get address of next instruction since this one is the last.
+					throw InvalidInstructionError(instr);
+				}
+				AmxInstruction &next_instr = *(instr_iterator + 1);
+				as.mov(eax, reinterpret_cast<sysint_t>(next_instr.GetIP()) 
+				            - reinterpret_cast<sysint_t>(GetAmxCode()));
+				break;
+			}
+			default:
+				throw UnsupportedInstructionError(instr);
+			}
+			break;
+		case OP_SCTRL: // index
+			// set the indexed special registers to the value in PRI.
+			// The index parameter must be: 2=HEA, 4=STK, 5=FRM,
+			// 6=CIP
+			switch (instr.GetOperand()) {
+			case 2:
+				as.mov(dword_ptr_abs(reinterpret_cast<void*>(&amx_->hea)), eax);
+				break;
+			case 4:
+				as.lea(esp, dword_ptr(eax, reinterpret_cast<sysint_t>(GetAmxData())));
+				break;
+			case 5:
+				as.lea(ebp, dword_ptr(eax, reinterpret_cast<sysint_t>(GetAmxData())));
+				break;
+			case 6:
+				as.push(esp);
+				as.push(eax);
+				as.push(reinterpret_cast<sysint_t>(this));
+				as.call(reinterpret_cast<void*>(::Jump));
+				// Didn't jump because of invalid address - exit with error.
+				halt(as, AMX_ERR_INVINSTR);
+				break;
+			default:
+				throw UnsupportedInstructionError(instr);
+			}
+			break;
+		case OP_MOVE_PRI:
+			// PRI = ALT
+			as.mov(eax, ecx);
+			break;
+		case OP_MOVE_ALT:
+			// ALT = PRI
+			as.mov(ecx, eax);
+			break;
+		case OP_XCHG:
+			// Exchange PRI and_ ALT
+			as.xchg(eax, ecx);
+			break;
+		case OP_PUSH_PRI:
+			// [STK] = PRI, STK = STK - cell size
+			as.push(eax);
+			break;
+		case OP_PUSH_ALT:
+			// [STK] = ALT, STK = STK - cell size
+			as.push(ecx);
+			break;
+		case OP_PUSH_C: // value
+			// [STK] = value, STK = STK - cell size
+			as.push(instr.GetOperand());
+			break;
+		case OP_PUSH: // address
+			// [STK] = [address], STK = STK - cell size
+			if (GetSpeculatedValue(instr.GetOperand(), known_value)) {
+				as.push(known_value);
+				break;
+			}
+			as.push(dword_ptr_abs(reinterpret_cast<void*>(instr.GetOperand() + GetAmxData())));
+			break;
+		case OP_PUSH_S: // offset
+			// [STK] = [FRM + offset], STK = STK - cell size
+			if (GetClonedArgument(instr.GetOperand(), known_value)) {
+				as.push(known_value);
+				break;
+			}
+			as.push(dword_ptr(ebp, instr.GetOperand()));
+			break;
+		case OP_POP_PRI:
+			// STK = STK + cell size, PRI = [STK]
+			as.pop(eax);
+			break;
+		case OP_POP_ALT:
+			// STK = STK + cell size, ALT = [STK]
+			as.pop(ecx);
+			break;
+		case OP_STACK: // value
+			// ALT = STK, STK = STK + value
+			as.lea(ecx, dword_ptr(esp, -reinterpret_cast<sysint_t>(GetAmxData())));
+			if (-instr.GetOperand() >= static_cast<cell>(kStackGuardSize)) {
+				stack_probe(as, -instr.GetOperand());
+			} else {
+				as.add(esp, instr.GetOperand());
+			}
+			break;
+		case OP_HEAP: // value
+			// ALT = HEA, HEA = HEA + value
+			as.mov(ecx, dword_ptr_abs(reinterpret_cast<void*>(&amx_->hea)));
+			as.add(dword_ptr_abs(reinterpret_cast<void*>(&amx_->hea)), instr.GetOperand());
+			break;
+		case OP_PROC:
+			// [STK] = FRM, STK = STK - cell size, FRM = STK
+			as.push(ebp);
+			as.mov(ebp, esp);
+			break;
+		case OP_RET:
+			// STK = STK + cell size, FRM = [STK],
+			// CIP = [STK], STK = STK + cell size
+			as.pop(ebp);
+			as.ret();
+			break;
+		case OP_RETN:
+			// FRM = [STK], STK = STK + cell size,
+			// CIP = [STK], STK = STK + cell size,
+			// STK = STK + [STK]
+			// The RETN instruction removes a specified number of bytes
+			// from the stack. The value to adjust STK with must be
+			// pushed prior to the call.
+			as.pop(ebp);
+			as.ret();
+			break;
+		case OP_CALL: { // offset
+			// [STK] = CIP + 5, STK = STK - cell size
+			// CIP = CIP + offset
+			// The CALL instruction jumps to an address after storing the
+			// address of the next sequential instruction on the stack.
+			// The address jumped to is relative to the current CIP,
+			// but the address on the stack is an absolute address.
+			cell fn_addr = instr.GetOperand() - reinterpret_cast<cell>(GetAmxCode());
+			std::map<cell, std::pair<cell, std::size_t> >::const_iterator call_counter 
+					= call_counters_.find(cip);
+			if (call_counter != call_counters_.end()) {
+				counter(as, call_counter->second.second);
+			}
+			std::map<cell, std::size_t>::const_iterator clone_call = clone_calls_.find(cip);
+			std::map<cell, std::size_t>::const_iterator memo = memo_functions_.find(fn_addr);
+			if (clone_call != clone_calls_.end()) {
+				as.call(clone_labels_[clone_call->second]);
+			} else if (memo != memo_functions_.end() && memo->second < memo_labels_.size()) {
+				as.call(memo_labels_[memo->second]);
+			} else {
+				as.call(Label(as, label_map, fn_addr));
+			}
+			if (!speculative_ && clone_ == 0) {
+				call_returns_[cip] = as.getCodeSize();
+			}
+			as.add(esp, dword_ptr(esp));
+			as.add(esp, 4);
+			break;
+		}
+		case OP_CALL_PRI:
+			// Same as CALL, the address to jump to is in PRI.
+			as.call(eax);
+			as.add(esp, dword_ptr(esp));
+			as.add(esp, 4);
+			break;
+
+		case OP_JUMP: { // offset
+			// CIP = CIP + offset (jump to the address relative from
+			// the current position)
+			cell dest = instr.GetOperand() - reinterpret_cast<cell>(GetAmxCode());
+			if (dest != next_emitted_cip) {
+				branch(as, Label(as, label_map, dest));
+			}
+			break;
+		}
+		case OP_JUMP_PRI:
+			// CIP = PRI (indirect jump)
+			as.push(esp);
+			as.push(eax);
+			as.push(reinterpret_cast<sysint_t>(this));
+			as.call(reinterpret_cast<void*>(::Jump));
+			// Didn't jump because of invalid address - exit with error.
+			halt(as, AMX_ERR_INVINSTR);
+			break;
+		case OP_JZER: 
+		case OP_JNZ:
+		case OP_JEQ:
+		case OP_JNEQ:
+		case OP_JLESS:
+		case OP_JLEQ:
+		case OP_JGRTR:
+		case OP_JGEQ:
+		case OP_JSLESS:
+		case OP_JSLEQ:
+		case OP_JSGRTR:
+		case OP_JSGEQ: {
+			cell dest = instr.GetOperand() - reinterpret_cast<cell>(GetAmxCode());
+
+			// Drop jumps that are known to go one way.
+			bool uses_alt = instr.GetOpcode() != OP_JZER && instr.GetOpcode() != OP_JNZ;
+			if (pri_known && (alt_known || !uses_alt)) {
+				if (IsJumpTaken(instr.GetOpcode(), pri_value, alt_value)) {
+					if (dest != next_emitted_cip) {
+						branch(as, Label(as, label_map, dest));
+					}
+					fall_through = -1;
+				}
+				break;
+			}
+
+			// Clones are laid out differently, so their jumps are not counted.
+			std::map<cell, std::size_t>::const_iterator branch_counter = branch_counters_.end();
+			if (clone_ == 0) {
+				branch_counter = branch_counters_.find(cip);
+			}
+			if (branch_counter != branch_counters_.end()) {
+				branch_count(as, branch_counter->second, false);
+			}
+
+			AsmJit::CONDITION cc = AsmJit::C_NO_CONDITION;
+			switch (instr.GetOpcode()) {
+				case OP_JZER: // offset
+					// if PRI == 0 then CIP = CIP + offset
+					as.cmp(eax, 0);
+					cc = AsmJit::C_Z;
+					break;
+				case OP_JNZ: // offset
+					// if PRI != 0 then CIP = CIP + offset
+					as.cmp(eax, 0);
+					cc = AsmJit::C_NZ;
+					break;
+				case OP_JEQ: // offset
+					// if PRI == ALT then CIP = CIP + offset
+					as.cmp(eax, ecx);
+					cc = AsmJit::C_E;
+					break;
+				case OP_JNEQ: // offset
+					// if PRI != ALT then CIP = CIP + offset
+					as.cmp(eax, ecx);
+					cc = AsmJit::C_NE;
+					break;
+				case OP_JLESS: // offset
+					// if PRI < ALT then CIP = CIP + offset (unsigned)
+					as.cmp(eax, ecx);
+					cc = AsmJit::C_B;
+					break;
+				case OP_JLEQ: // offset
+					// if PRI <= ALT then CIP = CIP + offset (unsigned)
+					as.cmp(eax, ecx);
+					cc = AsmJit::C_BE;
+					break;
+				case OP_JGRTR: // offset
+					// if PRI > ALT then CIP = CIP + offset (unsigned)
+					as.cmp(eax, ecx);
+					cc = AsmJit::C_A;
+					break;
+				case OP_JGEQ: // offset
+					// if PRI >= ALT then CIP = CIP + offset (unsigned)
+					as.cmp(eax, ecx);
+					cc = AsmJit::C_AE;
+					break;
+				case OP_JSLESS: // offset
+					// if PRI < ALT then CIP = CIP + offset (signed)
+					as.cmp(eax, ecx);
+					cc = AsmJit::C_L;
+					break;
+				case OP_JSLEQ: // offset
+					// if PRI <= ALT then CIP = CIP + offset (signed)
+					as.cmp(eax, ecx);
+					cc = AsmJit::C_LE;
+					break;
+				case OP_JSGRTR: // offset
+					// if PRI > ALT then CIP = CIP + offset (signed)
+					as.cmp(eax, ecx);
+					cc = AsmJit::C_G;
+					break;
+				case OP_JSGEQ: // offset
+					// if PRI >= ALT then CIP = CIP + offset (signed)
+					as.cmp(eax, ecx);
+					cc = AsmJit::C_GE;
+					break;
+			}
+
+			if (dest == next_emitted_cip && next_cip >= 0 && next_cip != next_emitted_cip) {
+				// The target has been placed right after the jump, so jump
+				// to the next AMX instruction instead.
+				branch(as, AsmJit::negateCondition(cc), Label(as, label_map, next_cip));
+				fall_through = dest;
+				inverted_branches_.insert(cip);
+			} else {
+				branch(as, cc, Label(as, label_map, dest));
+			}
+
+			if (branch_counter != branch_counters_.end()) {
+				branch_count(as, branch_counter->second, true);
+			}
+			break;
+		}
+
+		case OP_SHL:
+			// PRI = PRI << ALT
 			as.shl(eax, cl);
 			break;
 		case OP_SHR:
@@ -615,16 +1942,12 @@ void Jitter::Compile(std::FILE *list_stream) {
 			break;
 		case OP_SDIV:
 			// PRI = PRI / ALT (signed divide), ALT = PRI mod ALT
-			as.xor_(edx, edx);
-			as.idiv(ecx);
-			as.mov(ecx, edx);
+			sdiv(as);
 			break;
 		case OP_SDIV_ALT:
 			// PRI = ALT / PRI (signed divide), ALT = ALT mod PRI
 			as.xchg(eax, ecx);
-			as.xor_(edx, edx);
-			as.idiv(ecx);
-			as.mov(ecx, edx);
+			sdiv(as);
 			break;
 		case OP_UMUL:
 			// PRI = PRI * ALT (unsigned multiply)
@@ -652,530 +1975,3040 @@ void Jitter::Compile(std::FILE *list_stream) {
 			// PRI = PRI - ALT
 			as.sub(eax, ecx);
 			break;
-		case OP_SUB_ALT:
-			// PRI = ALT - PRI
-			// or_:
-			// PRI = -(PRI - ALT)
-			as.sub(eax, ecx);
-			as.neg(eax);
+		case OP_SUB_ALT:
+			// PRI = ALT - PRI
+			// or_:
+			// PRI = -(PRI - ALT)
+			as.sub(eax, ecx);
+			as.neg(eax);
+			break;
+		case OP_AND:
+			// PRI = PRI & ALT
+			as.and_(eax, ecx);
+			break;
+		case OP_OR:
+			// PRI = PRI | ALT
+			as.or_(eax, ecx);
+			break;
+		case OP_XOR:
+			// PRI = PRI ^ ALT
+			as.xor_(eax, ecx);
+			break;
+		case OP_NOT:
+			// PRI = !PRI
+			as.xor_(edx, edx);
+			as.test(eax, eax);
+			as.setz(dl);
+			as.mov(eax, edx);
+			break;
+		case OP_NEG:
+			// PRI = -PRI
+			as.neg(eax);
+			break;
+		case OP_INVERT:
+			// PRI = ~PRI
+			as.not_(eax);
+			break;
+		case OP_ADD_C: // value
+			// PRI = PRI + value
+			as.add(eax, instr.GetOperand());
+			break;
+		case OP_SMUL_C: // value
+			// PRI = PRI * value
+			as.imul(eax, instr.GetOperand());
+			break;
+		case OP_ZERO_PRI:
+			// PRI = 0
+			as.xor_(eax, eax);
+			break;
+		case OP_ZERO_ALT:
+			// ALT = 0
+			as.xor_(ecx, ecx);
+			break;
+		case OP_ZERO: // address
+			// [address] = 0
+			as.mov(dword_ptr_abs(reinterpret_cast<void*>(instr.GetOperand() + GetAmxData())), 0);
+			break;
+		case OP_ZERO_S: // offset
+			// [FRM + offset] = 0
+			as.mov(dword_ptr(ebp, instr.GetOperand()), 0);
+			break;
+		case OP_SIGN_PRI:
+			// sign extent the byte in PRI to a cell
+			as.movsx(eax, al);
+			break;
+		case OP_SIGN_ALT:
+			// sign extent the byte in ALT to a cell
+			as.movsx(ecx, cl);
+			break;
+		// Comparisons clear the result register before setting its low byte
+		// to avoid a partial register stall.
+		case OP_EQ:
+			// PRI = PRI == ALT ? 1 : 0
+			as.xor_(edx, edx);
+			as.cmp(eax, ecx);
+			as.sete(dl);
+			as.mov(eax, edx);
+			break;
+		case OP_NEQ:
+			// PRI = PRI != ALT ? 1 : 0
+			as.xor_(edx, edx);
+			as.cmp(eax, ecx);
+			as.setne(dl);
+			as.mov(eax, edx);
+			break;
+		case OP_LESS:
+			// PRI = PRI < ALT ? 1 : 0 (unsigned)
+			as.xor_(edx, edx);
+			as.cmp(eax, ecx);
+			as.setb(dl);
+			as.mov(eax, edx);
+			break;
+		case OP_LEQ:
+			// PRI = PRI <= ALT ? 1 : 0 (unsigned)
+			as.xor_(edx, edx);
+			as.cmp(eax, ecx);
+			as.setbe(dl);
+			as.mov(eax, edx);
+			break;
+		case OP_GRTR:
+			// PRI = PRI > ALT ? 1 : 0 (unsigned)
+			as.xor_(edx, edx);
+			as.cmp(eax, ecx);
+			as.seta(dl);
+			as.mov(eax, edx);
+			break;
+		case OP_GEQ:
+			// PRI = PRI >= ALT ? 1 : 0 (unsigned)
+			as.xor_(edx, edx);
+			as.cmp(eax, ecx);
+			as.setae(dl);
+			as.mov(eax, edx);
+			break;
+		case OP_SLESS:
+			// PRI = PRI < ALT ? 1 : 0 (signed)
+			as.xor_(edx, edx);
+			as.cmp(eax, ecx);
+			as.setl(dl);
+			as.mov(eax, edx);
+			break;
+		case OP_SLEQ:
+			// PRI = PRI <= ALT ? 1 : 0 (signed)
+			as.xor_(edx, edx);
+			as.cmp(eax, ecx);
+			as.setle(dl);
+			as.mov(eax, edx);
+			break;
+		case OP_SGRTR:
+			// PRI = PRI > ALT ? 1 : 0 (signed)
+			as.xor_(edx, edx);
+			as.cmp(eax, ecx);
+			as.setg(dl);
+			as.mov(eax, edx);
+			break;
+		case OP_SGEQ:
+			// PRI = PRI >= ALT ? 1 : 0 (signed)
+			as.xor_(edx, edx);
+			as.cmp(eax, ecx);
+			as.setge(dl);
+			as.mov(eax, edx);
+			break;
+		case OP_EQ_C_PRI: // value
+			// PRI = PRI == value ? 1 : 0
+			as.xor_(edx, edx);
+			as.cmp(eax, instr.GetOperand());
+			as.sete(dl);
+			as.mov(eax, edx);
+			break;
+		case OP_EQ_C_ALT: // value
+			// PRI = ALT == value ? 1 : 0
+			as.xor_(edx, edx);
+			as.cmp(ecx, instr.GetOperand());
+			as.sete(dl);
+			as.mov(eax, edx);
+			break;
+		case OP_INC_PRI:
+			// PRI = PRI + 1
+			as.inc(eax);
+			break;
+		case OP_INC_ALT:
+			// ALT = ALT + 1
+			as.inc(ecx);
+			break;
+		case OP_INC: // address
+			// [address] = [address] + 1
+			as.inc(dword_ptr_abs(reinterpret_cast<void*>(GetAmxData() + instr.GetOperand())));
+			break;
+		case OP_INC_S: // offset
+			// [FRM + offset] = [FRM + offset] + 1
+			as.inc(dword_ptr(ebp, instr.GetOperand()));
+			break;
+		case OP_INC_I:
+			// [PRI] = [PRI] + 1
+			as.inc(dword_ptr(eax, reinterpret_cast<sysint_t>(GetAmxData())));
+			break;
+		case OP_DEC_PRI:
+			// PRI = PRI - 1
+			as.dec(eax);
+			break;
+		case OP_DEC_ALT:
+			// ALT = ALT - 1
+			as.dec(ecx);
 			break;
-		case OP_AND:
-			// PRI = PRI & ALT
-			as.and_(eax, ecx);
+		case OP_DEC: // address
+			// [address] = [address] - 1
+			as.dec(dword_ptr_abs(reinterpret_cast<void*>(GetAmxData() + instr.GetOperand())));
 			break;
-		case OP_OR:
-			// PRI = PRI | ALT
-			as.or_(eax, ecx);
+		case OP_DEC_S: // offset
+			// [FRM + offset] = [FRM + offset] - 1
+			as.dec(dword_ptr(ebp, instr.GetOperand()));
 			break;
-		case OP_XOR:
-			// PRI = PRI ^ ALT
-			as.xor_(eax, ecx);
+		case OP_DEC_I:
+			// [PRI] = [PRI] - 1
+			as.dec(dword_ptr(eax, reinterpret_cast<sysint_t>(GetAmxData())));
 			break;
-		case OP_NOT:
-			// PRI = !PRI
-			as.test(eax, eax);
-			as.setz(cl);
-			as.movzx(eax, cl);
+		case OP_MOVS: { // number
+			// Copy memory from [PRI] to [ALT]. The parameter
+			// specifies the number of bytes. The blocks should not
+			// overlap.
+			cell size = instr.GetOperand();
+			sysint_t data = reinterpret_cast<sysint_t>(GetAmxData());
+			bool sse2 = GetTargetFeatures().Has(TargetFeatures::SSE2);
+			if (size <= (sse2 ? kMaxUnrolledSSE : kMaxUnrolled)) {
+				// Small blocks: fully unrolled moves.
+				cell offset = 0;
+				if (sse2) {
+					for (; offset + 16 <= size; offset += 16) {
+						as.movdqu(xmm0, dword_ptr(eax, data + offset));
+						as.movdqu(dword_ptr(ecx, data + offset), xmm0);
+					}
+				}
+				for (; offset + 4 <= size; offset += 4) {
+					as.mov(edx, dword_ptr(eax, data + offset));
+					as.mov(dword_ptr(ecx, data + offset), edx);
+				}
+				for (; offset < size; offset++) {
+					as.mov(dl, byte_ptr(eax, data + offset));
+					as.mov(byte_ptr(ecx, data + offset), dl);
+				}
+			} else {
+				as.lea(esi, dword_ptr(eax, data));
+				as.lea(edi, dword_ptr(ecx, data));
+				as.push(ecx);
+				as.mov(ecx, size / 4);
+				as.rep_movsd();
+				as.pop(ecx);
+				for (cell offset = 0; offset < size % 4; offset++) {
+					as.mov(dl, byte_ptr(esi, offset));
+					as.mov(byte_ptr(edi, offset), dl);
+				}
+			}
 			break;
-		case OP_NEG:
-			// PRI = -PRI
-			as.neg(eax);
+		}
+		case OP_CMPS: { // number
+			// Compare memory blocks at [PRI] and_ [ALT]. The parameter
+			// specifies the number of bytes. The blocks should not
+			// overlap.
+			// Same as PRI = memcmp(ALT, PRI, number).
+			AsmJit::Label &L_diff = Label(as, label_map, cip, "diff");
+			AsmJit::Label &L_done = Label(as, label_map, cip, "done");
+			cell size = instr.GetOperand();
+			cell tail = 0; // offset of the remaining bytes from esi/edi
+			as.lea(esi, dword_ptr(ecx, reinterpret_cast<sysint_t>(GetAmxData())));
+			as.lea(edi, dword_ptr(eax, reinterpret_cast<sysint_t>(GetAmxData())));
+			if (size / 4 > 0 && size <= kMaxUnrolled) {
+				for (; tail + 4 <= size; tail += 4) {
+					as.mov(eax, dword_ptr(esi, tail));
+					as.mov(edx, dword_ptr(edi, tail));
+					as.cmp(eax, edx);
+					branch(as, AsmJit::C_NE, L_diff);
+				}
+			} else if (size / 4 > 0) {
+				as.push(ecx);
+				as.mov(ecx, size / 4);
+				as.repe_cmpsd();
+				as.pop(ecx);
+				as.mov(eax, dword_ptr(esi, -4));
+				as.mov(edx, dword_ptr(edi, -4));
+				branch(as, AsmJit::C_NE, L_diff);
+			}
+			for (cell i = 0; i < size % 4; i++) {
+				as.movzx(eax, byte_ptr(esi, tail + i));
+				as.movzx(edx, byte_ptr(edi, tail + i));
+				as.sub(eax, edx);
+				branch(as, AsmJit::C_NZ, L_done);
+			}
+			as.xor_(eax, eax);
+			branch(as, L_done);
+			as.bind(L_diff);
+				// Cells are little-endian, so swap bytes to get the order
+				// of the first differing byte.
+				as.bswap(eax);
+				as.bswap(edx);
+				as.cmp(eax, edx);
+				as.sbb(eax, eax);
+				as.or_(eax, 1);
+			as.bind(L_done);
 			break;
-		case OP_INVERT:
-			// PRI = ~PRI
-			as.not_(eax);
+		}
+		case OP_FILL: { // number
+			// Fill memory at [ALT] with value in [PRI]. The parameter
+			// specifies the number of bytes, which must be a multiple
+			// of the cell size.
+			cell size = instr.GetOperand() / 4 * 4;
+			if (size > static_cast<cell>(sizeof(cell)) && IsFilledBufferOverwritten(instrs, instr_iterator - instrs.begin())) {
+				// The native overwrites all of the buffer, only the first cell
+				// can be seen in case it fails.
+				size = sizeof(cell);
+			}
+			sysint_t data = reinterpret_cast<sysint_t>(GetAmxData());
+			bool sse2 = GetTargetFeatures().Has(TargetFeatures::SSE2);
+			if (size <= (sse2 ? kMaxUnrolledSSE : kMaxUnrolled)) {
+				// Small blocks: fully unrolled stores.
+				cell offset = 0;
+				if (sse2 && size >= 32) {
+					as.movd(xmm0, eax);
+					as.pshufd(xmm0, xmm0, 0);
+					for (; offset + 16 <= size; offset += 16) {
+						as.movdqu(dword_ptr(ecx, data + offset), xmm0);
+					}
+				}
+				for (; offset < size; offset += 4) {
+					as.mov(dword_ptr(ecx, data + offset), eax);
+				}
+			} else {
+				as.lea(edi, dword_ptr(ecx, data));
+				as.push(ecx);
+				as.mov(ecx, size / 4);
+				as.rep_stosd();
+				as.pop(ecx);
+			}
 			break;
-		case OP_ADD_C: // value
-			// PRI = PRI + value
-			as.add(eax, instr.GetOperand());
+		}
+		case OP_HALT: // number
+			// Abort execution (exit value in PRI), parameters other than 0
+			// have a special meaning.
+			halt(as, instr.GetOperand());
 			break;
-		case OP_SMUL_C: // value
-			// PRI = PRI * value
-			as.imul(eax, instr.GetOperand());
+		case OP_BOUNDS: { // value
+			// Abort execution if PRI > value or_ if PRI < 0.
+			// Negative values are above any value when compared as unsigned.
+			as.cmp(eax, instr.GetOperand());
+			branch(as, AsmJit::C_A, HaltLabel(as, AMX_ERR_BOUNDS));
 			break;
-		case OP_ZERO_PRI:
-			// PRI = 0
-			as.xor_(eax, eax);
+		}
+		case OP_SYSREQ_PRI: {
+			// call system service, service number in PRI
+			as.push(eax);
+			as.push(reinterpret_cast<sysint_t>(amx_));
+			as.call(reinterpret_cast<void*>(GetNativeAddress));
+			as.add(esp, 8);
+			as.test(eax, eax);
+			branch(as, AsmJit::C_Z, HaltLabel(as, AMX_ERR_NOTFOUND));
+			as.push(esp);
+			as.push(reinterpret_cast<sysint_t>(amx_));
+			as.call(eax);
+			as.add(esp, 8);
 			break;
-		case OP_ZERO_ALT:
-			// ALT = 0
-			as.xor_(ecx, ecx);
+		}
+		case OP_SYSREQ_C:   // index
+		case OP_SYSREQ_D: { // address
+			// call system service
+			std::string native_name = GetSysreqNativeName(amx_, instr);
+			cell native_address = GetSysreqNativeAddress(amx_, instr);
+			// Replace calls to various natives with their optimized equivalents.
+			std::map<std::string, NativeOverride>::const_iterator it
+					= native_overrides_.find(native_name);
+			if (it != native_overrides_.end()) {
+				NativeCall call(native_address, instrs, instr_iterator - instrs.begin());
+				if ((*this.*(it->second))(as, call)) {
+					goto special_native;
+				}
+			}
+			as.push(esp);
+			as.push(reinterpret_cast<sysint_t>(amx_));
+			as.call(reinterpret_cast<void*>(native_address));
+			as.add(esp, 8);
+		special_native:
 			break;
-		case OP_ZERO: // address
-			// [address] = 0
-			as.mov(dword_ptr_abs(reinterpret_cast<void*>(instr.GetOperand() + GetAmxData())), 0);
+		}
+		case OP_SWITCH: { // offset
+			// Compare PRI to the values in the case table (whose address
+			// is passed as an offset from CIP) and_ jump to the associated
+			// the address in the matching record.
+
+			struct case_record {
+				cell value;    // case value
+				cell address;  // address to jump to (absolute)
+			} *case_table;
+
+			// Get pointer to the start of the case table.
+			case_table = reinterpret_cast<case_record*>(instr.GetOperand() + sizeof(cell));
+
+			// Get address of the "default" record.
+			cell default_addr = case_table[0].address - reinterpret_cast<cell>(GetAmxCode());
+
+			// The number of cases follows the CASETBL opcode (which follows the SWITCH).
+			int num_cases = *(reinterpret_cast<cell*>(instr.GetOperand()) + 1);
+
+			if (num_cases > 0) {
+				// Get minimum and maximum values.
+				cell *min_value = 0;
+				cell *max_value = 0;
+				for (int i = 0; i < num_cases; i++) {
+					cell *value = &case_table[i + 1].value;
+					if (min_value == 0 || *value < *min_value) {
+						min_value = value;
+					}
+					if (max_value == 0 || *value > *max_value) {
+						max_value = value;
+					}
+				}
+
+				// Check if the value in eax is in the allowed range.
+				// If not, jump to the default case (i.e. no match).
+				as.cmp(eax, *min_value);
+				branch(as, AsmJit::C_L, Label(as, label_map, default_addr));
+				as.cmp(eax, *max_value);
+				branch(as, AsmJit::C_G, Label(as, label_map, default_addr));
+
+				// OK now sequentially compare eax with each value.
+				// This is pretty slow so I probably should optimize
+				// this in future...
+				for (int i = 0; i < num_cases; i++) {
+					as.cmp(eax, case_table[i + 1].value);
+					branch(as, AsmJit::C_E, Label(as, label_map, case_table[i + 1].address - reinterpret_cast<cell>(GetAmxCode())));
+				}
+			}
+
+			// No match found - go for default case.
+			branch(as, Label(as, label_map, default_addr));
 			break;
-		case OP_ZERO_S: // offset
-			// [FRM + offset] = 0
-			as.mov(dword_ptr(ebp, instr.GetOperand()), 0);
+		}
+		case OP_CASETBL: // ...
+			// A variable number of case records follows this opcode, where
+			// each record takes two cells.
 			break;
-		case OP_SIGN_PRI:
-			// sign extent the byte in PRI to a cell
-			as.movsx(eax, al);
+		case OP_SWAP_PRI:
+			// [STK] = PRI and_ PRI = [STK]
+			as.xchg(dword_ptr(esp), eax);
 			break;
-		case OP_SIGN_ALT:
-			// sign extent the byte in ALT to a cell
-			as.movsx(ecx, cl);
+		case OP_SWAP_ALT:
+			// [STK] = ALT and_ ALT = [STK]
+			as.xchg(dword_ptr(esp), ecx);
 			break;
-		case OP_EQ:
-			// PRI = PRI == ALT ? 1 : 0
-			as.cmp(eax, ecx);
-			as.sete(al);
-			as.movzx(eax, al);
+		case OP_PUSH_ADR: // offset
+			// [STK] = FRM + offset, STK = STK - cell size
+			as.lea(edx, dword_ptr(ebp, instr.GetOperand() - reinterpret_cast<sysint_t>(GetAmxData())));
+			as.push(edx);
 			break;
-		case OP_NEQ:
-			// PRI = PRI != ALT ? 1 : 0
-			as.cmp(eax, ecx);
-			as.setne(al);
-			as.movzx(eax, al);
+		case OP_NOP:
+			// no-operation, for code alignment
 			break;
-		case OP_LESS:
-			// PRI = PRI < ALT ? 1 : 0 (unsigned)
-			as.cmp(eax, ecx);
-			as.setb(al);
-			as.movzx(eax, al);
+		case OP_BREAK:
+			// conditional breakpoint
+			break;
+		case OP_PUSH_R:
+		case OP_FILE:
+		case OP_SYMBOL:
+		case OP_LINE:
+		case OP_SRANGE:
+		case OP_SYMTAG:		
+		case OP_JREL:
+			// obsolete
+			throw ObsoleteInstructionError(instr);
+		default:
+			throw InvalidInstructionError(instr);
+		}		
+
+		if (speculative_ && MayInvalidate(instr.GetOpcode())
+				&& !IsReadOnlyNative(GetSysreqNativeName(amx_, instr))) {
+			bool check = true;
+			switch (instr.GetOpcode()) {
+				case OP_STOR_PRI:
+				case OP_STOR_ALT:
+				case OP_ZERO:
+				case OP_INC:
+				case OP_DEC:
+					check = speculated_.find(instr.GetOperand()) != speculated_.end();
+					break;
+				case OP_SYSREQ_PRI:
+				case OP_SYSREQ_C:
+				case OP_SYSREQ_D:
+					// Natives may write to any array passed to them.
+					revalidate(as);
+					break;
+				default:
+					break;
+			}
+			if (check) {
+				deopt_check(as, next_cip);
+			}
+		}
+
+		switch (instr.GetOpcode()) {
+			case OP_CONST_PRI:
+			case OP_ZERO_PRI:
+			case OP_LOAD_PRI:
+				pri_value = instr.GetOpcode() == OP_ZERO_PRI ? 0 : instr.GetOperand();
+				pri_known = instr.GetOpcode() != OP_LOAD_PRI 
+				         || GetSpeculatedValue(instr.GetOperand(), pri_value);
+				break;
+			case OP_CONST_ALT:
+			case OP_ZERO_ALT:
+			case OP_LOAD_ALT:
+				alt_value = instr.GetOpcode() == OP_ZERO_ALT ? 0 : instr.GetOperand();
+				alt_known = instr.GetOpcode() != OP_LOAD_ALT 
+				         || GetSpeculatedValue(instr.GetOperand(), alt_value);
+				break;
+			case OP_LOAD_S_PRI:
+				pri_known = GetClonedArgument(instr.GetOperand(), pri_value);
+				break;
+			case OP_LOAD_S_ALT:
+				alt_known = GetClonedArgument(instr.GetOperand(), alt_value);
+				break;
+			case OP_MOVE_PRI:
+				pri_known = alt_known;
+				pri_value = alt_value;
+				break;
+			case OP_MOVE_ALT:
+				alt_known = pri_known;
+				alt_value = pri_value;
+				break;
+			case OP_XCHG:
+				std::swap(pri_known, alt_known);
+				std::swap(pri_value, alt_value);
+				break;
+			case OP_STOR_PRI:
+			case OP_STOR_ALT:
+			case OP_STOR_S_PRI:
+			case OP_STOR_S_ALT:
+			case OP_PUSH_PRI:
+			case OP_PUSH_ALT:
+			case OP_PUSH_C:
+			case OP_PUSH:
+			case OP_PUSH_S:
+			case OP_ZERO:
+			case OP_ZERO_S:
+			case OP_INC:
+			case OP_INC_S:
+			case OP_DEC:
+			case OP_DEC_S:
+			case OP_NOP:
+			case OP_BREAK:
+				// PRI and ALT don't change.
+				break;
+			default:
+				pri_known = false;
+				alt_known = false;
+				break;
+		}
+
+		if (!CanFallThrough(instr.GetOpcode())) {
+			fall_through = -1;
+		}
+	}
+
+	if (trace != 0) {
+		if (trace->empty() || trace->back().kind != TraceStep::EXIT) {
+			branch(as, L_trace);
+		}
+	} else if (fall_through >= 0) {
+		branch(as, Label(as, label_map, fall_through));
+	}
+	clone_ = 0;
+
+	// Error paths go to the end of the code, away from hot code.
+	halt_thunks(as);
+	deopt_thunks(as);
+	trace_thunks(as);
+	memo_thunks(as, code_label_map);
+}
+
+void Jitter::branch(AsmJit::Assembler &as, const AsmJit::Label &label) {
+	branch(as, AsmJit::C_NO_CONDITION, label);
+}
+
+void Jitter::branch(AsmJit::Assembler &as, AsmJit::CONDITION cc, const AsmJit::Label &label) {
+	std::size_t index = branches_.size();
+	branches_.push_back(std::make_pair(as.getOffset(), label));
+
+	// Backward branches are made short by the assembler itself.
+	bool is_short = index < short_branches_.size() && short_branches_[index];
+	if (cc == AsmJit::C_NO_CONDITION) {
+		if (is_short) {
+			// jmp rel32 is 5 bytes, jmp rel8 is 2.
+			short_branch_savings_ += 3;
+			as.short_jmp(label);
+		} else {
+			as.jmp(label);
+		}
+	} else {
+		if (is_short) {
+			// jcc rel32 is 6 bytes, jcc rel8 is 2.
+			short_branch_savings_ += 4;
+			as.short_j(cc, label);
+		} else {
+			as.j(cc, label);
+		}
+	}
+}
+
+void Jitter::halt(AsmJit::Assembler &as, cell error_code) {
+	branch(as, HaltLabel(as, error_code));
+}
+
+void Jitter::halt_thunks(AsmJit::Assembler &as) {
+	using AsmJit::esp;
+	using AsmJit::ebp;
+	using AsmJit::dword_ptr_abs;
+	for (HaltLabelMap::iterator iterator = halt_labels_.begin(); 
+			iterator != halt_labels_.end(); ++iterator) 
+	{
+		as.bind(iterator->second);
+		as.mov(dword_ptr_abs(reinterpret_cast<void*>(&GetAmx()->error)), iterator->first);
+		as.mov(esp, dword_ptr_abs(reinterpret_cast<void*>(&halt_esp_)));
+		as.mov(ebp, dword_ptr_abs(reinterpret_cast<void*>(&halt_ebp_)));
+		as.ret();
+	}
+}
+
+void Jitter::stack_probe(AsmJit::Assembler &as, cell size) {
+	using AsmJit::edx;
+	using AsmJit::esp;
+	using AsmJit::dword_ptr;
+
+	// Touch each page of the frame in turn so that an overflow hits the
+	// guard region. Preserves PRI and ALT.
+	AsmJit::Label L_probe = as.newLabel();
+	as.mov(edx, size / kStackProbeSize);
+	as.bind(L_probe);
+	as.sub(esp, kStackProbeSize);
+	as.test(dword_ptr(esp), edx);
+	as.sub(edx, 1);
+	branch(as, AsmJit::C_NZ, L_probe);
+	if (size % kStackProbeSize != 0) {
+		as.sub(esp, size % kStackProbeSize);
+	}
+}
+
+void Jitter::sdiv(AsmJit::Assembler &as) {
+	using AsmJit::eax;
+	using AsmJit::ecx;
+	using AsmJit::edx;
+	using AsmJit::esi;
+	using AsmJit::edi;
+	using AsmJit::dword_ptr;
+
+	// PRI = PRI / ALT, ALT = PRI mod ALT. AMX division is floored, i.e. the
+	// remainder has the same sign as the divisor, while idiv truncates. So
+	// if the remainder is non-zero and its sign differs from the divisor's,
+	// the quotient is decremented and the divisor is added to the remainder.
+	// A zero divisor traps and the fault handler halts with AMX_ERR_DIVIDE.
+	as.mov(edx, eax);
+	as.sar(edx, 31);
+	as.idiv(ecx);
+	if (GetTargetFeatures().Has(TargetFeatures::CMOV)) {
+		as.test(edx, edx);
+		as.mov(esi, ecx);
+		as.cmovz(esi, edx);
+		as.xor_(esi, edx); // SF = non-zero remainder of different sign
+		as.lea(esi, dword_ptr(eax, -1));
+		as.cmovs(eax, esi);
+		as.lea(esi, dword_ptr(edx, ecx));
+		as.cmovs(edx, esi);
+	} else {
+		as.mov(esi, edx);
+		as.xor_(esi, ecx);
+		as.sar(esi, 31); // -1 if signs differ
+		as.cmp(edx, 1);
+		as.sbb(edi, edi);
+		as.not_(edi);    // -1 if remainder is non-zero
+		as.and_(esi, edi);
+		as.add(eax, esi);
+		as.and_(esi, ecx);
+		as.add(edx, esi);
+	}
+	as.mov(ecx, edx);
+}
+
+void Jitter::counter(AsmJit::Assembler &as, std::size_t index) {
+	// Counters are 64-bit. This clobbers flags.
+	uint64_t *count = &counters_[index];
+	as.add(AsmJit::dword_ptr_abs(reinterpret_cast<void*>(count)), 1);
+	as.adc(AsmJit::dword_ptr_abs(reinterpret_cast<void*>(count), sizeof(uint32_t)), 0);
+}
+
+void Jitter::branch_count(AsmJit::Assembler &as, std::size_t index, bool fall_through) {
+	// A branch has two counters: runs and fall-throughs.
+	std::size_t counter_index = fall_through ? index + 1 : index;
+	if (profiling_) {
+		counter(as, counter_index);
+		return;
+	}
+	std::map<std::size_t, int>::const_iterator loops = branch_loops_left_.find(index);
+	if (loops == branch_loops_left_.end() || loops->second <= 0) {
+		return;
+	}
+	BranchCountSite site;
+	site.counter = index;
+	site.offset = as.getOffset();
+	counter(as, counter_index);
+	site.size = as.getOffset() - site.offset;
+	new_branch_count_sites_.push_back(site);
+}
+
+void Jitter::memo_thunks(AsmJit::Assembler &as, LabelMap *label_map) {
+	using AsmJit::eax;
+	using AsmJit::ecx;
+	using AsmJit::edx;
+	using AsmJit::esp;
+	using AsmJit::dword_ptr;
+	using AsmJit::dword_ptr_abs;
+
+	for (std::size_t i = 0; i < memo_labels_.size(); i++) {
+		const Memo &memo = memos_[i];
+		uint64_t *misses = &memo_counters_[memo.counters];
+		uint64_t *hits = &memo_counters_[memo.counters + 1];
+		AsmJit::Label L_miss = as.newLabel();
+
+		// On entry [esp] is the return address, [esp + 4] is the size of
+		// the arguments and the arguments follow it.
+		as.bind(memo_labels_[i]);
+		if (memo.num_args > 0) {
+			for (int n = 1; n <= memo.num_args; n++) {
+				if (n == 1) {
+					as.mov(eax, dword_ptr(esp, 8));
+				} else {
+					as.xor_(eax, dword_ptr(esp, 4 + n * sizeof(cell)));
+				}
+				as.imul(eax, eax, static_cast<sysint_t>(0x9E3779B1));
+			}
+			as.shr(eax, 32 - kMemoCacheBits);
+			as.shl(eax, 5);
+			as.lea(edx, dword_ptr(eax, reinterpret_cast<sysint_t>(&memo_cache_[memo.cache])));
+		} else {
+			as.mov(edx, reinterpret_cast<sysint_t>(&memo_cache_[memo.cache]));
+		}
+
+		// Hit: valid entry with the same arguments.
+		as.cmp(dword_ptr(edx), 0);
+		as.je(L_miss);
+		for (int n = 1; n <= memo.num_args; n++) {
+			as.mov(ecx, dword_ptr(esp, 4 + n * sizeof(cell)));
+			as.cmp(ecx, dword_ptr(edx, n * sizeof(cell)));
+			as.jne(L_miss);
+		}
+		as.add(dword_ptr_abs(reinterpret_cast<void*>(hits)), 1);
+		as.adc(dword_ptr_abs(reinterpret_cast<void*>(hits), sizeof(uint32_t)), 0);
+		as.mov(eax, dword_ptr(edx, 5 * sizeof(cell)));
+		as.ret();
+
+		// Miss: call the function with a copy of the arguments and fill
+		// the entry.
+		as.bind(L_miss);
+		as.add(dword_ptr_abs(reinterpret_cast<void*>(misses)), 1);
+		as.adc(dword_ptr_abs(reinterpret_cast<void*>(misses), sizeof(uint32_t)), 0);
+		as.push(edx);
+		for (int n = 0; n < memo.num_args; n++) {
+			as.push(dword_ptr(esp, 8 + memo.num_args * sizeof(cell)));
+		}
+		as.push(static_cast<sysint_t>(memo.num_args * sizeof(cell)));
+		as.call(Label(as, label_map, memo.function));
+		as.add(esp, static_cast<sysint_t>((memo.num_args + 1) * sizeof(cell)));
+		as.pop(edx);
+		for (int n = 1; n <= memo.num_args; n++) {
+			as.mov(ecx, dword_ptr(esp, 4 + n * sizeof(cell)));
+			as.mov(dword_ptr(edx, n * sizeof(cell)), ecx);
+		}
+		as.mov(dword_ptr(edx, 5 * sizeof(cell)), eax);
+		as.mov(dword_ptr(edx), 1);
+		as.ret();
+	}
+}
+
+void Jitter::entry_thunk(AsmJit::Assembler &as) {
+	using AsmJit::eax;
+	using AsmJit::ebx;
+	using AsmJit::ecx;
+	using AsmJit::edx;
+	using AsmJit::esi;
+	using AsmJit::edi;
+	using AsmJit::esp;
+	using AsmJit::ebp;
+	using AsmJit::dword_ptr;
+	using AsmJit::dword_ptr_abs;
+
+	AsmJit::Label L_nested = as.newLabel();
+
+	as.push(ebx);
+	as.push(esi);
+	as.push(edi);
+	as.push(ebp);
+	as.mov(edx, dword_ptr(esp, 20)); // start
+	as.mov(esi, dword_ptr(esp, 24)); // params
+	as.mov(eax, dword_ptr(esp, 28)); // context
+
+	// A native may call back into the script, so the halt state of the
+	// outer call is restored on return.
+	as.push(dword_ptr_abs(reinterpret_cast<void*>(&halt_esp_)));
+	as.push(dword_ptr_abs(reinterpret_cast<void*>(&halt_ebp_)));
+
+	// Faults are blamed on this script only once its halt state is set up.
+	as.push(dword_ptr(eax, offsetof(ExecutionContext, jitter)));
+	as.mov(dword_ptr(eax, offsetof(ExecutionContext, jitter)), 0);
+
+	// Switch to the thread's JIT stack on the outermost call. ebx is not
+	// used by compiled code and natives preserve it.
+	as.mov(ebx, esp);
+	as.cmp(dword_ptr(eax, offsetof(ExecutionContext, call_depth)), 0);
+	as.jne(L_nested);
+	as.mov(esp, dword_ptr(eax, offsetof(ExecutionContext, stack_top)));
+	as.bind(L_nested);
+	as.add(dword_ptr(eax, offsetof(ExecutionContext, call_depth)), 1);
+
+	// Copy the argument size and the arguments in one go.
+	as.mov(ecx, dword_ptr(esi));
+	as.shr(ecx, 2);
+	as.add(ecx, 1);
+	as.mov(edi, ecx);
+	as.shl(edi, 2);
+	as.sub(esp, edi);
+	as.mov(edi, esp);
+	as.cld();
+	as.rep_movsd();
+
+	// A halt returns to right after the call.
+	as.lea(eax, dword_ptr(esp, -4));
+	as.mov(dword_ptr_abs(reinterpret_cast<void*>(&halt_esp_)), eax);
+	as.mov(dword_ptr_abs(reinterpret_cast<void*>(&halt_ebp_)), ebp);
+	as.mov(eax, dword_ptr(ebx, 40)); // context
+	as.mov(dword_ptr(eax, offsetof(ExecutionContext, jitter)), reinterpret_cast<sysint_t>(this));
+	as.call(edx);
+
+	// The context is reached through EBX, whatever the callee left on the
+	// stack.
+	as.mov(esp, ebx);
+	as.mov(ecx, dword_ptr(ebx, 40)); // context
+	as.sub(dword_ptr(ecx, offsetof(ExecutionContext, call_depth)), 1);
+	as.pop(dword_ptr(ecx, offsetof(ExecutionContext, jitter)));
+	as.pop(dword_ptr_abs(reinterpret_cast<void*>(&halt_ebp_)));
+	as.pop(dword_ptr_abs(reinterpret_cast<void*>(&halt_esp_)));
+	as.pop(ebp);
+	as.pop(edi);
+	as.pop(esi);
+	as.pop(ebx);
+	as.ret();
+}
+
+void Jitter::broadcast_thunk(AsmJit::Assembler &as) {
+	using AsmJit::eax;
+	using AsmJit::ebx;
+	using AsmJit::ecx;
+	using AsmJit::edx;
+	using AsmJit::esi;
+	using AsmJit::edi;
+	using AsmJit::esp;
+	using AsmJit::ebp;
+	using AsmJit::dword_ptr;
+	using AsmJit::dword_ptr_abs;
+
+	AsmJit::Label L_nested = as.newLabel();
+	AsmJit::Label L_loop = as.newLabel();
+	AsmJit::Label L_done = as.newLabel();
+
+	// Compiled code preserves EBP across calls and halts return with the
+	// EBP they were given, so the arguments are reached through it:
+	// [ebp + 20] = targets, [ebp + 24] = count, [ebp + 28] = params,
+	// [ebp + 32] = retvals, [ebp + 36] = context, [ebp + 40] = version.
+	as.push(ebx);
+	as.push(esi);
+	as.push(edi);
+	as.push(ebp);
+	as.mov(ebp, esp);
+
+	// [ebx - 4] holds ESP after switching stacks: the halt state of each
+	// target is saved right below it.
+	as.mov(eax, dword_ptr(ebp, 36));
+	as.push(dword_ptr(eax, offsetof(ExecutionContext, jitter)));
+	as.mov(dword_ptr(eax, offsetof(ExecutionContext, jitter)), 0);
+	as.mov(ebx, esp);
+	as.sub(esp, 4);
+	as.cmp(dword_ptr(eax, offsetof(ExecutionContext, call_depth)), 0);
+	as.jne(L_nested);
+	as.mov(esp, dword_ptr(eax, offsetof(ExecutionContext, stack_top)));
+	as.bind(L_nested);
+	as.mov(dword_ptr(ebx, -4), esp);
+	as.add(dword_ptr(eax, offsetof(ExecutionContext, call_depth)), 1);
+
+	// Stop as soon as a call has loaded or unloaded a script: the targets
+	// that are left may be gone.
+	as.bind(L_loop);
+	as.cmp(dword_ptr(ebp, 24), 0);
+	as.je(L_done);
+	as.mov(eax, dword_ptr_abs(reinterpret_cast<void*>(&instances_version_)));
+	as.cmp(eax, dword_ptr(ebp, 40));
+	as.jne(L_done);
+	as.mov(edx, dword_ptr(ebp, 20));
+
+	// Save the halt state of the target's Jitter. Reset the error code and
+	// the STK and HEA to restore on abort, like amx_Exec() does.
+	as.mov(eax, dword_ptr(edx, offsetof(BroadcastTarget, halt_esp)));
+	as.push(dword_ptr(eax));
+	as.mov(eax, dword_ptr(edx, offsetof(BroadcastTarget, halt_ebp)));
+	as.push(dword_ptr(eax));
+	as.mov(eax, dword_ptr(edx, offsetof(BroadcastTarget, amx)));
+	as.mov(dword_ptr(eax, offsetof(AMX, error)), AMX_ERR_NONE);
+	as.mov(ecx, dword_ptr(eax, offsetof(AMX, hea)));
+	as.mov(dword_ptr(eax, offsetof(AMX, reset_hea)), ecx);
+	as.mov(ecx, dword_ptr(eax, offsetof(AMX, stk)));
+	as.mov(dword_ptr(eax, offsetof(AMX, reset_stk)), ecx);
+
+	as.mov(esi, dword_ptr(ebp, 28));
+	as.mov(ecx, dword_ptr(esi));
+	as.shr(ecx, 2);
+	as.add(ecx, 1);
+	as.mov(eax, ecx);
+	as.shl(eax, 2);
+	as.sub(esp, eax);
+	as.mov(edi, esp);
+	as.cld();
+	as.rep_movsd();
+
+	as.lea(eax, dword_ptr(esp, -4));
+	as.mov(ecx, dword_ptr(edx, offsetof(BroadcastTarget, halt_esp)));
+	as.mov(dword_ptr(ecx), eax);
+	as.mov(ecx, dword_ptr(edx, offsetof(BroadcastTarget, halt_ebp)));
+	as.mov(dword_ptr(ecx), ebp);
+	as.mov(eax, dword_ptr(ebp, 36));
+	as.mov(ecx, dword_ptr(edx, offsetof(BroadcastTarget, jitter)));
+	as.mov(dword_ptr(eax, offsetof(ExecutionContext, jitter)), ecx);
+	as.mov(ecx, dword_ptr(edx, offsetof(BroadcastTarget, entry)));
+	as.call(dword_ptr(ecx));
+
+	as.mov(ecx, dword_ptr(ebp, 32));
+	as.mov(dword_ptr(ecx), eax);
+	as.mov(ecx, dword_ptr(ebp, 36));
+	as.mov(dword_ptr(ecx, offsetof(ExecutionContext, jitter)), 0);
+
+	// Find the saved halt state through EBX, whatever the callee left on
+	// the stack.
+	as.mov(esp, dword_ptr(ebx, -4));
+	as.sub(esp, 8);
+	as.mov(edx, dword_ptr(ebp, 20));
+	as.mov(eax, dword_ptr(edx, offsetof(BroadcastTarget, halt_ebp)));
+	as.pop(dword_ptr(eax));
+	as.mov(eax, dword_ptr(edx, offsetof(BroadcastTarget, halt_esp)));
+	as.pop(dword_ptr(eax));
+
+	as.add(dword_ptr(ebp, 20), static_cast<sysint_t>(sizeof(BroadcastTarget)));
+	as.add(dword_ptr(ebp, 32), static_cast<sysint_t>(sizeof(cell)));
+	as.sub(dword_ptr(ebp, 24), 1);
+	as.jmp(L_loop);
+
+	// Return the number of targets not called.
+	as.bind(L_done);
+	as.mov(eax, dword_ptr(ebp, 36));
+	as.sub(dword_ptr(eax, offsetof(ExecutionContext, call_depth)), 1);
+	as.mov(esp, ebx);
+	as.pop(dword_ptr(eax, offsetof(ExecutionContext, jitter)));
+	as.mov(eax, dword_ptr(ebp, 24));
+	as.pop(ebp);
+	as.pop(edi);
+	as.pop(esi);
+	as.pop(ebx);
+	as.ret();
+}
+
+AsmJit::Label &Jitter::HaltLabel(AsmJit::Assembler &as, cell error_code) {
+	HaltLabelMap::iterator iterator = halt_labels_.find(error_code);
+	if (iterator != halt_labels_.end()) {
+		return iterator->second;
+	}
+	return halt_labels_.insert(std::make_pair(error_code, as.newLabel())).first->second;
+}
+
+AsmJit::Label &Jitter::DeoptLabel(AsmJit::Assembler &as, cell cip) {
+	DeoptLabelMap::iterator iterator = deopt_labels_.find(cip);
+	if (iterator != deopt_labels_.end()) {
+		return iterator->second;
+	}
+	return deopt_labels_.insert(std::make_pair(cip, as.newLabel())).first->second;
+}
+
+void Jitter::guard_write(AsmJit::Assembler &as, const AmxInstruction &instr) {
+	using AsmJit::eax;
+	using AsmJit::ecx;
+	using AsmJit::edx;
+	using AsmJit::ebp;
+	using AsmJit::dword_ptr;
+	using AsmJit::dword_ptr_abs;
+
+	switch (instr.GetOpcode()) {
+		case OP_STOR_PRI:
+		case OP_STOR_ALT:
+		case OP_ZERO:
+		case OP_INC:
+		case OP_DEC:
+			if (speculated_.find(instr.GetOperand()) != speculated_.end()) {
+				// The global is written after all.
+				as.push(eax);
+				as.push(ecx);
+				as.push(static_cast<sysint_t>(sizeof(cell)));
+				as.push(instr.GetOperand());
+				as.push(reinterpret_cast<sysint_t>(this));
+				as.call(reinterpret_cast<void*>(::InvalidateGlobals));
+				as.pop(ecx);
+				as.pop(eax);
+			}
 			break;
-		case OP_LEQ:
-			// PRI = PRI <= ALT ? 1 : 0 (unsigned)
-			as.cmp(eax, ecx);
-			as.setbe(al);
-			as.movzx(eax, al);
+		case OP_STOR_I:
+			guard_range(as, ecx, sizeof(cell));
 			break;
-		case OP_GRTR:
-			// PRI = PRI > ALT ? 1 : 0 (unsigned)
-			as.cmp(eax, ecx);
-			as.seta(al);
-			as.movzx(eax, al);
+		case OP_STRB_I:
+		case OP_MOVS:
+		case OP_FILL:
+			guard_range(as, ecx, instr.GetOperand());
 			break;
-		case OP_GEQ:
-			// PRI = PRI >= ALT ? 1 : 0 (unsigned)
-			as.cmp(eax, ecx);
-			as.setae(al);
-			as.movzx(eax, al);
+		case OP_SREF_PRI:
+		case OP_SREF_ALT:
+			as.mov(edx, dword_ptr_abs(reinterpret_cast<void*>(GetAmxData() + instr.GetOperand())));
+			guard_range(as, edx, sizeof(cell));
 			break;
-		case OP_SLESS:
-			// PRI = PRI < ALT ? 1 : 0 (signed)
-			as.cmp(eax, ecx);
-			as.setl(al);
-			as.movzx(eax, al);
+		case OP_SREF_S_PRI:
+		case OP_SREF_S_ALT:
+			as.mov(edx, dword_ptr(ebp, instr.GetOperand()));
+			guard_range(as, edx, sizeof(cell));
 			break;
-		case OP_SLEQ:
-			// PRI = PRI <= ALT ? 1 : 0 (signed)
-			as.cmp(eax, ecx);
-			as.setle(al);
-			as.movzx(eax, al);
+		default:
 			break;
-		case OP_SGRTR:
-			// PRI = PRI > ALT ? 1 : 0 (signed)
-			as.cmp(eax, ecx);
-			as.setg(al);
-			as.movzx(eax, al);
+	}
+}
+
+void Jitter::guard_range(AsmJit::Assembler &as, const AsmJit::GPReg &address, cell size) {
+	using AsmJit::eax;
+	using AsmJit::ecx;
+
+	// Only writes that overlap [speculated_min_, speculated_max_ + 4) are
+	// looked at closer. Preserves PRI and ALT.
+	AsmJit::Label L_done = as.newLabel();
+	as.cmp(address, speculated_max_ + static_cast<cell>(sizeof(cell)));
+	branch(as, AsmJit::C_GE, L_done);
+	as.cmp(address, speculated_min_ - size);
+	branch(as, AsmJit::C_LE, L_done);
+	as.push(eax);
+	as.push(ecx);
+	as.push(size);
+	as.push(address);
+	as.push(reinterpret_cast<sysint_t>(this));
+	as.call(reinterpret_cast<void*>(::InvalidateGlobals));
+	as.pop(ecx);
+	as.pop(eax);
+	as.bind(L_done);
+}
+
+void Jitter::revalidate(AsmJit::Assembler &as) {
+	using AsmJit::eax;
+	using AsmJit::ecx;
+
+	// Preserves PRI and ALT.
+	as.push(eax);
+	as.push(ecx);
+	as.push(reinterpret_cast<sysint_t>(this));
+	as.call(reinterpret_cast<void*>(::RevalidateGlobals));
+	as.pop(ecx);
+	as.pop(eax);
+}
+
+void Jitter::deopt_check(AsmJit::Assembler &as, cell cip) {
+	if (cip >= 0) {
+		as.cmp(AsmJit::dword_ptr_abs(reinterpret_cast<void*>(&deoptimized_)), 0);
+		branch(as, AsmJit::C_NE, DeoptLabel(as, cip));
+	}
+}
+
+AsmJit::Label &Jitter::TraceLabel(AsmJit::Assembler &as, TraceLabelMap &labels, cell cip) {
+	TraceLabelMap::iterator iterator = labels.find(cip);
+	if (iterator != labels.end()) {
+		return iterator->second;
+	}
+	return labels.insert(std::make_pair(cip, as.newLabel())).first->second;
+}
+
+void Jitter::trace_check(AsmJit::Assembler &as, cell cip) {
+	using AsmJit::edx;
+
+	// Jump to the trace of the loop if it's compiled. Otherwise count down
+	// to zero, then try to compile it.
+	std::size_t index = trace_counters_[cip];
+	cell *countdown = &trace_countdowns_[index];
+	void **slot = &trace_slots_[index];
+	AsmJit::Label L_count = as.newLabel();
+	AsmJit::Label L_continue = as.newLabel();
+	as.mov(edx, AsmJit::dword_ptr_abs(reinterpret_cast<void*>(slot)));
+	as.test(edx, edx);
+	branch(as, AsmJit::C_Z, L_count);
+	as.jmp(edx);
+	as.bind(L_count);
+	as.sub(AsmJit::dword_ptr_abs(reinterpret_cast<void*>(countdown)), 1);
+	branch(as, AsmJit::C_NZ, L_continue);
+	as.call(TraceLabel(as, trace_entries_, cip));
+	as.bind(L_continue);
+}
+
+void Jitter::trace_step(AsmJit::Assembler &as, const AmxInstruction &instr, const TraceStep &step) {
+	using AsmJit::eax;
+	using AsmJit::ecx;
+	using AsmJit::ebp;
+	using AsmJit::esp;
+	using AsmJit::dword_ptr;
+
+	cell cip = GetInstrAddress(instr);
+	switch (step.kind) {
+		case TraceStep::TAKEN:
+		case TraceStep::NOT_TAKEN: {
+			if (instr.GetOpcode() == OP_JZER || instr.GetOpcode() == OP_JNZ) {
+				as.cmp(eax, 0);
+			} else {
+				as.cmp(eax, ecx);
+			}
+			AsmJit::CONDITION cc = GetJumpCondition(instr.GetOpcode());
+			if (step.kind == TraceStep::TAKEN) {
+				cc = AsmJit::negateCondition(cc);
+			}
+			branch(as, cc, TraceLabel(as, trace_exits_, step.exit));
 			break;
-		case OP_SGEQ:
-			// PRI = PRI >= ALT ? 1 : 0 (signed)
-			as.cmp(eax, ecx);
-			as.setge(al);
-			as.movzx(eax, al);
+		}
+		case TraceStep::CALL: {
+			// Call the function in generic code.
+			cell fn_addr = instr.GetOperand() - reinterpret_cast<cell>(GetAmxCode());
+			as.call(GetResumeAddress(fn_addr));
+			as.add(esp, dword_ptr(esp));
+			as.add(esp, 4);
 			break;
-		case OP_EQ_C_PRI: // value
-			// PRI = PRI == value ? 1 : 0
-			as.cmp(eax, instr.GetOperand());
-			as.sete(al);
-			as.movzx(eax, al);
+		}
+		case TraceStep::INLINED_CALL: {
+			// Push the address the CALL would return to in generic code so
+			// that the frame looks the same if the trace is left in the 
+			// called function.
+			std::map<cell, sysint_t>::const_iterator ret = call_returns_.find(cip);
+			assert(ret != call_returns_.end());
+			as.push(reinterpret_cast<sysint_t>(generic_code_.code) + ret->second);
 			break;
-		case OP_EQ_C_ALT: // value
-			// PRI = ALT == value ? 1 : 0
-			as.cmp(ecx, instr.GetOperand());
-			as.sete(al);
-			as.movzx(eax, al);
+		}
+		case TraceStep::INLINED_RETURN:
+			// Return and remove arguments like the CALL does.
+			as.pop(ebp);
+			as.add(esp, 4);
+			as.add(esp, dword_ptr(esp));
+			as.add(esp, 4);
 			break;
-		case OP_INC_PRI:
-			// PRI = PRI + 1
-			as.inc(eax);
+		case TraceStep::EXIT:
+			branch(as, TraceLabel(as, trace_exits_, step.exit));
 			break;
-		case OP_INC_ALT:
-			// ALT = ALT + 1
-			as.inc(ecx);
+		default:
 			break;
-		case OP_INC: // address
-			// [address] = [address] + 1
-			as.inc(dword_ptr_abs(reinterpret_cast<void*>(GetAmxData() + instr.GetOperand())));
+	}
+}
+
+void Jitter::trace_thunks(AsmJit::Assembler &as) {
+	using AsmJit::eax;
+	using AsmJit::ecx;
+	using AsmJit::edx;
+	using AsmJit::esp;
+
+	// Called from a loop header: enter the trace if there's one, otherwise
+	// return to the loop. Preserves PRI and ALT.
+	for (TraceLabelMap::iterator iterator = trace_entries_.begin(); 
+			iterator != trace_entries_.end(); ++iterator) 
+	{
+		AsmJit::Label L_return = as.newLabel();
+		as.bind(iterator->second);
+		as.push(eax);
+		as.push(ecx);
+		as.push(iterator->first);
+		as.push(reinterpret_cast<sysint_t>(this));
+		as.call(reinterpret_cast<void*>(::EnterTrace));
+		as.mov(edx, eax);
+		as.pop(ecx);
+		as.pop(eax);
+		as.test(edx, edx);
+		branch(as, AsmJit::C_Z, L_return);
+		as.add(esp, 4);
+		as.jmp(edx);
+		as.bind(L_return);
+		as.ret();
+	}
+
+	// Leave a trace for generic code.
+	for (TraceLabelMap::iterator iterator = trace_exits_.begin(); 
+			iterator != trace_exits_.end(); ++iterator) 
+	{
+		as.bind(iterator->second);
+		as.jmp(GetResumeAddress(iterator->first));
+	}
+}
+
+void Jitter::deopt_thunks(AsmJit::Assembler &as) {
+	using AsmJit::eax;
+	using AsmJit::ecx;
+	using AsmJit::edx;
+	using AsmJit::esp;
+	using AsmJit::dword_ptr;
+
+	if (deopt_labels_.empty()) {
+		return;
+	}
+
+	// Each thunk pushes its AMX address and goes to the common part, which
+	// looks up the same place in generic code and continues there.
+	AsmJit::Label L_resume = as.newLabel();
+	for (DeoptLabelMap::iterator iterator = deopt_labels_.begin(); 
+			iterator != deopt_labels_.end(); ++iterator) 
+	{
+		as.bind(iterator->second);
+		as.push(iterator->first);
+		branch(as, L_resume);
+	}
+
+	as.bind(L_resume);
+	as.push(eax);
+	as.push(ecx);
+	as.push(dword_ptr(esp, 8));
+	as.push(reinterpret_cast<sysint_t>(this));
+	as.call(reinterpret_cast<void*>(::GetResumeAddress));
+	as.mov(edx, eax);
+	as.pop(ecx);
+	as.pop(eax);
+	as.add(esp, 4);
+	as.jmp(edx);
+}
+
+bool Jitter::native_float(AsmJit::Assembler &as, const NativeCall &) {
+	using AsmJit::esp;
+	using AsmJit::eax;
+	using AsmJit::dword_ptr;
+
+	if (GetTargetFeatures().Has(TargetFeatures::SSE2)) {
+		as.cvtsi2ss(AsmJit::xmm0, dword_ptr(esp, 4));
+		as.movd(eax, AsmJit::xmm0);
+		return true;
+	}
+
+	as.fild(dword_ptr(esp, 4));
+	as.sub(esp, 4);
+	as.fstp(dword_ptr(esp));
+	as.mov(eax, dword_ptr(esp));
+	as.add(esp, 4);
+	return true;
+}
+
+bool Jitter::native_floatabs(AsmJit::Assembler &as, const NativeCall &) {
+	using AsmJit::esp;
+	using AsmJit::eax;
+	using AsmJit::dword_ptr;
+	// Clear the sign bit, no need for the FPU.
+	as.mov(eax, dword_ptr(esp, 4));
+	as.and_(eax, 0x7FFFFFFF);
+	return true;
+}
+
+bool Jitter::native_floatadd(AsmJit::Assembler &as, const NativeCall &) {
+	using AsmJit::esp;
+	using AsmJit::eax;
+	using AsmJit::dword_ptr;
+
+	if (GetTargetFeatures().Has(TargetFeatures::SSE2)) {
+		as.movss(AsmJit::xmm0, dword_ptr(esp, 4));
+		as.addss(AsmJit::xmm0, dword_ptr(esp, 8));
+		as.movd(eax, AsmJit::xmm0);
+		return true;
+	}
+
+	as.fld(dword_ptr(esp, 4));
+	as.fadd(dword_ptr(esp, 8));
+	as.sub(esp, 4);
+	as.fstp(dword_ptr(esp));
+	as.mov(eax, dword_ptr(esp));
+	as.add(esp, 4);
+	return true;
+}
+
+bool Jitter::native_floatsub(AsmJit::Assembler &as, const NativeCall &) {
+	using AsmJit::esp;
+	using AsmJit::eax;
+	using AsmJit::dword_ptr;
+
+	if (GetTargetFeatures().Has(TargetFeatures::SSE2)) {
+		as.movss(AsmJit::xmm0, dword_ptr(esp, 4));
+		as.subss(AsmJit::xmm0, dword_ptr(esp, 8));
+		as.movd(eax, AsmJit::xmm0);
+		return true;
+	}
+
+	as.fld(dword_ptr(esp, 4));
+	as.fsub(dword_ptr(esp, 8));
+	as.sub(esp, 4);
+	as.fstp(dword_ptr(esp));
+	as.mov(eax, dword_ptr(esp));
+	as.add(esp, 4);
+	return true;
+}
+
+bool Jitter::native_floatmul(AsmJit::Assembler &as, const NativeCall &) {
+	using AsmJit::esp;
+	using AsmJit::eax;
+	using AsmJit::dword_ptr;
+
+	if (GetTargetFeatures().Has(TargetFeatures::SSE2)) {
+		as.movss(AsmJit::xmm0, dword_ptr(esp, 4));
+		as.mulss(AsmJit::xmm0, dword_ptr(esp, 8));
+		as.movd(eax, AsmJit::xmm0);
+		return true;
+	}
+
+	as.fld(dword_ptr(esp, 4));
+	as.fmul(dword_ptr(esp, 8));
+	as.sub(esp, 4);
+	as.fstp(dword_ptr(esp));
+	as.mov(eax, dword_ptr(esp));
+	as.add(esp, 4);
+	return true;
+}
+
+bool Jitter::native_floatdiv(AsmJit::Assembler &as, const NativeCall &) {
+	using AsmJit::esp;
+	using AsmJit::eax;
+	using AsmJit::dword_ptr;
+
+	if (GetTargetFeatures().Has(TargetFeatures::SSE2)) {
+		as.movss(AsmJit::xmm0, dword_ptr(esp, 4));
+		as.divss(AsmJit::xmm0, dword_ptr(esp, 8));
+		as.movd(eax, AsmJit::xmm0);
+		return true;
+	}
+
+	as.fld(dword_ptr(esp, 4));
+	as.fdiv(dword_ptr(esp, 8));
+	as.sub(esp, 4);
+	as.fstp(dword_ptr(esp));
+	as.mov(eax, dword_ptr(esp));
+	as.add(esp, 4);
+	return true;
+}
+
+bool Jitter::native_floatsqroot(AsmJit::Assembler &as, const NativeCall &) {
+	using AsmJit::esp;
+	using AsmJit::eax;
+	using AsmJit::dword_ptr;
+
+	if (GetTargetFeatures().Has(TargetFeatures::SSE2)) {
+		as.sqrtss(AsmJit::xmm0, dword_ptr(esp, 4));
+		as.movd(eax, AsmJit::xmm0);
+		return true;
+	}
+
+	as.fld(dword_ptr(esp, 4));
+	as.fsqrt();
+	as.sub(esp, 4);
+	as.fstp(dword_ptr(esp));
+	as.mov(eax, dword_ptr(esp));
+	as.add(esp, 4);
+	return true;
+}
+
+bool Jitter::native_floatlog(AsmJit::Assembler &as, const NativeCall &) {
+	using AsmJit::esp;
+	using AsmJit::eax;
+	using AsmJit::st;
+	using AsmJit::dword_ptr;
+	as.fld1();
+	as.fld(dword_ptr(esp, 8));
+	as.fyl2x();
+	as.fld1();
+	as.fdivrp(st(1));
+	as.fld(dword_ptr(esp, 4));
+	as.fyl2x();
+	as.sub(esp, 4);
+	as.fstp(dword_ptr(esp));
+	as.mov(eax, dword_ptr(esp));
+	as.add(esp, 4);
+	return true;
+}
+
+bool Jitter::native_strlen(AsmJit::Assembler &as, const NativeCall &call) {
+	if (!GetTargetFeatures().Has(TargetFeatures::SSE2)) {
+		return false;
+	}
+	call_replacement(as, reinterpret_cast<void*>(StrLen), call.GetAddress());
+	return true;
+}
+
+bool Jitter::native_strcmp(AsmJit::Assembler &as, const NativeCall &call) {
+	if (!GetTargetFeatures().Has(TargetFeatures::SSE2)) {
+		return false;
+	}
+	call_replacement(as, reinterpret_cast<void*>(StrCmp), call.GetAddress());
+	return true;
+}
+
+bool Jitter::native_strfind(AsmJit::Assembler &as, const NativeCall &call) {
+	if (!GetTargetFeatures().Has(TargetFeatures::SSE2)) {
+		return false;
+	}
+	call_replacement(as, reinterpret_cast<void*>(StrFind), call.GetAddress());
+	return true;
+}
+
+bool Jitter::native_strcat(AsmJit::Assembler &as, const NativeCall &call) {
+	if (!GetTargetFeatures().Has(TargetFeatures::SSE2)) {
+		return false;
+	}
+	call_replacement(as, reinterpret_cast<void*>(StrCat), call.GetAddress());
+	return true;
+}
+
+bool Jitter::native_strmid(AsmJit::Assembler &as, const NativeCall &call) {
+	if (!GetTargetFeatures().Has(TargetFeatures::SSE2)) {
+		return false;
+	}
+	call_replacement(as, reinterpret_cast<void*>(StrMid), call.GetAddress());
+	return true;
+}
+
+bool Jitter::native_format(AsmJit::Assembler &as, const NativeCall &call) {
+	using AsmJit::esp;
+	using AsmJit::edx;
+
+	const AmxInstruction *push = GetArgumentPush(call, 3);
+	if (push == 0 || push->GetOpcode() != OP_PUSH_C) {
+		return false;
+	}
+
+	cell address = push->GetOperand();
+	std::size_t push_index = push - &call.GetInstructions()[0];
+	if (!IsConstantString(call.GetInstructions(), address, push_index)) {
+		return false;
+	}
+
+	FormatPlan plan;
+	if (!plan.Parse(reinterpret_cast<cell*>(GetAmxData() + address))) {
+		return false;
+	}
+
+	// The sizing pass only needs an address of the same size.
+	const FormatPlan *plan_ptr = &plan;
+	if (!sizing_) {
+		new_format_plans_.push_back(plan);
+		plan_ptr = &new_format_plans_.back();
+	}
+
+	// FormatWithPlan(amx, params, plan, native)
+	as.mov(edx, esp);
+	as.push(call.GetAddress());
+	as.push(reinterpret_cast<sysint_t>(plan_ptr));
+	as.push(edx);
+	as.push(reinterpret_cast<sysint_t>(amx_));
+	as.call(reinterpret_cast<void*>(FormatWithPlan));
+	as.add(esp, 16);
+	return true;
+}
+
+bool Jitter::GetConstantArgument(const NativeCall &call, int n, std::string &s) const {
+	const AmxInstruction *push = GetArgumentPush(call, n);
+	if (push == 0 || push->GetOpcode() != OP_PUSH_C) {
+		return false;
+	}
+	std::size_t push_index = push - &call.GetInstructions()[0];
+	if (!IsConstantString(call.GetInstructions(), push->GetOperand(), push_index)) {
+		return false;
+	}
+	s.clear();
+	for (const cell *c = reinterpret_cast<cell*>(GetAmxData() + push->GetOperand()); *c != 0; c++) {
+		if (*c < 0 || *c > 0xFF) {
+			return false; // packed
+		}
+		s.push_back(static_cast<char>(*c));
+	}
+	return true;
+}
+
+bool Jitter::native_funcidx(AsmJit::Assembler &as, const NativeCall &call) {
+	using AsmJit::eax;
+
+	std::string name;
+	if (!GetConstantArgument(call, 1, name)) {
+		return false;
+	}
+	int index;
+	if (FindPublic(name.c_str(), &index) != AMX_ERR_NONE) {
+		index = -1;
+	}
+	as.mov(eax, index);
+	return true;
+}
+
+bool Jitter::native_CallLocalFunction(AsmJit::Assembler &as, const NativeCall &call) {
+	using AsmJit::eax;
+	using AsmJit::edx;
+	using AsmJit::ebp;
+	using AsmJit::esp;
+	using AsmJit::dword_ptr;
+	using AsmJit::dword_ptr_abs;
+
+	std::string name;
+	std::string format;
+	if (!GetConstantArgument(call, 1, name) || !GetConstantArgument(call, 2, format)) {
+		return false;
+	}
+	int index;
+	if (FindPublic(name.c_str(), &index) != AMX_ERR_NONE) {
+		return false;
+	}
+
+	// Only arguments that are passed by value. Extra arguments are passed by
+	// reference, so their values are loaded from AMX memory.
+	const AmxInstruction &count = call.GetInstructions()[call.GetIndex() - 1];
+	int num_args = static_cast<int>(format.size());
+	if (count.GetOperand() != static_cast<cell>((num_args + 2) * sizeof(cell))
+			|| format.find_first_not_of("difc") != std::string::npos) {
+		return false;
+	}
+
+	// The call gets its own halt point, so that an error in the callee ends
+	// only the callee like in a nested amx_Exec(). The caller's error code
+	// is kept, and the heap is reset if the callee fails.
+	as.push(dword_ptr_abs(reinterpret_cast<void*>(&halt_esp_)));
+	as.push(dword_ptr_abs(reinterpret_cast<void*>(&halt_ebp_)));
+	as.push(dword_ptr_abs(reinterpret_cast<void*>(&amx_->error)));
+	as.push(dword_ptr_abs(reinterpret_cast<void*>(&amx_->hea)));
+	as.mov(dword_ptr_abs(reinterpret_cast<void*>(&amx_->error)), AMX_ERR_NONE);
+
+	// Push the values in reverse order; each push moves the next argument 
+	// to the same offset from ESP.
+	for (int n = 0; n < num_args; n++) {
+		as.mov(edx, dword_ptr(esp, (num_args + 6) * sizeof(cell)));
+		as.mov(edx, dword_ptr(edx, reinterpret_cast<sysint_t>(GetAmxData())));
+		as.push(edx);
+	}
+	as.push(static_cast<sysint_t>(num_args * sizeof(cell)));
+
+	// A halt returns to right after the call.
+	as.lea(edx, dword_ptr(esp, -4));
+	as.mov(dword_ptr_abs(reinterpret_cast<void*>(&halt_esp_)), edx);
+	as.mov(dword_ptr_abs(reinterpret_cast<void*>(&halt_ebp_)), ebp);
+	as.call(dword_ptr_abs(reinterpret_cast<void*>(&public_entries_[index])));
+	as.add(esp, static_cast<sysint_t>((num_args + 1) * sizeof(cell)));
+
+	AsmJit::Label L_ok = as.newLabel();
+	as.cmp(dword_ptr_abs(reinterpret_cast<void*>(&amx_->error)), AMX_ERR_NONE);
+	as.short_je(L_ok);
+	as.xor_(eax, eax);
+	as.mov(edx, dword_ptr(esp));
+	as.mov(dword_ptr_abs(reinterpret_cast<void*>(&amx_->hea)), edx);
+	as.bind(L_ok);
+	as.add(esp, 4);
+	as.pop(dword_ptr_abs(reinterpret_cast<void*>(&amx_->error)));
+	as.pop(dword_ptr_abs(reinterpret_cast<void*>(&halt_ebp_)));
+	as.pop(dword_ptr_abs(reinterpret_cast<void*>(&halt_esp_)));
+	return true;
+}
+
+bool Jitter::native_CallRemoteFunction(AsmJit::Assembler &as, const NativeCall &call) {
+	call_replacement(as, reinterpret_cast<void*>(&Jitter::CallRemoteFunction), call.GetAddress());
+	return true;
+}
+
+// static
+cell Jitter::CallRemoteFunction(AMX *amx, cell *params, AMX_NATIVE native) {
+	static const int kMaxArgs = 32;
+
+	AMX_HEADER *hdr = reinterpret_cast<AMX_HEADER*>(amx->base);
+	unsigned char *data = amx->base + hdr->dat;
+
+	// Only unpacked names and formats made of d, i, f and c.
+	std::string strings[2];
+	for (int i = 0; i < 2; i++) {
+		for (const cell *c = reinterpret_cast<cell*>(data + params[1 + i]); *c != 0; c++) {
+			if (*c < 0 || *c > 0xFF) {
+				return native(amx, params);
+			}
+			strings[i].push_back(static_cast<char>(*c));
+		}
+	}
+	const std::string &name = strings[0];
+	const std::string &format = strings[1];
+	int num_args = static_cast<int>(params[0] / sizeof(cell)) - 2;
+	if (num_args != static_cast<int>(format.size()) || num_args > kMaxArgs
+			|| format.find_first_not_of("difc") != std::string::npos) {
+		return native(amx, params);
+	}
+
+	// Scripts that failed to compile or that may not be called by the
+	// server at all must be left to the server.
+	std::vector<BroadcastTarget> targets;
+	bool all_compiled = true;
+	unsigned int version;
+	{
+		AsmJit::AutoLock lock(instances_lock_);
+		version = instances_version_;
+		RemoteCache::const_iterator it = remote_cache_.find(std::make_pair(name, format));
+		if (it != remote_cache_.end()) {
+			targets = it->second;
+		} else {
+			std::vector<BroadcastTarget> gamemode_targets;
+			for (std::size_t i = 0; i < instances_.size() && all_compiled; i++) {
+				Jitter *jitter = instances_[i];
+				all_compiled = jitter->code_ != 0 && jitter->script_kind_ != SCRIPT_UNKNOWN;
+				int index;
+				if (all_compiled && jitter->FindPublic(name.c_str(), &index) == AMX_ERR_NONE) {
+					BroadcastTarget target;
+					target.jitter = jitter;
+					target.serial = jitter->serial_;
+					target.index = index;
+					target.entry = &jitter->public_entries_[index];
+					target.halt_esp = &jitter->halt_esp_;
+					target.halt_ebp = &jitter->halt_ebp_;
+					target.amx = jitter->amx_;
+					if (jitter->script_kind_ == SCRIPT_GAMEMODE) {
+						gamemode_targets.push_back(target);
+					} else {
+						targets.push_back(target);
+					}
+				}
+			}
+			if (targets.size() > 1 && !filterscript_order_known_) {
+				all_compiled = false;
+			}
+			targets.insert(targets.end(), gamemode_targets.begin(), gamemode_targets.end());
+			if (all_compiled) {
+				remote_cache_.insert(std::make_pair(std::make_pair(name, format), targets));
+			}
+		}
+	}
+	if (!all_compiled) {
+		return native(amx, params);
+	}
+
+	// Arguments are passed by reference.
+	cell args[kMaxArgs + 1];
+	args[0] = num_args * sizeof(cell);
+	for (int i = 1; i <= num_args; i++) {
+		args[i] = *reinterpret_cast<cell*>(data + params[2 + i]);
+	}
+
+	if (targets.empty()) {
+		return 0;
+	}
+
+	cell retval = 0;
+	std::size_t called = 0;
+	if (!speculation_) {
+		typedef int (*BroadcastThunk)(const BroadcastTarget *targets, int count, 
+		                              const cell *params, cell *retvals, 
+		                              ExecutionContext *context, unsigned int version);
+		std::vector<cell> retvals(targets.size());
+		int left = reinterpret_cast<BroadcastThunk>(broadcast_)(&targets[0], 
+			static_cast<int>(targets.size()), args, &retvals[0], GetExecutionContext(), version);
+		called = targets.size() - left;
+		if (called > 0) {
+			retval = retvals[called - 1];
+		}
+	}
+
+	// The rest is called one by one: speculated code may have to be 
+	// compiled again afterwards, and targets may have been unloaded by an
+	// earlier call.
+	for (std::size_t i = called; i < targets.size(); i++) {
+		if (IsLiveTarget(targets[i])) {
+			AMX *target_amx = targets[i].amx;
+			target_amx->reset_hea = target_amx->hea;
+			target_amx->reset_stk = target_amx->stk;
+			targets[i].jitter->CallPublic(targets[i].index, args, &retval);
+		}
+	}
+	return retval;
+}
+
+// static
+bool Jitter::IsLiveTarget(const BroadcastTarget &target) {
+	AsmJit::AutoLock lock(instances_lock_);
+	return std::find(instances_.begin(), instances_.end(), target.jitter) != instances_.end()
+	    && target.jitter->serial_ == target.serial;
+}
+
+void Jitter::call_replacement(AsmJit::Assembler &as, void *function, cell native) {
+	using AsmJit::esp;
+	using AsmJit::edx;
+	// Call function(amx, params, native), params being the same pointer that
+	// would be passed to the native.
+	as.mov(edx, esp);
+	as.push(native);
+	as.push(edx);
+	as.push(reinterpret_cast<sysint_t>(amx_));
+	as.call(function);
+	as.add(esp, 12);
+}
+
+void Jitter::array_loop(AsmJit::Assembler &as, const LoopIdiom &loop) {
+	using AsmJit::eax;
+	using AsmJit::ecx;
+	using AsmJit::edx;
+	using AsmJit::esi;
+	using AsmJit::edi;
+	using AsmJit::ebp;
+	using AsmJit::esp;
+	using AsmJit::dword_ptr;
+
+	// Run the whole loop at once if the loop variable is within the bounds,
+	// then let the original code check the condition again and leave.
+	AsmJit::Label L_scalar = as.newLabel();
+	as.mov(edx, dword_ptr(ebp, loop.index));
+	as.cmp(edx, 0);
+	branch(as, AsmJit::C_L, L_scalar);
+	as.cmp(edx, loop.count);
+	branch(as, AsmJit::C_GE, L_scalar);
+
+	as.mov(ecx, loop.count);
+	as.sub(ecx, edx); // number of iterations
+
+	switch (loop.kind) {
+		case LoopIdiom::FILL:
+			if (loop.value.type == LoopOperand::CONSTANT) {
+				as.mov(eax, loop.value.value);
+			} else {
+				as.mov(eax, GetLoopOperandPtr(loop.value));
+			}
+			array_pointer(as, edi, loop.array);
+			as.rep_stosd();
 			break;
-		case OP_INC_S: // offset
-			// [FRM + offset] = [FRM + offset] + 1
-			as.inc(dword_ptr(ebp, instr.GetOperand()));
+		case LoopIdiom::COPY:
+			array_pointer(as, esi, loop.source);
+			array_pointer(as, edi, loop.array);
+			as.rep_movsd();
 			break;
-		case OP_INC_I:
-			// [PRI] = [PRI] + 1
-			as.inc(dword_ptr(eax, reinterpret_cast<sysint_t>(GetAmxData())));
+		case LoopIdiom::SUM:
+			array_pointer(as, esi, loop.array);
+			as.push(ecx);
+			as.push(esi);
+			as.call(reinterpret_cast<void*>(SumCells));
+			as.add(esp, 8);
+			as.add(GetLoopOperandPtr(loop.result), eax);
 			break;
-		case OP_DEC_PRI:
-			// PRI = PRI - 1
-			as.dec(eax);
+		case LoopIdiom::COUNT:
+		case LoopIdiom::FIND:
+			array_pointer(as, esi, loop.array);
+			if (loop.kind == LoopIdiom::FIND) {
+				as.push(loop.equal ? 1 : 0);
+			}
+			if (loop.value.type == LoopOperand::CONSTANT) {
+				as.push(loop.value.value);
+			} else {
+				as.push(GetLoopOperandPtr(loop.value));
+			}
+			as.push(ecx);
+			as.push(esi);
+			if (loop.kind == LoopIdiom::FIND) {
+				as.call(reinterpret_cast<void*>(FindCell));
+				as.add(esp, 16);
+				as.add(eax, dword_ptr(ebp, loop.index));
+				as.mov(dword_ptr(ebp, loop.index), eax);
+			} else {
+				as.call(reinterpret_cast<void*>(CountCells));
+				as.add(esp, 12);
+				if (!loop.equal) {
+					// Cells not equal to the value = iterations - cells equal to it.
+					as.mov(edx, loop.count);
+					as.sub(edx, dword_ptr(ebp, loop.index));
+					as.sub(edx, eax);
+					as.mov(eax, edx);
+				}
+				as.add(GetLoopOperandPtr(loop.result), eax);
+			}
 			break;
-		case OP_DEC_ALT:
-			// ALT = ALT - 1
-			as.dec(ecx);
+		case LoopIdiom::MIN:
+		case LoopIdiom::MAX:
+			array_pointer(as, esi, loop.array);
+			as.push(GetLoopOperandPtr(loop.result));
+			as.push(ecx);
+			as.push(esi);
+			as.call(reinterpret_cast<void*>(loop.kind == LoopIdiom::MIN ? MinCell : MaxCell));
+			as.add(esp, 12);
+			as.mov(GetLoopOperandPtr(loop.result), eax);
 			break;
-		case OP_DEC: // address
-			// [address] = [address] - 1
-			as.dec(dword_ptr_abs(reinterpret_cast<void*>(GetAmxData() + instr.GetOperand())));
+	}
+
+	if (loop.kind != LoopIdiom::FIND) {
+		as.mov(dword_ptr(ebp, loop.index), loop.count);
+	}
+	as.bind(L_scalar);
+}
+
+void Jitter::array_pointer(AsmJit::Assembler &as, const AsmJit::GPReg &reg, const LoopOperand &array) {
+	using AsmJit::edx;
+	using AsmJit::ebp;
+	using AsmJit::dword_ptr;
+	// reg = address of array[edx]
+	switch (array.type) {
+		case LoopOperand::LOCAL:
+			as.lea(reg, dword_ptr(ebp, edx, 2, array.value));
 			break;
-		case OP_DEC_S: // offset
-			// [FRM + offset] = [FRM + offset] - 1
-			as.dec(dword_ptr(ebp, instr.GetOperand()));
+		case LoopOperand::GLOBAL:
+			as.mov(reg, reinterpret_cast<sysint_t>(GetAmxData()) + array.value);
+			as.lea(reg, dword_ptr(reg, edx, 2));
 			break;
-		case OP_DEC_I:
-			// [PRI] = [PRI] - 1
-			as.dec(dword_ptr(eax, reinterpret_cast<sysint_t>(GetAmxData())));
+		case LoopOperand::LOCAL_REF:
+			as.mov(reg, dword_ptr(ebp, array.value));
+			as.lea(reg, dword_ptr(reg, edx, 2, reinterpret_cast<sysint_t>(GetAmxData())));
 			break;
-		case OP_MOVS: // number
-			// Copy memory from [PRI] to [ALT]. The parameter
-			// specifies the number of bytes. The blocks should not
-			// overlap.
-			as.lea(esi, dword_ptr(eax, reinterpret_cast<sysint_t>(GetAmxData())));
-			as.lea(edi, dword_ptr(ecx, reinterpret_cast<sysint_t>(GetAmxData())));
-			as.push(ecx);
-			if (instr.GetOperand() % 4 == 0) {
-				as.mov(ecx, instr.GetOperand() / 4);
-				as.rep_movsd();
-			} else if (instr.GetOperand() % 2 == 0) {
-				as.mov(ecx, instr.GetOperand() / 2);
-				as.rep_movsw();
-			} else {
-				as.mov(ecx, instr.GetOperand());
-				as.rep_movsb();
+		default:
+			assert(0);
+	}
+}
+
+AsmJit::Label &Jitter::Label(AsmJit::Assembler &as, LabelMap *label_map, cell address, const std::string &name) {
+	LabelMap::iterator iterator = label_map->find(TaggedAddress(address, name));
+	if (iterator != label_map->end()) {
+		return iterator->second;
+	} else {
+		std::pair<LabelMap::iterator, bool> where = 
+				label_map->insert(std::make_pair(TaggedAddress(address, name), as.newLabel()));
+		return where.first->second;
+	}
+}
+
+std::size_t Jitter::stack_size_ = 1 << 20;
+AsmJit::Lock Jitter::instances_lock_;
+
+// The context of the calling thread, see GetExecutionContext().
+static THREAD_LOCAL ExecutionContext *current_context = 0;
+int Jitter::align_flags_ = Jitter::ALIGN_NONE;
+int Jitter::align_size_ = 16;
+TargetFeatures Jitter::target_;
+bool Jitter::has_target_ = false;
+bool Jitter::speculation_ = false;
+bool Jitter::tracing_ = false;
+std::size_t Jitter::max_clones_ = 16;
+Jitter::RemoteCache Jitter::remote_cache_;
+std::vector<Jitter*> Jitter::instances_;
+unsigned int Jitter::next_serial_ = 0;
+unsigned int Jitter::instances_version_ = 0;
+bool Jitter::filterscript_order_known_ = true;
+void *Jitter::broadcast_ = 0;
+bool Jitter::memoization_ = false;
+
+// static
+void Jitter::SetStackSize(std::size_t stack_size) {
+	stack_size_ = stack_size;
+}
+
+static std::size_t GetPageSize() {
+	#if defined OS_WIN32
+		SYSTEM_INFO info;
+		GetSystemInfo(&info);
+		return info.dwPageSize;
+	#else
+		return sysconf(_SC_PAGESIZE);
+	#endif
+}
+
+void StackBuffer::Allocate(std::size_t size) {
+	if (ptr_ != 0) {
+		return;
+	}
+	std::size_t page_size = GetPageSize();
+	guard_size_ = kStackGuardSize;
+	size_ = guard_size_ + (size + page_size - 1) / page_size * page_size;
+	#if defined OS_WIN32
+		// Committed memory still isn't backed until it's touched.
+		ptr_ = VirtualAlloc(0, size_, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+	#else
+		ptr_ = mmap(0, size_, PROT_READ | PROT_WRITE, 
+		            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		if (ptr_ == MAP_FAILED) {
+			ptr_ = 0;
+		}
+	#endif
+	if (ptr_ != 0) {
+		top_ = reinterpret_cast<char*>(ptr_) + size_ - 4;
+		Protect();
+	} else {
+		size_ = guard_size_ = 0;
+	}
+}
+
+void StackBuffer::Deallocate() {
+	if (ptr_ != 0) {
+		#if defined OS_WIN32
+			VirtualFree(ptr_, 0, MEM_RELEASE);
+		#else
+			munmap(ptr_, size_);
+		#endif
+		ptr_ = top_ = 0;
+		size_ = guard_size_ = 0;
+	}
+}
+
+void StackBuffer::Protect() {
+	#if defined OS_WIN32
+		// Exceptions are dispatched on the faulting stack, so the topmost
+		// guard page is a real guard page: it turns into usable memory for
+		// the exception handler when hit.
+		std::size_t page_size = GetPageSize();
+		char *guard_page = reinterpret_cast<char*>(ptr_) + guard_size_ - page_size;
+		DWORD old_protect;
+		VirtualProtect(ptr_, guard_size_ - page_size, PAGE_NOACCESS, &old_protect);
+		VirtualProtect(guard_page, page_size, PAGE_READWRITE | PAGE_GUARD, &old_protect);
+	#else
+		mprotect(ptr_, guard_size_, PROT_NONE);
+	#endif
+}
+
+// static
+bool Jitter::HaltOnFault(cell error, void **eip, void **esp, void **ebp) {
+	ExecutionContext *context = current_context;
+	if (context == 0 || context->jitter == 0) {
+		return false;
+	}
+	// Same as the halt thunks, the native frames above the script's (if any)
+	// are thrown away.
+	Jitter *jitter = context->jitter;
+	jitter->amx_->error = error;
+	void **halt_esp = reinterpret_cast<void**>(jitter->halt_esp_);
+	*eip = *halt_esp;
+	*esp = halt_esp + 1;
+	*ebp = jitter->halt_ebp_;
+	return true;
+}
+
+// Check if a faulting address is in the guard region of the thread's stack.
+static bool IsStackOverflow(const void *address) {
+	return current_context != 0 && current_context->stack.IsGuardAddress(address);
+}
+
+// Check if a fault comes from code compiled for the script running on this
+// thread (division in compiled code isn't guarded, zero divisors and 
+// INT_MIN / -1 trap instead). Faults in natives are not handled: leaving
+// a native for the halt path would skip its epilogue and lose EBX, which
+// the thunks rely on.
+static bool IsScriptFault(const void *eip) {
+	return current_context != 0 && current_context->jitter != 0 
+	    && current_context->jitter->IsCodeAddress(eip);
+}
+
+// Release the context of a thread that is exiting.
+static void FreeExecutionContext(ExecutionContext *context) {
+	#if defined OS_LINUX
+		if (context->signal_stack != 0) {
+			stack_t stack;
+			std::memset(&stack, 0, sizeof(stack));
+			stack.ss_flags = SS_DISABLE;
+			sigaltstack(&stack, 0);
+			std::free(context->signal_stack);
+		}
+	#endif
+	if (current_context == context) {
+		current_context = 0;
+	}
+	delete context;
+}
+
+#if defined OS_WIN32
+
+static DWORD context_fls_index = FLS_OUT_OF_INDEXES;
+
+static void WINAPI HandleThreadExit(void *context) {
+	if (context != 0) {
+		FreeExecutionContext(reinterpret_cast<ExecutionContext*>(context));
+	}
+}
+
+static void WatchThreadExit(ExecutionContext *context) {
+	if (context_fls_index != FLS_OUT_OF_INDEXES) {
+		FlsSetValue(context_fls_index, context);
+	}
+}
+
+static LONG CALLBACK HandleException(EXCEPTION_POINTERS *info) {
+	EXCEPTION_RECORD *record = info->ExceptionRecord;
+	CONTEXT *context = info->ContextRecord;
+	switch (record->ExceptionCode) {
+		case STATUS_GUARD_PAGE_VIOLATION:
+		case EXCEPTION_ACCESS_VIOLATION: {
+			if (record->NumberParameters < 2) {
+				break;
+			}
+			if (!IsStackOverflow(reinterpret_cast<void*>(record->ExceptionInformation[1]))) {
+				break;
+			}
+			void *eip = reinterpret_cast<void*>(context->Eip);
+			void *esp = reinterpret_cast<void*>(context->Esp);
+			void *ebp = reinterpret_cast<void*>(context->Ebp);
+			if (IsScriptFault(eip) && Jitter::HaltOnFault(AMX_ERR_STACKERR, &eip, &esp, &ebp)) {
+				current_context->overflowed = true;
+				context->Eip = reinterpret_cast<DWORD>(eip);
+				context->Esp = reinterpret_cast<DWORD>(esp);
+				context->Ebp = reinterpret_cast<DWORD>(ebp);
+				return EXCEPTION_CONTINUE_EXECUTION;
 			}
-			as.pop(ecx);
-			break;
-		case OP_CMPS: // number
-			// Compare memory blocks at [PRI] and_ [ALT]. The parameter
-			// specifies the number of bytes. The blocks should not
-			// overlap.
-			as.push(instr.GetOperand());
-			as.lea(edx, dword_ptr(ecx, reinterpret_cast<sysint_t>(GetAmxData())));
-			as.push(edx);
-			as.lea(edx, dword_ptr(eax, reinterpret_cast<sysint_t>(GetAmxData())));
-			as.push(edx);
-			as.call(reinterpret_cast<void*>(std::memcmp));
-			as.call(edx);
-			as.add(esp, 12);
-			break;
-		case OP_FILL: { // number
-			// Fill memory at [ALT] with value in [PRI]. The parameter
-			// specifies the number of bytes, which must be a multiple
-			// of the cell size.
-			AsmJit::Label &L_loop = Label(as, label_map.get(), cip, "loop");
-			as.lea(edi, dword_ptr(ecx, reinterpret_cast<sysint_t>(GetAmxData())));                      // memory start
-			as.lea(esi, dword_ptr(ecx, reinterpret_cast<sysint_t>(GetAmxData()) + instr.GetOperand())); // memory end
-			as.bind(L_loop);
-				as.mov(dword_ptr(edi), eax);
-				as.add(edi, sizeof(cell));
-				as.cmp(edi, esi);
-			as.jl(L_loop); // if edi < esi fill next cell
 			break;
 		}
-		case OP_HALT: // number
-			// Abort execution (exit value in PRI), parameters other than 0
-			// have a special meaning.
-			halt(as, instr.GetOperand());
-			break;
-		case OP_BOUNDS: { // value
-			// Abort execution if PRI > value or_ if PRI < 0.
-			AsmJit::Label &L_halt = Label(as, label_map.get(), cip, "halt");
-			AsmJit::Label &L_good = Label(as, label_map.get(), cip, "good");
-				as.cmp(eax, instr.GetOperand());
-			as.jg(L_halt);
-				as.cmp(eax, 0);
-				as.jl(L_halt);
-				as.jmp(L_good);
-			as.bind(L_halt);
-				halt(as, AMX_ERR_BOUNDS);
-			as.bind(L_good);
+		case EXCEPTION_INT_DIVIDE_BY_ZERO:
+		case EXCEPTION_INT_OVERFLOW: {
+			void *eip = reinterpret_cast<void*>(context->Eip);
+			void *esp = reinterpret_cast<void*>(context->Esp);
+			void *ebp = reinterpret_cast<void*>(context->Ebp);
+			if (IsScriptFault(eip) && Jitter::HaltOnFault(AMX_ERR_DIVIDE, &eip, &esp, &ebp)) {
+				context->Eip = reinterpret_cast<DWORD>(eip);
+				context->Esp = reinterpret_cast<DWORD>(esp);
+				context->Ebp = reinterpret_cast<DWORD>(ebp);
+				return EXCEPTION_CONTINUE_EXECUTION;
+			}
 			break;
 		}
-		case OP_SYSREQ_PRI: {
-			// call system service, service number in PRI
-			AsmJit::Label &L_halt = Label(as, label_map.get(), cip, "halt");			
-				as.push(eax);
-				as.push(reinterpret_cast<sysint_t>(amx_));
-				as.call(reinterpret_cast<void*>(GetNativeAddress));
-				as.add(esp, 8);
-				as.test(eax, eax);
-				as.jz(L_halt);
-				as.push(esp);
-				as.push(reinterpret_cast<sysint_t>(amx_));
-				as.call(eax);
-			as.bind(L_halt);
-				halt(as, AMX_ERR_NOTFOUND);
-			break;
+	}
+	return EXCEPTION_CONTINUE_SEARCH;
+}
+
+static void InstallFaultHandlers() {
+	AddVectoredExceptionHandler(1, HandleException);
+	context_fls_index = FlsAlloc(HandleThreadExit);
+}
+
+#elif defined OS_LINUX
+
+static struct sigaction old_segv_action;
+static struct sigaction old_fpe_action;
+static pthread_key_t context_key;
+static bool has_context_key = false;
+
+static void HandleThreadExit(void *context) {
+	FreeExecutionContext(reinterpret_cast<ExecutionContext*>(context));
+}
+
+static void WatchThreadExit(ExecutionContext *context) {
+	if (has_context_key) {
+		pthread_setspecific(context_key, context);
+	}
+}
+
+// Pass a signal that isn't ours to whoever handled it before us.
+static void ChainSignal(int sig, siginfo_t *info, void *context, 
+                        const struct sigaction &action)
+{
+	if ((action.sa_flags & SA_SIGINFO) != 0) {
+		action.sa_sigaction(sig, info, context);
+	} else if (action.sa_handler != SIG_DFL && action.sa_handler != SIG_IGN) {
+		action.sa_handler(sig);
+	} else {
+		// The faulting instruction is re-executed and the default action
+		// takes place.
+		signal(sig, SIG_DFL);
+	}
+}
+
+static void HandleSegv(int sig, siginfo_t *info, void *context) {
+	greg_t *regs = reinterpret_cast<ucontext_t*>(context)->uc_mcontext.gregs;
+	if (IsStackOverflow(info->si_addr)) {
+		void *eip = reinterpret_cast<void*>(regs[REG_EIP]);
+		void *esp = reinterpret_cast<void*>(regs[REG_ESP]);
+		void *ebp = reinterpret_cast<void*>(regs[REG_EBP]);
+		if (IsScriptFault(eip) && Jitter::HaltOnFault(AMX_ERR_STACKERR, &eip, &esp, &ebp)) {
+			current_context->overflowed = true;
+			regs[REG_EIP] = reinterpret_cast<greg_t>(eip);
+			regs[REG_ESP] = reinterpret_cast<greg_t>(esp);
+			regs[REG_EBP] = reinterpret_cast<greg_t>(ebp);
+			return;
 		}
-		case OP_SYSREQ_C:   // index
-		case OP_SYSREQ_D: { // address
-			// call system service
-			std::string native_name;
-			switch (instr.GetOpcode()) {
-				case OP_SYSREQ_C:
-					native_name = GetNativeName(amx_, instr.GetOperand());
-					break;
-				case OP_SYSREQ_D: {
-					int index = GetNativeIndex(amx_, instr.GetOperand());
-					if (index != -1) {
-						native_name = GetNativeName(amx_, index);
-					}
-					break;
+	}
+	ChainSignal(sig, info, context, old_segv_action);
+}
+
+static void HandleFpe(int sig, siginfo_t *info, void *context) {
+	greg_t *regs = reinterpret_cast<ucontext_t*>(context)->uc_mcontext.gregs;
+	void *eip = reinterpret_cast<void*>(regs[REG_EIP]);
+	void *esp = reinterpret_cast<void*>(regs[REG_ESP]);
+	void *ebp = reinterpret_cast<void*>(regs[REG_EBP]);
+	if (IsScriptFault(eip) && Jitter::HaltOnFault(AMX_ERR_DIVIDE, &eip, &esp, &ebp)) {
+		regs[REG_EIP] = reinterpret_cast<greg_t>(eip);
+		regs[REG_ESP] = reinterpret_cast<greg_t>(esp);
+		regs[REG_EBP] = reinterpret_cast<greg_t>(ebp);
+		return;
+	}
+	ChainSignal(sig, info, context, old_fpe_action);
+}
+
+static void InstallFaultHandlers() {
+	struct sigaction action;
+	std::memset(&action, 0, sizeof(action));
+	action.sa_sigaction = HandleSegv;
+	action.sa_flags = SA_SIGINFO | SA_ONSTACK;
+	sigemptyset(&action.sa_mask);
+	sigaction(SIGSEGV, &action, &old_segv_action);
+	action.sa_sigaction = HandleFpe;
+	sigaction(SIGFPE, &action, &old_fpe_action);
+	has_context_key = pthread_key_create(&context_key, HandleThreadExit) == 0;
+}
+
+#else
+
+static void InstallFaultHandlers() {}
+static void WatchThreadExit(ExecutionContext *) {}
+
+#endif
+
+// static
+ExecutionContext *Jitter::GetExecutionContext() {
+	ExecutionContext *context = current_context;
+	if (context == 0) {
+		// Contexts are freed when their thread exits.
+		{
+			static bool fault_handlers_installed = false;
+			AsmJit::AutoLock lock(instances_lock_);
+			if (!fault_handlers_installed) {
+				InstallFaultHandlers();
+				fault_handlers_installed = true;
+			}
+		}
+		context = new ExecutionContext;
+		context->stack.Allocate(stack_size_);
+		context->stack_top = context->stack.GetTop();
+		context->call_depth = 0;
+		context->jitter = 0;
+		context->overflowed = false;
+		context->signal_stack = 0;
+		#if defined OS_LINUX
+			// The overflow handler can't run on the stack that overflowed.
+			stack_t old_stack;
+			if (sigaltstack(0, &old_stack) == 0 && (old_stack.ss_flags & SS_DISABLE) != 0) {
+				stack_t stack;
+				stack.ss_sp = std::malloc(kSignalStackSize);
+				stack.ss_size = kSignalStackSize;
+				stack.ss_flags = 0;
+				if (stack.ss_sp != 0 && sigaltstack(&stack, 0) == 0) {
+					context->signal_stack = stack.ss_sp;
+				} else {
+					std::free(stack.ss_sp);
 				}
 			}
-			// Replace calls to various natives with their optimized equivalents.
-			std::map<std::string, NativeOverride>::const_iterator it
-					= native_overrides_.find(native_name);
-			if (it != native_overrides_.end()) {
-				(*this.*(it->second))(as);
-				goto special_native;
-			} else {
-				goto ordinary_native;
+		#endif
+		current_context = context;
+		WatchThreadExit(context);
+	}
+	if (context->overflowed) {
+		context->stack.Protect();
+		context->overflowed = false;
+	}
+	return context;
+}
+
+// static
+void Jitter::SetTargetFeatures(const TargetFeatures &features) {
+	target_ = features;
+	has_target_ = true;
+}
+
+const TargetFeatures &Jitter::GetTargetFeatures() {
+	if (!has_target_) {
+		SetTargetFeatures(TargetFeatures::GetHostFeatures());
+	}
+	return target_;
+}
+
+bool Jitter::SetCodeAlignment(int flags, int size) {
+	// The code buffer itself is aligned to 64 bytes.
+	if (size > 0 && size <= 64 && (size & (size - 1)) == 0) {
+		align_flags_ = flags;
+		align_size_ = size;
+		return true;
+	}
+	return false;
+}
+
+void Jitter::SetSpeculation(bool speculation) {
+	speculation_ = speculation;
+}
+
+void Jitter::SetTracing(bool tracing) {
+	tracing_ = tracing;
+}
+
+void Jitter::SetMaxClones(std::size_t max_clones) {
+	max_clones_ = max_clones;
+}
+
+void Jitter::SetMemoization(bool automatic) {
+	memoization_ = automatic;
+}
+
+void Jitter::SetMemoizedFunctions(const std::set<cell> &include, const std::set<cell> &exclude) {
+	memo_include_ = include;
+	memo_exclude_ = exclude;
+}
+
+void Jitter::GetMemoStats(std::vector<MemoStats> &stats) const {
+	for (std::size_t i = 0; i < memos_.size(); i++) {
+		MemoStats memo_stats;
+		memo_stats.function = memos_[i].function;
+		memo_stats.hits = memo_counters_[memos_[i].counters + 1];
+		memo_stats.calls = memo_counters_[memos_[i].counters] + memo_stats.hits;
+		stats.push_back(memo_stats);
+	}
+}
+
+uint32_t Jitter::GetCodeHash() const {
+	std::vector<AmxInstruction> instrs;
+	ParseCode(0, GetAmxHeader()->dat - GetAmxHeader()->cod, instrs);
+
+	// Code addresses are absolute, so they are hashed relative to the code
+	// section to get the same hash every time the script is loaded.
+	cell code = reinterpret_cast<cell>(GetAmxCode());
+	const cell *code_end = reinterpret_cast<const cell*>(GetAmxCode() 
+	                     + GetAmxHeader()->dat - GetAmxHeader()->cod);
+
+	uint32_t hash = 2166136261u;
+	for (std::size_t i = 0; i < instrs.size(); i++) {
+		const AmxInstruction &instr = instrs[i];
+		hash = HashCell(hash, instr.GetOpcode());
+
+		AmxOpcode opcode = instr.GetOpcode();
+		if (opcode == OP_CALL || opcode == OP_JUMP || opcode == OP_SWITCH
+				|| IsConditionalJump(opcode)) {
+			hash = HashCell(hash, instr.GetOperand() - code);
+		} else if (opcode == OP_CASETBL) {
+			// Number of cases, default address and value/address pairs.
+			cell num_cases = instr.GetOperand(0);
+			hash = HashCell(hash, num_cases);
+			hash = HashCell(hash, instr.GetOperand(1) - code);
+			for (cell j = 0; j < num_cases; j++) {
+				hash = HashCell(hash, instr.GetOperand(2 + j * 2));
+				hash = HashCell(hash, instr.GetOperand(3 + j * 2) - code);
 			}
-		ordinary_native:
-			as.push(esp);
-			as.push(reinterpret_cast<sysint_t>(amx_));
-			switch (instr.GetOpcode()) {
-				case OP_SYSREQ_C:					
-					as.call(reinterpret_cast<void*>(GetNativeAddress(amx_, instr.GetOperand())));
-					break;
-				case OP_SYSREQ_D:
-					as.call(reinterpret_cast<void*>(instr.GetOperand()));
-					break;
+		} else if (opcode != OP_SYSREQ_D) {
+			// SYSREQ.D has the address of a native, which may change.
+			const cell *end = (i + 1 < instrs.size()) ? instrs[i + 1].GetIP() : code_end;
+			for (const cell *operand = instr.GetIP() + 1; operand < end; operand++) {
+				hash = HashCell(hash, *operand);
+			}
+		}
+	}
+
+	return hash;
+}
+
+bool Jitter::SetProfile(const Profile &profile) {
+	if (profile.GetHash() != GetCodeHash()) {
+		return false;
+	}
+	profile_ = profile;
+	has_profile_ = true;
+	return true;
+}
+
+void Jitter::EnableProfiling() {
+	profiling_ = true;
+}
+
+void Jitter::GetProfile(Profile &profile) const {
+	profile.SetHash(GetCodeHash());
+
+	for (std::map<cell, std::size_t>::const_iterator iterator = block_counters_.begin(); 
+			iterator != block_counters_.end(); ++iterator) {
+		uint64_t count = counters_[iterator->second];
+		if (count == 0) {
+			continue;
+		}
+		if (functions_.find(iterator->first) != functions_.end()) {
+			profile.AddFunction(iterator->first, count);
+		} else {
+			profile.AddBlock(iterator->first, count);
+		}
+	}
+
+	for (std::map<cell, std::pair<cell, std::size_t> >::const_iterator iterator = call_counters_.begin(); 
+			iterator != call_counters_.end(); ++iterator) {
+		uint64_t count = counters_[iterator->second.second];
+		if (count == 0) {
+			continue;
+		}
+		// The caller is the last function starting before the call. Address
+		// 0 is always in functions_.
+		std::set<cell>::const_iterator caller = functions_.upper_bound(iterator->first);
+		assert(caller != functions_.begin());
+		--caller;
+		profile.AddCall(*caller, iterator->second.first, count);
+	}
+
+	for (std::map<cell, std::size_t>::const_iterator iterator = branch_counters_.begin(); 
+			iterator != branch_counters_.end(); ++iterator) {
+		uint64_t runs = counters_[iterator->second];
+		uint64_t fall_through = counters_[iterator->second + 1];
+		if (runs == 0) {
+			continue;
+		}
+		if (inverted_branches_.find(iterator->first) != inverted_branches_.end()) {
+			profile.AddBranch(iterator->first, fall_through, runs - fall_through);
+		} else {
+			profile.AddBranch(iterator->first, runs - fall_through, fall_through);
+		}
+	}
+}
+
+void Jitter::AnalyzeCode(const std::vector<AmxInstruction> &instrs) {
+	jump_targets_.clear();
+	loop_headers_.clear();
+	loop_ends_.clear();
+	data_refs_.clear();
+	functions_.clear();
+	blocks_.clear();
+
+	for (std::vector<AmxInstruction>::size_type i = 0; i < instrs.size(); i++) {
+		const AmxInstruction &instr = instrs[i];
+
+		if (i == 0 || instr.GetOpcode() == OP_PROC) {
+			functions_.insert(GetInstrAddress(instr));
+			blocks_.insert(GetInstrAddress(instr));
+		}
+		if (i + 1 < instrs.size() && (!CanFallThrough(instr.GetOpcode()) 
+				|| IsConditionalJump(instr.GetOpcode()))) {
+			blocks_.insert(GetInstrAddress(instrs[i + 1]));
+		}
+
+		switch (instr.GetOpcode()) {
+		case OP_CALL:
+		case OP_JUMP:
+		case OP_JZER:
+		case OP_JNZ:
+		case OP_JEQ:
+		case OP_JNEQ:
+		case OP_JLESS:
+		case OP_JLEQ:
+		case OP_JGRTR:
+		case OP_JGEQ:
+		case OP_JSLESS:
+		case OP_JSLEQ:
+		case OP_JSGRTR:
+		case OP_JSGEQ:
+		{
+			cell target = instr.GetOperand() - reinterpret_cast<cell>(GetAmxCode());
+			jump_targets_.insert(target);
+			if (instr.GetOpcode() != OP_CALL && target <= GetInstrAddress(instr)) {
+				loop_headers_.insert(target);
+				cell &end = loop_ends_[target];
+				end = std::max(end, GetInstrAddress(instr));
 			}
-			as.add(esp, 8);
-		special_native:
 			break;
 		}
-		case OP_SWITCH: { // offset
-			// Compare PRI to the values in the case table (whose address
-			// is passed as an offset from CIP) and_ jump to the associated
-			// the address in the matching record.
+		case OP_SWITCH: {
+			// The case table is: CASETBL, number of cases, default address
+			// and then a value/address pair for each case.
+			const cell *table = reinterpret_cast<const cell*>(instr.GetOperand());
+			jump_targets_.insert(table[2] - reinterpret_cast<cell>(GetAmxCode()));
+			for (cell j = 0; j < table[1]; j++) {
+				jump_targets_.insert(table[4 + j * 2] - reinterpret_cast<cell>(GetAmxCode()));
+			}
+			break;
+		}
+		case OP_LOAD_PRI:
+		case OP_LOAD_ALT:
+		case OP_LREF_PRI:
+		case OP_LREF_ALT:
+		case OP_STOR_PRI:
+		case OP_STOR_ALT:
+		case OP_SREF_PRI:
+		case OP_SREF_ALT:
+		case OP_PUSH:
+		case OP_ZERO:
+		case OP_INC:
+		case OP_DEC:
+		case OP_CONST_PRI:
+		case OP_CONST_ALT:
+		case OP_PUSH_C:
+			data_refs_.push_back(std::make_pair(instr.GetOperand(), i));
+			break;
+		default:
+			break;
+		}
+	}
 
-			struct case_record {
-				cell value;    // case value
-				cell address;  // address to jump to (absolute)
-			} *case_table;
+	std::sort(data_refs_.begin(), data_refs_.end());
 
-			// Get pointer to the start of the case table.
-			case_table = reinterpret_cast<case_record*>(instr.GetOperand() + sizeof(cell));
+	// Every jump target starts a new block.
+	for (std::set<cell>::const_iterator iterator = jump_targets_.begin(); 
+			iterator != jump_targets_.end(); ++iterator) {
+		blocks_.insert(*iterator);
+	}
 
-			// Get address of the "default" record.
-			cell default_addr = case_table[0].address - reinterpret_cast<cell>(GetAmxCode());
+	loops_.clear();
+	for (std::vector<AmxInstruction>::size_type i = 0; i < instrs.size(); i++) {
+		const AmxInstruction &instr = instrs[i];
+		if (instr.GetOpcode() != OP_JUMP) {
+			continue;
+		}
+		cell target = instr.GetOperand() - reinterpret_cast<cell>(GetAmxCode());
+		std::size_t top, test;
+		LoopIdiom loop;
+		if (target < GetInstrAddress(instr) && FindInstr(instrs, target, top)
+				&& AnalyzeLoop(instrs, top, i, test, loop)) {
+			// Only FILL and COPY don't need SSE2 kernels.
+			if (loop.kind == LoopIdiom::FILL || loop.kind == LoopIdiom::COPY
+					|| GetTargetFeatures().Has(TargetFeatures::SSE2)) {
+				loops_.insert(std::make_pair(test, loop));
+			}
+		}
+	}
+}
 
-			// The number of cases follows the CASETBL opcode (which follows the SWITCH).
-			int num_cases = *(reinterpret_cast<cell*>(instr.GetOperand()) + 1);
+void Jitter::LayoutCode(const std::vector<AmxInstruction> &instrs) {
+	layout_.clear();
 
-			if (num_cases > 0) {
-				// Get minimum and maximum values.
-				cell *min_value = 0;
-				cell *max_value = 0;
-				for (int i = 0; i < num_cases; i++) {
-					cell *value = &case_table[i + 1].value;
-					if (min_value == 0 || *value < *min_value) {
-						min_value = value;
-					}
-					if (max_value == 0 || *value > *max_value) {
-						max_value = value;
+	if (!has_profile_) {
+		for (std::size_t i = 0; i < instrs.size(); i++) {
+			layout_.push_back(i);
+		}
+		return;
+	}
+
+	// Split code into functions and functions into basic blocks, both given
+	// by the index of their first instruction.
+	std::vector<std::size_t> functions;
+	std::vector<std::vector<std::size_t> > blocks;
+	std::map<cell, std::size_t> function_index;
+	for (std::size_t i = 0; i < instrs.size(); i++) {
+		cell cip = GetInstrAddress(instrs[i]);
+		if (functions_.find(cip) != functions_.end()) {
+			function_index.insert(std::make_pair(cip, functions.size()));
+			functions.push_back(i);
+			blocks.push_back(std::vector<std::size_t>());
+		}
+		if (blocks_.find(cip) != blocks_.end()) {
+			blocks.back().push_back(i);
+		}
+	}
+	std::size_t num_functions = functions.size();
+	functions.push_back(instrs.size());
+
+	// Order functions Pettis-Hansen style: every function starts in a chain
+	// of its own, then chains are joined along call graph edges, heaviest 
+	// edges first, so that functions calling each other a lot end up close.
+	typedef std::map<std::pair<std::size_t, std::size_t>, uint64_t> EdgeMap;
+	EdgeMap edges;
+	const Profile::CallMap &calls = profile_.GetCalls();
+	for (Profile::CallMap::const_iterator iterator = calls.begin(); 
+			iterator != calls.end(); ++iterator) {
+		std::map<cell, std::size_t>::const_iterator caller = function_index.find(iterator->first.first);
+		std::map<cell, std::size_t>::const_iterator callee = function_index.find(iterator->first.second);
+		if (caller != function_index.end() && callee != function_index.end() 
+				&& caller->second != callee->second) {
+			std::size_t u = std::min(caller->second, callee->second);
+			std::size_t v = std::max(caller->second, callee->second);
+			edges[std::make_pair(u, v)] += iterator->second;
+		}
+	}
+
+	std::vector<std::pair<uint64_t, std::pair<std::size_t, std::size_t> > > sorted_edges;
+	for (EdgeMap::const_iterator iterator = edges.begin(); iterator != edges.end(); ++iterator) {
+		sorted_edges.push_back(std::make_pair(iterator->second, iterator->first));
+	}
+	std::sort(sorted_edges.rbegin(), sorted_edges.rend());
+
+	std::vector<std::vector<std::size_t> > chains(num_functions);
+	std::vector<std::size_t> chain_of(num_functions);
+	for (std::size_t f = 0; f < num_functions; f++) {
+		chains[f].push_back(f);
+		chain_of[f] = f;
+	}
+	for (std::size_t i = 0; i < sorted_edges.size(); i++) {
+		std::size_t u = sorted_edges[i].second.first;
+		std::size_t v = sorted_edges[i].second.second;
+		std::size_t a = chain_of[u];
+		std::size_t b = chain_of[v];
+		if (a == b) {
+			continue;
+		}
+		for (std::size_t j = 0; j < chains[b].size(); j++) {
+			chain_of[chains[b][j]] = a;
+		}
+		MergeChains(chains[a], chains[b], u, v);
+		chains[b].clear();
+	}
+
+	// Hottest chains go first. Functions that were never called are single
+	// chains with no weight and keep their original order at the end.
+	std::vector<std::pair<uint64_t, std::size_t> > chain_order;
+	for (std::size_t c = 0; c < num_functions; c++) {
+		if (chains[c].empty()) {
+			continue;
+		}
+		uint64_t weight = 0;
+		for (std::size_t j = 0; j < chains[c].size(); j++) {
+			weight += profile_.GetCount(GetInstrAddress(instrs[functions[chains[c][j]]]));
+		}
+		chain_order.push_back(std::make_pair(weight, c));
+	}
+	std::stable_sort(chain_order.begin(), chain_order.end(), HeavierFirst());
+
+	// Lay out blocks of each function starting with the entry block and 
+	// following the most likely successor when it hasn't been placed yet. 
+	// Blocks that were never run go after all other code.
+	std::vector<std::pair<std::size_t, std::size_t> > hot_blocks;
+	std::vector<std::pair<std::size_t, std::size_t> > cold_blocks;
+
+	for (std::size_t c = 0; c < chain_order.size(); c++) {
+		const std::vector<std::size_t> &chain = chains[chain_order[c].second];
+		for (std::size_t j = 0; j < chain.size(); j++) {
+			std::size_t f = chain[j];
+			const std::vector<std::size_t> &starts = blocks[f];
+			std::size_t num_blocks = starts.size();
+
+			std::vector<std::size_t> ends(num_blocks);
+			std::map<cell, std::size_t> block_index;
+			std::vector<bool> hot(num_blocks);
+			for (std::size_t b = 0; b < num_blocks; b++) {
+				ends[b] = (b + 1 < num_blocks) ? starts[b + 1] : functions[f + 1];
+				cell cip = GetInstrAddress(instrs[starts[b]]);
+				block_index.insert(std::make_pair(cip, b));
+				hot[b] = profile_.GetCount(cip) > 0;
+			}
+
+			if (num_blocks == 0 || !hot[0]) {
+				for (std::size_t b = 0; b < num_blocks; b++) {
+					cold_blocks.push_back(std::make_pair(starts[b], ends[b]));
+				}
+				continue;
+			}
+
+			std::vector<bool> placed(num_blocks);
+			std::size_t current = 0;
+			for (;;) {
+				placed[current] = true;
+				hot_blocks.push_back(std::make_pair(starts[current], ends[current]));
+
+				// Successors of the block in order of preference.
+				const AmxInstruction &last = instrs[ends[current] - 1];
+				std::size_t successors[2] = {num_blocks, num_blocks};
+				std::size_t next_block = current + 1;
+				if (IsConditionalJump(last.GetOpcode()) || last.GetOpcode() == OP_JUMP) {
+					cell dest = last.GetOperand() - reinterpret_cast<cell>(GetAmxCode());
+					std::map<cell, std::size_t>::const_iterator target = block_index.find(dest);
+					std::size_t target_block = (target != block_index.end()) ? target->second : num_blocks;
+					if (last.GetOpcode() == OP_JUMP) {
+						successors[0] = target_block;
+					} else {
+						uint64_t taken = 0;
+						uint64_t not_taken = 0;
+						profile_.GetBranch(GetInstrAddress(last), taken, not_taken);
+						if (taken > not_taken) {
+							successors[0] = target_block;
+							successors[1] = next_block;
+						} else {
+							successors[0] = next_block;
+							successors[1] = target_block;
+						}
 					}
+				} else if (CanFallThrough(last.GetOpcode())) {
+					successors[0] = next_block;
 				}
 
-				// Check if the value in eax is in the allowed range.
-				// If not, jump to the default case (i.e. no match).
-				as.cmp(eax, *min_value);
-				as.jl(Label(as, label_map.get(), default_addr));
-				as.cmp(eax, *max_value);
-				as.jg(Label(as, label_map.get(), default_addr));
+				std::size_t next = num_blocks;
+				for (int s = 0; s < 2 && next == num_blocks; s++) {
+					if (successors[s] < num_blocks && hot[successors[s]] && !placed[successors[s]]) {
+						next = successors[s];
+					}
+				}
+				for (std::size_t b = 0; b < num_blocks && next == num_blocks; b++) {
+					if (hot[b] && !placed[b]) {
+						next = b;
+					}
+				}
+				if (next == num_blocks) {
+					break;
+				}
+				current = next;
+			}
 
-				// OK now sequentially compare eax with each value.
-				// This is pretty slow so I probably should optimize
-				// this in future...
-				for (int i = 0; i < num_cases; i++) {
-					as.cmp(eax, case_table[i + 1].value);
-					as.je(Label(as, label_map.get(), case_table[i + 1].address - reinterpret_cast<cell>(GetAmxCode())));
+			for (std::size_t b = 0; b < num_blocks; b++) {
+				if (!hot[b]) {
+					cold_blocks.push_back(std::make_pair(starts[b], ends[b]));
 				}
 			}
+		}
+	}
 
-			// No match found - go for default case.
-			as.jmp(Label(as, label_map.get(), default_addr));
-			break;
+	hot_blocks.insert(hot_blocks.end(), cold_blocks.begin(), cold_blocks.end());
+	for (std::size_t b = 0; b < hot_blocks.size(); b++) {
+		for (std::size_t i = hot_blocks[b].first; i < hot_blocks[b].second; i++) {
+			layout_.push_back(i);
 		}
-		case OP_CASETBL: // ...
-			// A variable number of case records follows this opcode, where
-			// each record takes two cells.
-			break;
-		case OP_SWAP_PRI:
-			// [STK] = PRI and_ PRI = [STK]
-			as.xchg(dword_ptr(esp), eax);
-			break;
-		case OP_SWAP_ALT:
-			// [STK] = ALT and_ ALT = [STK]
-			as.xchg(dword_ptr(esp), ecx);
-			break;
-		case OP_PUSH_ADR: // offset
-			// [STK] = FRM + offset, STK = STK - cell size
-			as.lea(edx, dword_ptr(ebp, instr.GetOperand() - reinterpret_cast<sysint_t>(GetAmxData())));
-			as.push(edx);
-			break;
-		case OP_NOP:
-			// no-operation, for code alignment
-			break;
-		case OP_BREAK:
-			// conditional breakpoint
-			break;
-		case OP_PUSH_R:
-		case OP_FILE:
-		case OP_SYMBOL:
-		case OP_LINE:
-		case OP_SRANGE:
-		case OP_SYMTAG:		
-		case OP_JREL:
-			// obsolete
-			throw ObsoleteInstructionError(instr);
-		default:
-			throw InvalidInstructionError(instr);
-		}		
 	}
+}
 
-	code_ = as.make();
+const AmxInstruction *Jitter::GetArgumentPush(const NativeCall &call, int n) const {
+	const std::vector<AmxInstruction> &instrs = call.GetInstructions();
+	std::size_t index = call.GetIndex();
 
-	code_map_ = code_map.release();
-	label_map_ = label_map.release();
-}
+	// Expect "push arg n, ..., push arg 1, push.c argcount, sysreq".
+	if (index < static_cast<std::size_t>(n) + 1) {
+		return 0;
+	}
+	const AmxInstruction &count = instrs[index - 1];
+	if (count.GetOpcode() != OP_PUSH_C 
+			|| count.GetOperand() < n * static_cast<cell>(sizeof(cell))) {
+		return 0;
+	}
+	for (int k = 1; k <= n; k++) {
+		switch (instrs[index - 1 - k].GetOpcode()) {
+			case OP_PUSH_C:
+			case OP_PUSH:
+			case OP_PUSH_S:
+			case OP_PUSH_ADR:
+				break;
+			default:
+				return 0;
+		}
+	}
 
-void Jitter::halt(AsmJit::Assembler &as, cell error_code) {
-	using AsmJit::esp;
-	using AsmJit::ebp;
-	using AsmJit::dword_ptr_abs;
-	as.mov(dword_ptr_abs(reinterpret_cast<void*>(&GetAmx()->error)), error_code);
-	as.mov(esp, dword_ptr_abs(reinterpret_cast<void*>(&halt_esp_)));
-	as.mov(ebp, dword_ptr_abs(reinterpret_cast<void*>(&halt_ebp_)));
-	as.ret();
-}
+	// Nothing may jump in between the pushes.
+	for (int k = 0; k < n + 1; k++) {
+		if (jump_targets_.find(GetInstrAddress(instrs[index - k])) != jump_targets_.end()) {
+			return 0;
+		}
+	}
 
-void Jitter::native_float(AsmJit::Assembler &as) {
-	using AsmJit::esp;
-	using AsmJit::eax;
-	using AsmJit::dword_ptr;
-	as.fild(dword_ptr(esp, 4));
-	as.sub(esp, 4);
-	as.fstp(dword_ptr(esp));
-	as.mov(eax, dword_ptr(esp));
-	as.add(esp, 4);
+	return &instrs[index - 1 - n];
 }
 
-void Jitter::native_floatabs(AsmJit::Assembler &as) {
-	using AsmJit::esp;
-	using AsmJit::eax;
-	using AsmJit::dword_ptr;
-	as.fld(dword_ptr(esp, 4));
-	as.fabs();
-	as.sub(esp, 4);
-	as.fstp(dword_ptr(esp));
-	as.mov(eax, dword_ptr(esp));
-	as.add(esp, 4);
-}
+bool Jitter::IsConstantString(const std::vector<AmxInstruction> &instrs, 
+                              cell address, std::size_t push) const 
+{
+	cell data_size = GetAmxHeader()->hea - GetAmxHeader()->dat;
+	if (address < 0 || address % sizeof(cell) != 0) {
+		return false;
+	}
 
-void Jitter::native_floatadd(AsmJit::Assembler &as) {
-	using AsmJit::esp;
-	using AsmJit::eax;
-	using AsmJit::dword_ptr;
-	as.fld(dword_ptr(esp, 4));
-	as.fadd(dword_ptr(esp, 8));
-	as.sub(esp, 4);
-	as.fstp(dword_ptr(esp));
-	as.mov(eax, dword_ptr(esp));
-	as.add(esp, 4);
-}
+	cell end = address;
+	while (end < data_size && *reinterpret_cast<cell*>(GetAmxData() + end) != 0) {
+		end += sizeof(cell);
+	}
+	if (end >= data_size) {
+		return false;
+	}
 
-void Jitter::native_floatsub(AsmJit::Assembler &as) {
-	using AsmJit::esp;
-	using AsmJit::eax;
-	using AsmJit::dword_ptr;
-	as.fld(dword_ptr(esp, 4));
-	as.fsub(dword_ptr(esp, 8));
-	as.sub(esp, 4);
-	as.fstp(dword_ptr(esp));
-	as.mov(eax, dword_ptr(esp));
-	as.add(esp, 4);
-}
+	// Scripts can't refer to data other than by its address, so if none of
+	// the instructions that have an address within the string as operand 
+	// can modify it, the string is constant.
+	DataRefs::const_iterator it = std::lower_bound(data_refs_.begin(), data_refs_.end(), 
+	                                               std::make_pair(address, std::size_t(0)));
+	for (; it != data_refs_.end() && it->first <= end; ++it) {
+		if (it->second == push) {
+			continue;
+		}
+		switch (instrs[it->second].GetOpcode()) {
+			case OP_LOAD_PRI:
+			case OP_LOAD_ALT:
+			case OP_LREF_PRI:
+			case OP_LREF_ALT:
+			case OP_SREF_PRI:
+			case OP_SREF_ALT:
+			case OP_PUSH:
+				break;
+			default:
+				return false;
+		}
+	}
 
-void Jitter::native_floatmul(AsmJit::Assembler &as) {
-	using AsmJit::esp;
-	using AsmJit::eax;
-	using AsmJit::dword_ptr;
-	as.fld(dword_ptr(esp, 4));
-	as.fmul(dword_ptr(esp, 8));
-	as.sub(esp, 4);
-	as.fstp(dword_ptr(esp));
-	as.mov(eax, dword_ptr(esp));
-	as.add(esp, 4);
+	return true;
 }
 
-void Jitter::native_floatdiv(AsmJit::Assembler &as) {
-	using AsmJit::esp;
-	using AsmJit::eax;
-	using AsmJit::dword_ptr;
-	as.fld(dword_ptr(esp, 4));
-	as.fdiv(dword_ptr(esp, 8));
-	as.sub(esp, 4);
-	as.fstp(dword_ptr(esp));
-	as.mov(eax, dword_ptr(esp));
-	as.add(esp, 4);
+bool Jitter::FindInstr(const std::vector<AmxInstruction> &instrs, cell address, 
+                       std::size_t &index) const 
+{
+	std::size_t first = 0;
+	std::size_t last = instrs.size();
+	while (first < last) {
+		std::size_t middle = first + (last - first) / 2;
+		cell middle_address = GetInstrAddress(instrs[middle]);
+		if (middle_address == address) {
+			index = middle;
+			return true;
+		}
+		if (middle_address < address) {
+			first = middle + 1;
+		} else {
+			last = middle;
+		}
+	}
+	return false;
 }
 
-void Jitter::native_floatsqroot(AsmJit::Assembler &as) {
-	using AsmJit::esp;
-	using AsmJit::eax;
-	using AsmJit::dword_ptr;
-	as.fld(dword_ptr(esp, 4));
-	as.fsqrt();
-	as.sub(esp, 4);
-	as.fstp(dword_ptr(esp));
-	as.mov(eax, dword_ptr(esp));
-	as.add(esp, 4);
+bool Jitter::AnalyzeLoop(const std::vector<AmxInstruction> &instrs, std::size_t top, 
+                         std::size_t back, std::size_t &test, LoopIdiom &loop) const 
+{
+	// Pawn compiles "for (...; i < n; i++) body" to
+	//
+	//   jump test
+	// top:
+	//   inc.s i
+	// test:
+	//   <i < n>
+	//   jzer exit
+	//   <body>
+	//   jump top
+	// exit:
+	//
+	// Loops written with "while" have the increment at the end of the body
+	// instead.
+	std::size_t body_end;
+	if (instrs[top].GetOpcode() == OP_INC_S) {
+		loop.index = instrs[top].GetOperand();
+		test = top + 1;
+		body_end = back;
+	} else if (back > top && instrs[back - 1].GetOpcode() == OP_INC_S) {
+		loop.index = instrs[back - 1].GetOperand();
+		test = top;
+		body_end = back - 1;
+	} else {
+		return false;
+	}
+	if (back + 1 >= instrs.size()) {
+		return false;
+	}
+
+	cell code = reinterpret_cast<cell>(GetAmxCode());
+	cell loop_start = GetInstrAddress(instrs[top]);
+	cell loop_end = GetInstrAddress(instrs[back]);
+	cell exit = GetInstrAddress(instrs[back + 1]);
+
+	LoopEvaluator eval(loop.index);
+	std::size_t i = test;
+
+	// The loop condition, which must be "i < n" or equivalent.
+	LoopValue cond;
+	for (; i < body_end; i++) {
+		const AmxInstruction &instr = instrs[i];
+		if (i != test && jump_targets_.find(GetInstrAddress(instr)) != jump_targets_.end()) {
+			return false;
+		}
+		if (IsConditionalJump(instr.GetOpcode())) {
+			if (instr.GetOperand() - code != exit || !eval.GetBranchCondition(instr, cond)) {
+				return false;
+			}
+			break;
+		}
+		if (!eval.Execute(instr)) {
+			return false;
+		}
+	}
+	if (i >= body_end || !eval.effects.empty() || !eval.stack.empty()
+			|| eval.pri.Is(LoopTerm::UNKNOWN) || eval.alt.Is(LoopTerm::UNKNOWN)) {
+		return false;
+	}
+	cond.cond = Negate(cond.cond);
+	cond.Normalize();
+	if (cond.lhs.kind != LoopTerm::INDEX || cond.rhs.kind != LoopTerm::CONSTANT 
+			|| cond.rhs.operand.type != LoopOperand::CONSTANT) {
+		return false;
+	}
+	if (cond.cond == COND_LT) {
+		loop.count = cond.rhs.operand.value;
+	} else if (cond.cond == COND_LE && cond.rhs.operand.value < std::numeric_limits<cell>::max()) {
+		loop.count = cond.rhs.operand.value + 1;
+	} else {
+		return false;
+	}
+
+	// The body. It may contain one conditional jump that either leaves the 
+	// loop or skips some code.
+	eval.pri = eval.alt = LoopValue();
+	bool has_branch = false;
+	bool branch_exits = false;
+	LoopValue branch;
+	std::size_t skip_end = 0;
+	for (i++; i <= body_end; i++) {
+		if (i == skip_end) {
+			if (!eval.stack.empty()) {
+				return false;
+			}
+			eval.pri = eval.alt = LoopValue();
+			eval.guarded = false;
+		}
+		if (i == body_end) {
+			break;
+		}
+		const AmxInstruction &instr = instrs[i];
+		if (i != skip_end && jump_targets_.find(GetInstrAddress(instr)) != jump_targets_.end()) {
+			return false;
+		}
+		if (instr.GetOpcode() == OP_JUMP) {
+			// A "break" inside an "if".
+			cell target = instr.GetOperand() - code;
+			if (!eval.guarded || (target >= loop_start && target <= loop_end)) {
+				return false;
+			}
+			eval.effects.push_back(LoopEffect(LoopEffect::EXIT, LoopOperand(), LoopValue(), true));
+			continue;
+		}
+		if (IsConditionalJump(instr.GetOpcode())) {
+			if (has_branch || !eval.stack.empty() || !eval.GetBranchCondition(instr, branch)) {
+				return false;
+			}
+			has_branch = true;
+			cell target = instr.GetOperand() - code;
+			if (target < loop_start || target > loop_end) {
+				branch_exits = true;
+			} else if (!FindInstr(instrs, target, skip_end) || skip_end <= i || skip_end > body_end) {
+				return false;
+			} else {
+				eval.guarded = true;
+			}
+			continue;
+		}
+		if (!eval.Execute(instr)) {
+			return false;
+		}
+	}
+	if (!eval.stack.empty()) {
+		return false;
+	}
+
+	bool sse2 = GetTargetFeatures().Has(TargetFeatures::SSE2);
+	const std::vector<LoopEffect> &effects = eval.effects;
+	loop.equal = true;
+
+	if (branch_exits || (effects.size() == 1 && effects[0].kind == LoopEffect::EXIT)) {
+		// Search.
+		if (!sse2 || (branch_exits && !effects.empty())) {
+			return false;
+		}
+		LoopValue exit_cond = branch;
+		if (!branch_exits) {
+			exit_cond.cond = Negate(exit_cond.cond);
+		}
+		exit_cond.Normalize();
+		if (exit_cond.lhs.kind != LoopTerm::ELEM || !GetInvariant(exit_cond.rhs, loop.value)
+				|| (exit_cond.cond != COND_EQ && exit_cond.cond != COND_NE)) {
+			return false;
+		}
+		loop.kind = LoopIdiom::FIND;
+		loop.array = exit_cond.lhs.operand;
+		loop.equal = exit_cond.cond == COND_EQ;
+	} else if (effects.size() == 1 && !has_branch) {
+		const LoopEffect &effect = effects[0];
+		if (effect.kind == LoopEffect::STORE_ELEM && effect.value.kind == LoopValue::TERM) {
+			// Fill or copy.
+			loop.array = effect.target;
+			if (GetInvariant(effect.value.lhs, loop.value)) {
+				loop.kind = LoopIdiom::FILL;
+			} else if (effect.value.lhs.kind == LoopTerm::ELEM) {
+				loop.kind = LoopIdiom::COPY;
+				loop.source = effect.value.lhs.operand;
+				if (loop.source.type == LoopOperand::LOCAL_REF || loop.array.type == LoopOperand::LOCAL_REF) {
+					return false;
+				}
+				// Copying forward is only different from copying one cell at
+				// a time when the destination overlaps the end of the source.
+				if (loop.source.type == loop.array.type && loop.array.value > loop.source.value
+						&& IsInArray(loop.array, loop.source, loop.count)) {
+					return false;
+				}
+			} else {
+				return false;
+			}
+		} else if (effect.kind == LoopEffect::STORE_SCALAR && effect.value.kind == LoopValue::SUM && sse2) {
+			// Sum.
+			const LoopTerm &lhs = effect.value.lhs;
+			const LoopTerm &rhs = effect.value.rhs;
+			const LoopTerm &elem = lhs.kind == LoopTerm::ELEM ? lhs : rhs;
+			const LoopTerm &acc = lhs.kind == LoopTerm::ELEM ? rhs : lhs;
+			if (elem.kind != LoopTerm::ELEM || acc.kind != LoopTerm::SCALAR || acc.operand != effect.target) {
+				return false;
+			}
+			loop.kind = LoopIdiom::SUM;
+			loop.array = elem.operand;
+			loop.result = effect.target;
+		} else {
+			return false;
+		}
+	} else if (effects.size() == 1 && effects[0].guarded && sse2) {
+		const LoopEffect &effect = effects[0];
+		LoopValue exec_cond = branch;
+		exec_cond.cond = Negate(exec_cond.cond);
+		exec_cond.Normalize();
+		if (exec_cond.lhs.kind != LoopTerm::ELEM) {
+			return false;
+		}
+		loop.array = exec_cond.lhs.operand;
+		loop.result = effect.target;
+		if (effect.kind == LoopEffect::INC_SCALAR) {
+			// Count.
+			if (!GetInvariant(exec_cond.rhs, loop.value)
+					|| (exec_cond.cond != COND_EQ && exec_cond.cond != COND_NE)) {
+				return false;
+			}
+			loop.kind = LoopIdiom::COUNT;
+			loop.equal = exec_cond.cond == COND_EQ;
+		} else if (effect.kind == LoopEffect::STORE_SCALAR) {
+			// Minimum or maximum.
+			if (!effect.value.Is(LoopTerm::ELEM) || effect.value.lhs.operand != loop.array
+					|| exec_cond.rhs.kind != LoopTerm::SCALAR || exec_cond.rhs.operand != loop.result) {
+				return false;
+			}
+			switch (exec_cond.cond) {
+				case COND_LT:
+				case COND_LE:
+					loop.kind = LoopIdiom::MIN;
+					break;
+				case COND_GT:
+				case COND_GE:
+					loop.kind = LoopIdiom::MAX;
+					break;
+				default:
+					return false;
+			}
+		} else {
+			return false;
+		}
+	} else {
+		return false;
+	}
+
+	// The BOUNDS checks must never fail (the index is known to be 
+	// non-negative when the kernel is run).
+	if (loop.count - 1 > eval.max_index) {
+		return false;
+	}
+
+	// Make sure that the loop doesn't modify anything it reads other than
+	// what it's expected to.
+	bool writes_array = loop.kind == LoopIdiom::FILL || loop.kind == LoopIdiom::COPY;
+	bool writes_result = loop.kind == LoopIdiom::SUM || loop.kind == LoopIdiom::COUNT
+	                  || loop.kind == LoopIdiom::MIN || loop.kind == LoopIdiom::MAX;
+	bool reads_result = writes_result && loop.kind != LoopIdiom::COUNT;
+	if (writes_result && loop.result.type == LoopOperand::GLOBAL) {
+		for (std::size_t j = 0; j < eval.array_reads.size(); j++) {
+			if (eval.array_reads[j].type == LoopOperand::LOCAL_REF) {
+				return false;
+			}
+		}
+	}
+	std::vector<LoopOperand> arrays = eval.array_reads;
+	if (writes_array) {
+		arrays.push_back(loop.array);
+	}
+	LoopOperand index(LoopOperand::LOCAL, loop.index);
+	for (std::size_t j = 0; j < arrays.size(); j++) {
+		if (IsInArray(index, arrays[j], loop.count)
+				|| (writes_result && IsInArray(loop.result, arrays[j], loop.count))) {
+			return false;
+		}
+	}
+	for (std::size_t j = 0; j < eval.reads.size(); j++) {
+		const LoopOperand &read = eval.reads[j];
+		if (writes_result && read == loop.result && !reads_result) {
+			return false;
+		}
+		if (writes_array && (IsInArray(read, loop.array, loop.count) 
+				|| (loop.array.type == LoopOperand::LOCAL_REF && read.type == LoopOperand::GLOBAL))) {
+			return false;
+		}
+	}
+
+	return true;
 }
 
-void Jitter::native_floatlog(AsmJit::Assembler &as) {
-	using AsmJit::esp;
-	using AsmJit::eax;
-	using AsmJit::st;
-	using AsmJit::dword_ptr;
-	as.fld1();
-	as.fld(dword_ptr(esp, 8));
-	as.fyl2x();
-	as.fld1();
-	as.fdivrp(st(1));
-	as.fld(dword_ptr(esp, 4));
-	as.fyl2x();
-	as.sub(esp, 4);
-	as.fstp(dword_ptr(esp));
-	as.mov(eax, dword_ptr(esp));
-	as.add(esp, 4);
+AsmJit::Mem Jitter::GetLoopOperandPtr(const LoopOperand &operand) const {
+	if (operand.type == LoopOperand::GLOBAL) {
+		return AsmJit::dword_ptr_abs(reinterpret_cast<void*>(GetAmxData() + operand.value));
+	}
+	return AsmJit::dword_ptr(AsmJit::ebp, operand.value);
 }
 
-AsmJit::Label &Jitter::Label(AsmJit::Assembler &as, LabelMap *label_map, cell address, const std::string &name) {
-	LabelMap::iterator iterator = label_map->find(TaggedAddress(address, name));
-	if (iterator != label_map->end()) {
-		return iterator->second;
+bool Jitter::IsFilledBufferOverwritten(const std::vector<AmxInstruction> &instrs, 
+                                       std::size_t fill) const 
+{
+	// Look for:
+	//
+	//   zero.pri / addr.alt buffer (in any order)
+	//   fill size
+	//   push arg n, ..., push arg 1
+	//   push.c argcount
+	//   sysreq.c native
+	//
+	// where the native writes the whole buffer pushed by "push.adr buffer" and
+	// is told its full size by a "push.c" argument.
+	if (fill < 2) {
+		return false;
+	}
+	const AmxInstruction *addr = 0;
+	if (instrs[fill - 1].GetOpcode() == OP_ADDR_ALT && instrs[fill - 2].GetOpcode() == OP_ZERO_PRI) {
+		addr = &instrs[fill - 1];
+	} else if (instrs[fill - 2].GetOpcode() == OP_ADDR_ALT && instrs[fill - 1].GetOpcode() == OP_ZERO_PRI) {
+		addr = &instrs[fill - 2];
 	} else {
-		std::pair<LabelMap::iterator, bool> where = 
-				label_map->insert(std::make_pair(TaggedAddress(address, name), as.newLabel()));
-		return where.first->second;
+		return false;
+	}
+
+	cell buffer = addr->GetOperand();
+	cell buffer_end = buffer + instrs[fill].GetOperand();
+
+	std::size_t sysreq = fill + 1;
+	for (; sysreq < instrs.size(); sysreq++) {
+		const AmxInstruction &instr = instrs[sysreq];
+		if (jump_targets_.find(GetInstrAddress(instr)) != jump_targets_.end()) {
+			return false;
+		}
+		if (instr.GetOpcode() != OP_PUSH_C && instr.GetOpcode() != OP_PUSH 
+				&& instr.GetOpcode() != OP_PUSH_S && instr.GetOpcode() != OP_PUSH_ADR) {
+			break;
+		}
+	}
+	if (sysreq >= instrs.size() || sysreq < fill + 2) {
+		return false;
+	}
+
+	const AmxInstruction &count = instrs[sysreq - 1];
+	int num_args = static_cast<int>(sysreq - fill - 2);
+	if (count.GetOpcode() != OP_PUSH_C 
+			|| count.GetOperand() != num_args * static_cast<cell>(sizeof(cell))) {
+		return false;
+	}
+
+	std::string native_name = GetSysreqNativeName(amx_, instrs[sysreq]);
+	for (std::size_t i = 0; i < sizeof(string_writers) / sizeof(*string_writers); i++) {
+		if (native_name != string_writers[i].name || !string_writers[i].whole 
+				|| string_writers[i].arg > num_args || string_writers[i].size_arg > num_args
+				|| string_writers[i].size_arg < 1) {
+			continue;
+		}
+		const AmxInstruction &length = instrs[sysreq - 1 - string_writers[i].size_arg];
+		if (length.GetOpcode() != OP_PUSH_C 
+				|| length.GetOperand() * static_cast<cell>(sizeof(cell)) != buffer_end - buffer) {
+			return false;
+		}
+		// The buffer must be passed only once, as the destination.
+		const AmxInstruction *dest = &instrs[sysreq - 1 - string_writers[i].arg];
+		for (std::size_t j = fill + 1; j < sysreq - 1; j++) {
+			const AmxInstruction &push = instrs[j];
+			bool is_buffer = push.GetOpcode() == OP_PUSH_ADR && push.GetOperand() == buffer;
+			bool in_buffer = (push.GetOpcode() == OP_PUSH_S || push.GetOpcode() == OP_PUSH_ADR)
+			               && push.GetOperand() >= buffer && push.GetOperand() < buffer_end;
+			if ((&push == dest) != is_buffer || (&push != dest && in_buffer)) {
+				return false;
+			}
+		}
+		return true;
 	}
-}
 
-void *Jitter::esp_;
-StackBuffer Jitter::stack_;
-int Jitter::call_depth_ = 0;
+	return false;
+}
 
-// static
-void Jitter::SetStackSize(std::size_t stack_size) {
-	if (!stack_.IsReady()) {
-		stack_.Allocate(stack_size);
+void Jitter::GetEnclosingLoops(cell cip, std::vector<cell> &headers) const {
+	headers.clear();
+	std::map<cell, cell>::const_iterator end = loop_ends_.upper_bound(cip);
+	for (std::map<cell, cell>::const_iterator it = loop_ends_.begin(); it != end; ++it) {
+		if (cip <= it->second) {
+			headers.push_back(it->first);
+		}
 	}
 }
 
@@ -1351,10 +5184,681 @@ void Jitter::ParseCode(cell start, cell end, std::vector<AmxInstruction> &instru
 	}
 }
 
+bool Jitter::GetSpeculatedValue(cell address, cell &value) const {
+	if (speculative_) {
+		std::map<cell, cell>::const_iterator it = speculated_.find(address);
+		if (it != speculated_.end()) {
+			value = it->second;
+			return true;
+		}
+	}
+	return false;
+}
+
+bool Jitter::MayWriteSpeculated(const LoopIdiom &loop) const {
+	if (!speculative_) {
+		return false;
+	}
+	switch (loop.kind) {
+		case LoopIdiom::FILL:
+		case LoopIdiom::COPY:
+			if (loop.array.type == LoopOperand::LOCAL_REF) {
+				return true;
+			}
+			return loop.array.type == LoopOperand::GLOBAL
+			    && loop.array.value < speculated_max_ + static_cast<cell>(sizeof(cell))
+			    && loop.array.value + loop.count * static_cast<cell>(sizeof(cell)) > speculated_min_;
+		case LoopIdiom::SUM:
+		case LoopIdiom::COUNT:
+		case LoopIdiom::MIN:
+		case LoopIdiom::MAX:
+			return loop.result.type == LoopOperand::GLOBAL
+			    && speculated_.find(loop.result.value) != speculated_.end();
+		default:
+			return false;
+	}
+}
+
+void Jitter::SelectSpeculatedGlobals(const std::vector<AmxInstruction> &instrs) {
+	speculated_.clear();
+
+	cell data_size = GetAmxHeader()->hea - GetAmxHeader()->dat;
+
+	// Globals are identified by their references in the code, which are 
+	// sorted by address.
+	std::vector<std::pair<std::size_t, cell> > candidates;
+	for (DataRefs::const_iterator it = data_refs_.begin(); it != data_refs_.end(); ) {
+		cell address = it->first;
+		std::size_t reads = 0;
+		bool direct = true;
+		for (; it != data_refs_.end() && it->first == address; ++it) {
+			switch (instrs[it->second].GetOpcode()) {
+				case OP_LOAD_PRI:
+				case OP_LOAD_ALT:
+				case OP_PUSH:
+					reads++;
+					break;
+				case OP_STOR_PRI:
+				case OP_STOR_ALT:
+				case OP_ZERO:
+				case OP_INC:
+				case OP_DEC:
+					// Guarded in speculated code.
+					break;
+				default:
+					// The address is taken or the global holds a reference.
+					direct = false;
+					break;
+			}
+		}
+		if (direct && reads > 0 
+				&& address >= 0 && address < data_size && address % sizeof(cell) == 0
+				&& unspeculated_.find(address) == unspeculated_.end()
+				&& !IsPublicVariable(amx_, address)) {
+			candidates.push_back(std::make_pair(reads, address));
+		}
+	}
+
+	std::sort(candidates.begin(), candidates.end(), MoreFrequentFirst());
+	if (candidates.size() > kMaxSpeculatedGlobals) {
+		candidates.resize(kMaxSpeculatedGlobals);
+	}
+
+	for (std::size_t i = 0; i < candidates.size(); i++) {
+		cell address = candidates[i].second;
+		speculated_[address] = *reinterpret_cast<cell*>(GetAmxData() + address);
+	}
+	if (!speculated_.empty()) {
+		speculated_min_ = speculated_.begin()->first;
+		speculated_max_ = speculated_.rbegin()->first;
+	}
+}
+
+void Jitter::Speculate() {
+	// Nothing is running, so the previous speculated code can go.
+	UseCode(generic_code_);
+	FreeCode(speculated_code_);
+	speculated_.clear();
+	deoptimized_ = 0;
+
+	if (generic_code_.code == 0 || speculation_rounds_ >= kMaxSpeculationRounds) {
+		return;
+	}
+	speculation_rounds_++;
+
+	std::vector<AmxInstruction> instrs;
+	ParseCode(0, GetAmxHeader()->dat - GetAmxHeader()->cod, instrs);
+	AnalyzeCode(instrs);
+	SelectSpeculatedGlobals(instrs);
+	if (speculated_.empty()) {
+		return;
+	}
+
+	speculative_ = true;
+	try {
+		Assemble(instrs, 0, speculated_code_);
+	} catch (const JitError &) {
+		speculated_.clear();
+	}
+	speculative_ = false;
+
+	if (speculated_code_.code != 0) {
+		UseCode(speculated_code_);
+	}
+}
+
+void Jitter::InvalidateGlobals(cell address, cell size) {
+	std::map<cell, cell>::const_iterator it 
+			= speculated_.lower_bound(address - static_cast<cell>(sizeof(cell)) + 1);
+	for (; it != speculated_.end() && it->first < address + size; ++it) {
+		unspeculated_.insert(it->first);
+		deoptimized_ = 1;
+	}
+	if (deoptimized_ != 0) {
+		UseCode(generic_code_);
+	}
+}
+
+void Jitter::RevalidateGlobals() {
+	for (std::map<cell, cell>::const_iterator it = speculated_.begin(); 
+			it != speculated_.end(); ++it) {
+		if (*reinterpret_cast<cell*>(GetAmxData() + it->first) != it->second) {
+			unspeculated_.insert(it->first);
+			deoptimized_ = 1;
+		}
+	}
+	if (deoptimized_ != 0) {
+		UseCode(generic_code_);
+	}
+}
+
+void *Jitter::GetResumeAddress(cell cip) {
+	CodeMap::const_iterator it = generic_code_.code_map->find(cip);
+	assert(it != generic_code_.code_map->end());
+	return it->second + reinterpret_cast<char*>(generic_code_.code);
+}
+
+void Jitter::SelectClones(const std::vector<AmxInstruction> &instrs) {
+	clones_.clear();
+	clone_calls_.clear();
+
+	// Counts collected from clones would be mixed up with the originals'.
+	if (profiling_) {
+		return;
+	}
+
+	// Candidate clones by function and arguments, with addresses of calls.
+	typedef std::pair<cell, std::map<cell, cell> > CloneKey;
+	std::map<CloneKey, std::vector<cell> > candidates;
+
+	// Arguments (FRM offsets) that functions change or may change, by 
+	// function, and functions that can't be cloned at all.
+	std::map<cell, std::set<cell> > written_args;
+	std::set<cell> unclonable;
+
+	for (std::size_t i = 0; i < instrs.size(); i++) {
+		if (instrs[i].GetOpcode() != OP_CALL) {
+			continue;
+		}
+		cell fn_addr = instrs[i].GetOperand() - reinterpret_cast<cell>(GetAmxCode());
+
+		if (unclonable.find(fn_addr) != unclonable.end()) {
+			continue;
+		}
+		std::map<cell, std::set<cell> >::iterator written = written_args.find(fn_addr);
+		if (written == written_args.end()) {
+			std::size_t begin;
+			if (!FindInstr(instrs, fn_addr, begin) || instrs[begin].GetOpcode() != OP_PROC) {
+				unclonable.insert(fn_addr);
+				continue;
+			}
+			std::size_t end = begin + 1;
+			while (end < instrs.size() && instrs[end].GetOpcode() != OP_PROC) {
+				end++;
+			}
+			if (end - begin > kMaxCloneSize) {
+				unclonable.insert(fn_addr);
+				continue;
+			}
+			std::set<cell> args;
+			bool clonable = true;
+			for (std::size_t j = begin; j < end && clonable; j++) {
+				const AmxInstruction &instr = instrs[j];
+				switch (instr.GetOpcode()) {
+					case OP_STOR_S_PRI:
+					case OP_STOR_S_ALT:
+					case OP_ZERO_S:
+					case OP_INC_S:
+					case OP_DEC_S:
+						args.insert(instr.GetOperand());
+						break;
+					case OP_ADDR_PRI:
+					case OP_ADDR_ALT:
+					case OP_PUSH_ADR:
+						// Arguments may be accessed through their addresses.
+						clonable = instr.GetOperand() < 0;
+						break;
+					case OP_LCTRL:
+					case OP_SCTRL:
+						clonable = instr.GetOperand() != 5 && instr.GetOperand() != 4;
+						break;
+					case OP_CALL:
+						clonable = instr.GetOperand() != instrs[i].GetOperand();
+						break;
+					case OP_SYSREQ_C:
+					case OP_SYSREQ_D:
+						clonable = GetSysreqNativeName(amx_, instr) != "setarg";
+						break;
+					default:
+						break;
+				}
+			}
+			if (!clonable) {
+				unclonable.insert(fn_addr);
+				continue;
+			}
+			written = written_args.insert(std::make_pair(fn_addr, args)).first;
+		}
+
+		if (i == 0 || instrs[i - 1].GetOpcode() != OP_PUSH_C) {
+			continue;
+		}
+		NativeCall call(0, instrs, i);
+		int num_args = instrs[i - 1].GetOperand() / static_cast<cell>(sizeof(cell));
+		std::map<cell, cell> args;
+		for (int n = 1; n <= num_args; n++) {
+			const AmxInstruction *push = GetArgumentPush(call, n);
+			// Arguments follow the saved FRM, return address and argument size.
+			cell offset = static_cast<cell>((n + 2) * sizeof(cell));
+			if (push != 0 && push->GetOpcode() == OP_PUSH_C
+					&& written->second.find(offset) == written->second.end()) {
+				args[offset] = push->GetOperand();
+			}
+		}
+		if (!args.empty()) {
+			candidates[CloneKey(fn_addr, args)].push_back(GetInstrAddress(instrs[i]));
+		}
+	}
+
+	// Prefer functions that are run more often, then those called with the
+	// same arguments from more places. Functions never run with the profile
+	// are not cloned.
+	std::vector<std::pair<uint64_t, std::map<CloneKey, std::vector<cell> >::const_iterator> > order;
+	for (std::map<CloneKey, std::vector<cell> >::const_iterator it = candidates.begin(); 
+			it != candidates.end(); ++it) {
+		uint64_t weight = it->second.size();
+		if (has_profile_) {
+			uint64_t count = profile_.GetCount(it->first.first);
+			if (count == 0) {
+				continue;
+			}
+			weight = count * it->second.size();
+		}
+		order.push_back(std::make_pair(weight, it));
+	}
+	std::stable_sort(order.begin(), order.end(), HeavierFirst());
+
+	for (std::size_t i = 0; i < order.size() && clones_.size() < max_clones_; i++) {
+		const CloneKey &key = order[i].second->first;
+		Clone clone;
+		clone.function = key.first;
+		FindInstr(instrs, key.first, clone.begin);
+		clone.end = clone.begin + 1;
+		while (clone.end < instrs.size() && instrs[clone.end].GetOpcode() != OP_PROC) {
+			clone.end++;
+		}
+		clone.args = key.second;
+
+		const std::vector<cell> &calls = order[i].second->second;
+		for (std::size_t j = 0; j < calls.size(); j++) {
+			clone_calls_[calls[j]] = clones_.size();
+		}
+		clones_.push_back(clone);
+	}
+}
+
+bool Jitter::IsPureFunction(const std::vector<AmxInstruction> &instrs, cell address,
+                            std::map<cell, int> &purity) const
+{
+	std::map<cell, int>::iterator it = purity.find(address);
+	if (it != purity.end()) {
+		// A function that is still being checked calls itself.
+		return it->second == 1;
+	}
+	purity[address] = 0;
+
+	std::size_t begin;
+	bool pure = FindInstr(instrs, address, begin) && instrs[begin].GetOpcode() == OP_PROC;
+	for (std::size_t i = begin + 1; pure && i < instrs.size(); i++) {
+		const AmxInstruction &instr = instrs[i];
+		if (instr.GetOpcode() == OP_PROC) {
+			break;
+		}
+		switch (instr.GetOpcode()) {
+			// Globals, references, arrays and the heap.
+			case OP_LOAD_PRI:
+			case OP_LOAD_ALT:
+			case OP_LREF_PRI:
+			case OP_LREF_ALT:
+			case OP_LREF_S_PRI:
+			case OP_LREF_S_ALT:
+			case OP_LOAD_I:
+			case OP_LODB_I:
+			case OP_ADDR_PRI:
+			case OP_ADDR_ALT:
+			case OP_STOR_PRI:
+			case OP_STOR_ALT:
+			case OP_SREF_PRI:
+			case OP_SREF_ALT:
+			case OP_SREF_S_PRI:
+			case OP_SREF_S_ALT:
+			case OP_STOR_I:
+			case OP_STRB_I:
+			case OP_LIDX:
+			case OP_LIDX_B:
+			case OP_LCTRL:
+			case OP_SCTRL:
+			case OP_PUSH:
+			case OP_PUSH_ADR:
+			case OP_HEAP:
+			case OP_ZERO:
+			case OP_INC:
+			case OP_INC_I:
+			case OP_DEC:
+			case OP_DEC_I:
+			case OP_MOVS:
+			case OP_CMPS:
+			case OP_FILL:
+			case OP_JUMP_PRI:
+			case OP_CALL_PRI:
+			case OP_SYSREQ_PRI:
+				pure = false;
+				break;
+			case OP_SYSREQ_C:
+			case OP_SYSREQ_D:
+				pure = IsPureNative(GetSysreqNativeName(amx_, instr));
+				break;
+			case OP_CALL:
+				pure = IsPureFunction(instrs, 
+					instr.GetOperand() - reinterpret_cast<cell>(GetAmxCode()), purity);
+				break;
+			default:
+				break;
+		}
+	}
+
+	purity[address] = pure ? 1 : 2;
+	return pure;
+}
+
+void Jitter::SelectMemoized(const std::vector<AmxInstruction> &instrs) {
+	memos_.clear();
+	memo_functions_.clear();
+	memo_cache_.clear();
+	memo_counters_.clear();
+
+	// Counts collected from memoized functions would miss the cache hits.
+	if (profiling_ || (!memoization_ && memo_include_.empty())) {
+		return;
+	}
+
+	// Number of arguments passed to each function, or -1 if it varies or
+	// is not known.
+	std::map<cell, int> num_args;
+	for (std::size_t i = 0; i < instrs.size(); i++) {
+		if (instrs[i].GetOpcode() != OP_CALL) {
+			continue;
+		}
+		cell fn_addr = instrs[i].GetOperand() - reinterpret_cast<cell>(GetAmxCode());
+		int n = -1;
+		if (i > 0 && instrs[i - 1].GetOpcode() == OP_PUSH_C) {
+			n = instrs[i - 1].GetOperand() / static_cast<cell>(sizeof(cell));
+		}
+		std::map<cell, int>::iterator it = num_args.find(fn_addr);
+		if (it == num_args.end()) {
+			num_args.insert(std::make_pair(fn_addr, n));
+		} else if (it->second != n) {
+			it->second = -1;
+		}
+	}
+
+	std::map<cell, int> purity;
+	for (std::map<cell, int>::const_iterator it = num_args.begin(); 
+			it != num_args.end(); ++it) {
+		if (it->second < 0 || it->second > kMaxMemoArgs
+				|| memo_exclude_.find(it->first) != memo_exclude_.end()) {
+			continue;
+		}
+		std::size_t begin;
+		if (!FindInstr(instrs, it->first, begin) || instrs[begin].GetOpcode() != OP_PROC) {
+			continue;
+		}
+		if (memo_include_.find(it->first) == memo_include_.end()
+				&& !(memoization_ && IsPureFunction(instrs, it->first, purity))) {
+			continue;
+		}
+		Memo memo;
+		memo.function = it->first;
+		memo.num_args = it->second;
+		memo.cache = memo_cache_.size();
+		memo.counters = memo_counters_.size();
+		memo_functions_.insert(std::make_pair(memo.function, memos_.size()));
+		memos_.push_back(memo);
+		memo_cache_.resize(memo_cache_.size() + (kMemoEntrySize << kMemoCacheBits), 0);
+		memo_counters_.resize(memo_counters_.size() + 2, 0);
+	}
+}
+
+void Jitter::FindConstantPublics(const std::vector<AmxInstruction> &instrs) {
+	constant_publics_.clear();
+
+	// Profiles count calls to publics.
+	if (profiling_) {
+		return;
+	}
+
+	AMX_HEADER *hdr = GetAmxHeader();
+	int num_publics = (hdr->natives - hdr->publics) / hdr->defsize;
+	constant_publics_.resize(num_publics, std::make_pair(false, 0));
+
+	for (int index = 0; index < num_publics; index++) {
+		// Scripts are compiled again with speculation when these return.
+		const char *name = GetPublicName(amx_, index);
+		if (std::strcmp(name, "OnGameModeInit") == 0 
+				|| std::strcmp(name, "OnFilterScriptInit") == 0) {
+			continue;
+		}
+
+		std::size_t i;
+		if (!FindInstr(instrs, GetPublicAddress(amx_, index), i)
+				|| instrs[i].GetOpcode() != OP_PROC) {
+			continue;
+		}
+		bool pri_known = false;
+		cell pri_value = 0;
+		for (i++; i < instrs.size(); i++) {
+			const AmxInstruction &instr = instrs[i];
+			if (instr.GetOpcode() == OP_CONST_PRI) {
+				pri_known = true;
+				pri_value = instr.GetOperand();
+			} else if (instr.GetOpcode() == OP_ZERO_PRI) {
+				pri_known = true;
+				pri_value = 0;
+			} else if (instr.GetOpcode() == OP_RETN) {
+				constant_publics_[index] = std::make_pair(pri_known, pri_value);
+				break;
+			} else if (instr.GetOpcode() != OP_BREAK && instr.GetOpcode() != OP_NOP
+					&& instr.GetOpcode() != OP_CONST_ALT && instr.GetOpcode() != OP_ZERO_ALT) {
+				break;
+			}
+		}
+	}
+}
+
+bool Jitter::GetClonedArgument(cell offset, cell &value) const {
+	if (clone_ != 0) {
+		std::map<cell, cell>::const_iterator it = clone_->args.find(offset);
+		if (it != clone_->args.end()) {
+			value = it->second;
+			return true;
+		}
+	}
+	return false;
+}
+
+bool Jitter::IsLikelyTaken(cell cip) const {
+	std::map<cell, std::size_t>::const_iterator it = branch_counters_.find(cip);
+	if (it == branch_counters_.end()) {
+		return false;
+	}
+	uint64_t runs = counters_[it->second];
+	uint64_t fall_through = counters_[it->second + 1];
+	uint64_t taken = runs - fall_through;
+	if (inverted_branches_.find(cip) != inverted_branches_.end()) {
+		taken = fall_through;
+	}
+	return taken > runs - taken;
+}
+
+bool Jitter::RecordTrace(const std::vector<AmxInstruction> &instrs, cell header, 
+                         std::vector<TraceStep> &trace) const 
+{
+	std::size_t index;
+	if (!FindInstr(instrs, header, index)) {
+		return false;
+	}
+
+	// Inlined CALLs and the functions they call.
+	std::vector<std::pair<std::size_t, cell> > calls;
+
+	while (trace.size() < kMaxTraceLength && index < instrs.size()) {
+		const AmxInstruction &instr = instrs[index];
+		cell cip = GetInstrAddress(instr);
+		if (cip == header && !trace.empty()) {
+			return calls.empty();
+		}
+
+		cell next_cip = index + 1 < instrs.size() ? GetInstrAddress(instrs[index + 1]) : -1;
+		cell dest = -1;
+		switch (instr.GetOpcode()) {
+			case OP_JUMP:
+				dest = instr.GetOperand() - reinterpret_cast<cell>(GetAmxCode());
+				break;
+			case OP_JZER:
+			case OP_JNZ:
+			case OP_JEQ:
+			case OP_JNEQ:
+			case OP_JLESS:
+			case OP_JLEQ:
+			case OP_JGRTR:
+			case OP_JGEQ:
+			case OP_JSLESS:
+			case OP_JSLEQ:
+			case OP_JSGRTR:
+			case OP_JSGEQ: {
+				cell target = instr.GetOperand() - reinterpret_cast<cell>(GetAmxCode());
+				if (IsLikelyTaken(cip)) {
+					trace.push_back(TraceStep(index, TraceStep::TAKEN, next_cip));
+					dest = target;
+				} else {
+					trace.push_back(TraceStep(index, TraceStep::NOT_TAKEN, target));
+					index++;
+				}
+				break;
+			}
+			case OP_CALL: {
+				cell fn_addr = instr.GetOperand() - reinterpret_cast<cell>(GetAmxCode());
+				bool recursive = false;
+				for (std::size_t i = 0; i < calls.size(); i++) {
+					recursive = recursive || calls[i].second == fn_addr;
+				}
+				std::size_t fn_index;
+				if (recursive || calls.size() >= kMaxTraceInlineDepth 
+						|| !FindInstr(instrs, fn_addr, fn_index)) {
+					trace.push_back(TraceStep(index, TraceStep::CALL));
+					index++;
+				} else {
+					trace.push_back(TraceStep(index, TraceStep::INLINED_CALL));
+					calls.push_back(std::make_pair(index, fn_addr));
+					index = fn_index;
+				}
+				break;
+			}
+			case OP_RET:
+			case OP_RETN:
+				if (calls.empty()) {
+					// The loop's function returns.
+					trace.push_back(TraceStep(index, TraceStep::EXIT, cip));
+					return true;
+				}
+				trace.push_back(TraceStep(index, TraceStep::INLINED_RETURN));
+				index = calls.back().first + 1;
+				calls.pop_back();
+				break;
+			case OP_JUMP_PRI:
+			case OP_CALL_PRI:
+			case OP_SWITCH:
+			case OP_CASETBL:
+			case OP_HALT:
+			case OP_SYSREQ_PRI:
+			case OP_SCTRL:
+				trace.push_back(TraceStep(index, TraceStep::EXIT, cip));
+				return true;
+			default:
+				trace.push_back(TraceStep(index));
+				index++;
+				break;
+		}
+
+		if (dest >= 0) {
+			if (dest == header) {
+				if (!calls.empty()) {
+					return false;
+				}
+				return true;
+			}
+			if (dest <= cip) {
+				// Another loop, which gets its own trace.
+				trace.push_back(TraceStep(index, TraceStep::EXIT, dest));
+				return true;
+			}
+			if (!FindInstr(instrs, dest, index)) {
+				return false;
+			}
+		}
+	}
+	return false;
+}
+
+void *Jitter::EnterTrace(cell header) {
+	std::size_t index = trace_counters_[header];
+	cell &countdown = trace_countdowns_[index];
+
+	std::map<cell, void*>::const_iterator it = traces_.find(header);
+	if (it == traces_.end()) {
+		void *code = 0;
+		std::vector<AmxInstruction> instrs;
+		ParseCode(0, GetAmxHeader()->dat - GetAmxHeader()->cod, instrs);
+		AnalyzeCode(instrs);
+		std::vector<TraceStep> trace;
+		if (RecordTrace(instrs, header, trace)) {
+			try {
+				// Branches in traces are all long, there's no sizing pass.
+				short_branches_.clear();
+				AsmJit::Assembler as;
+				CodeMap code_map;
+				LabelMap label_map;
+				EmitCode(as, instrs, &code_map, &label_map, false, &trace);
+				code = as.make();
+				AddCodeRange(code, as.getCodeSize());
+				KeepFormatPlans(code);
+			} catch (const JitError &) {
+				code = 0;
+			}
+		}
+		it = traces_.insert(std::make_pair(header, code)).first;
+	}
+
+	// From now on the loop header enters the trace without calling here.
+	// Loops that can't be traced are given up on. Either way the loop's 
+	// branches no longer need counting for it.
+	trace_slots_[index] = it->second;
+	countdown = std::numeric_limits<cell>::max();
+	RetireBranchCounts(index);
+	return it->second;
+}
+
 Jitter::~Jitter() {
-	if (code_ != 0) {
-		AsmJit::MemoryManager::getGlobal()->free(code_);
+	for (std::map<cell, void*>::iterator it = traces_.begin(); it != traces_.end(); ++it) {
+		if (it->second != 0) {
+			AsmJit::MemoryManager::getGlobal()->free(it->second);
+		}
+	}
+	FreeCode(generic_code_);
+	FreeCode(speculated_code_);
+	if (entry_ != 0) {
+		AsmJit::MemoryManager::getGlobal()->free(entry_);
+	}
+	AsmJit::AutoLock lock(instances_lock_);
+	std::vector<Jitter*>::iterator self = std::find(instances_.begin(), instances_.end(), this);
+	bool last_filterscript = true;
+	bool filterscripts_left = false;
+	for (std::vector<Jitter*>::iterator it = instances_.begin(); it != instances_.end(); ++it) {
+		if (it != self && (*it)->script_kind_ == SCRIPT_FILTERSCRIPT) {
+			filterscripts_left = true;
+			last_filterscript = last_filterscript && it < self;
+		}
+	}
+	if (script_kind_ == SCRIPT_FILTERSCRIPT && !last_filterscript) {
+		// The server may load the next filterscript into the free slot.
+		filterscript_order_known_ = false;
+	}
+	if (!filterscripts_left) {
+		filterscript_order_known_ = true;
 	}
+	instances_.erase(self);
+	instances_version_++;
+	remote_cache_.clear();
 }
 
 void Jitter::Jump(cell ip, void *stack_ptr) {
@@ -1378,106 +5882,16 @@ void Jitter::Jump(cell ip, void *stack_ptr) {
 }
 
 void Jitter::CallFunction(cell address, cell *params, cell *retval) {
-	int parambytes = params[0];
-	int paramcount = parambytes / sizeof(cell);
-
-	const void *start = GetInstrPtr(address, GetCode());	
-	cell retval_;
-
+	void *start = GetInstrPtr(address, GetCode());
 	assert(start != 0);
+	CallCode(start, params, retval);
+}
 
-	void *halt_esp = halt_esp_;
-	void *halt_ebp = halt_ebp_;
-
-	#if defined COMPILER_MSVC
-		if (++call_depth_ == 1) {
-			assert(stack_.IsReady());
-			void *stack_top = stack_.GetTop();
-			__asm {
-				mov dword ptr [esp_], esp
-				mov esp, dword ptr [stack_top]
-			}
-		}
-		__asm {
-			push esi
-			push edi
-		}
-		for (int i = paramcount; i >= 0; --i) {
-			__asm {
-				mov eax, dword ptr [i]
-				mov ecx, dword ptr [params]
-				push dword ptr [ecx + eax * 4]
-			}
-		}
-		__asm {
-			mov eax, dword ptr [this]
-			lea ecx, dword ptr [esp - 4]
-			mov dword ptr [eax].halt_esp_, ecx
-			mov dword ptr [eax].halt_ebp_, ebp
-			call dword ptr [start]
-			mov dword ptr [retval_], eax
-			add esp, dword ptr [parambytes]
-			add esp, 4
-			pop edi
-			pop esi
-		}
-		if (--call_depth_ == 0) {
-			__asm {
-				mov esp, dword ptr [esp_]
-			}
-		}
-	#elif defined COMPILER_GCC
-		if (++call_depth_ == 1) {
-			__asm__ __volatile__ (
-				"movl %%esp, %0;"
-				"movl %1, %%esp;"
-					: "=r"(esp_)
-					: "r"(stack_.GetTop())
-					: );
-		}
-		__asm__ __volatile__ (
-			"pushl %%esi;"
-			"pushl %%edi;"
-				: : : "%esp");
-		for (int i = paramcount; i >= 0; --i) {
-			__asm__ __volatile__ (
-				"pushl %0;"
-					: : "r"(params[i]) : "%esp");
-		}
-		__asm__ __volatile__ (
-			"leal -4(%%esp), %%eax;"
-			"movl %%eax, (%0);"
-			"movl %%ebp, (%1);"
-				:
-				: "r"(&halt_esp_), "r"(&halt_ebp_)
-				: "%eax");
-		__asm__ __volatile__ (
-			"calll *%1;"
-			"movl %%eax, %0;"
-				: "=r"(retval_)
-				: "r"(start)
-				: "%ecx", "%edx" );
-		__asm__ __volatile__ (
-			"addl %0, %%esp;"
-			"popl %%edi;"
-			"popl %%esi;"
-				:
-				: "r"(parambytes + sizeof(cell))
-				: );
-		if (--call_depth_ == 0) {
-			__asm__ __volatile__ (
-				"movl %0, %%esp;"
-					:
-					: "r"(esp_)
-					: );
-		}
-	#endif
-
-	halt_esp_ = halt_esp;
-	halt_ebp_ = halt_ebp;
-
+void Jitter::CallCode(void *start, cell *params, cell *retval) {
+	typedef cell (*EntryThunk)(void *start, const cell *params, ExecutionContext *context);
+	cell result = reinterpret_cast<EntryThunk>(entry_)(start, params, GetExecutionContext());
 	if (retval != 0) {
-		*retval = retval_;
+		*retval = result;
 	}
 }
 
@@ -1487,10 +5901,6 @@ int Jitter::CallPublicFunction(int index, cell *retval) {
 		return AMX_ERR_NOTFOUND;
 	}
 
-	// Some instructions may set a non-zero error code to indicate
-	// that a runtime error occured (e.g. array index out of bounds).
-	amx_->error = AMX_ERR_NONE;
-
 	amx_->stk -= sizeof(cell);
 	int paramcount = amx_->paramcount;
 	cell *params = reinterpret_cast<cell*>(GetAmxData() + amx_->stk);
@@ -1499,12 +5909,7 @@ int Jitter::CallPublicFunction(int index, cell *retval) {
 	amx_->reset_hea = amx_->hea;
 	amx_->reset_stk = amx_->stk;
 
-	cell address = GetPublicAddress(amx_, index);
-	if (address == 0) {
-		amx_->error = AMX_ERR_INDEX;
-	} else {
-		CallFunction(address, params, retval);
-	}
+	CallPublic(index, params, retval);
 
 	// Reset STK and_ parameter count.
 	amx_->stk += (paramcount + 1) * sizeof(cell);
@@ -1513,4 +5918,114 @@ int Jitter::CallPublicFunction(int index, cell *retval) {
 	return amx_->error;
 }
 
+int Jitter::CallPublic(int index, cell *params, cell *retval) {
+	// Some instructions may set a non-zero error code to indicate
+	// that a runtime error occured (e.g. array index out of bounds).
+	amx_->error = AMX_ERR_NONE;
+
+	if (code_ != 0 && code_ == speculated_code_.code) {
+		// Globals may have been changed from outside of the script.
+		RevalidateGlobals();
+	}
+
+	// Publics are looked up in a flat array, main() is rarely called.
+	void *start = 0;
+	if (index >= 0 && index < static_cast<int>(public_entries_.size())) {
+		start = public_entries_[index];
+	} else if (index == AMX_EXEC_MAIN) {
+		cell address = GetPublicAddress(amx_, index);
+		start = address != 0 ? GetInstrPtr(address, GetCode()) : 0;
+	}
+	if (start == 0) {
+		amx_->error = AMX_ERR_INDEX;
+	} else {
+		active_calls_++;
+		CallCode(start, params, retval);
+		active_calls_--;
+	}
+
+	// Speculate once the script has initialized its globals, and again 
+	// without the offending globals after speculated code had to be left.
+	if (speculation_ && active_calls_ == 0) {
+		const char *name = GetPublicName(amx_, index);
+		bool init = name != 0 && (std::strcmp(name, "OnGameModeInit") == 0 
+		                       || std::strcmp(name, "OnFilterScriptInit") == 0);
+		if ((init && speculation_rounds_ == 0) || deoptimized_ != 0) {
+			Speculate();
+		}
+	}
+
+	return amx_->error;
+}
+
+void Jitter::BuildNameTable(NameTable &table, bool natives) {
+	AMX_HEADER *hdr = GetAmxHeader();
+	int count = natives ? (hdr->libraries - hdr->natives) / hdr->defsize 
+	                    : (hdr->natives - hdr->publics) / hdr->defsize;
+
+	// Keep the table at most half full so that probe sequences, including
+	// those of names that aren't there, stay short.
+	std::size_t size = 16;
+	while (size < static_cast<std::size_t>(count) * 2) {
+		size *= 2;
+	}
+	table.hashes.assign(size, 0);
+	table.slots.assign(size, 0);
+
+	for (int i = 0; i < count; i++) {
+		const char *name = natives ? GetNativeName(amx_, i) : GetPublicName(amx_, i);
+		uint32_t hash = HashString(name);
+		std::size_t slot = hash & (size - 1);
+		while (table.slots[slot] != 0) {
+			slot = (slot + 1) & (size - 1);
+		}
+		table.hashes[slot] = hash;
+		table.slots[slot] = i + 1;
+	}
+}
+
+int Jitter::FindName(const NameTable &table, bool natives, const char *name, int *index) const {
+	uint32_t hash = HashString(name);
+	std::size_t mask = table.slots.size() - 1;
+	for (std::size_t slot = hash & mask; table.slots[slot] != 0; slot = (slot + 1) & mask) {
+		if (table.hashes[slot] == hash) {
+			int i = table.slots[slot] - 1;
+			const char *other = natives ? GetNativeName(amx_, i) : GetPublicName(amx_, i);
+			if (std::strcmp(name, other) == 0) {
+				*index = i;
+				return AMX_ERR_NONE;
+			}
+		}
+	}
+	// Not found, set to an invalid index like amx_FindPublic() does.
+	*index = std::numeric_limits<int>::max();
+	return AMX_ERR_NOTFOUND;
+}
+
+int Jitter::FindPublic(const char *name, int *index) const {
+	return FindName(public_names_, false, name, index);
+}
+
+int Jitter::FindNative(const char *name, int *index) const {
+	return FindName(native_names_, true, name, index);
+}
+
+bool Jitter::CallConstantPublic(int index, cell *retval) {
+	if (index < 0 || index >= static_cast<int>(constant_publics_.size())
+			|| !constant_publics_[index].first
+			|| (amx_->flags & AMX_FLAG_NTVREG) == 0) {
+		return false;
+	}
+
+	// Pop the arguments as if the function had run.
+	amx_->error = AMX_ERR_NONE;
+	amx_->stk += amx_->paramcount * sizeof(cell);
+	amx_->paramcount = 0;
+
+	if (retval != 0) {
+		*retval = constant_publics_[index].second;
+	}
+	return true;
+}
+
 } // namespace jit
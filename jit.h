@@ -24,16 +24,23 @@
 #ifndef JIT_H
 #define JIT_H
 
+#include <cstddef>
 #include <cstdio>
 #include <cstdlib>
+#include <list>
 #include <map>
+#include <set>
 #include <string>
+#include <utility>
 #include <vector>
 
 #include <AsmJit/Assembler.h>
 #include <AsmJit/Operand.h>
+#include <AsmJit/Platform.h>
 
 #include "amx/amx.h"
+#include "format.h"
+#include "profile.h"
 
 namespace jit {
 
@@ -93,6 +100,115 @@ private:
 	const cell *ip_;
 };
 
+// A SYSREQ.C or SYSREQ.D instruction as seen by native overrides.
+class NativeCall {
+public:
+	NativeCall(cell address, const std::vector<AmxInstruction> &instrs, std::size_t index)
+		: address_(address), instrs_(instrs), index_(index)
+	{}
+
+	// Address of the native function.
+	inline cell GetAddress() const
+		{ return address_; }
+	// All instructions of the script.
+	inline const std::vector<AmxInstruction> &GetInstructions() const
+		{ return instrs_; }
+	// Index of the SYSREQ instruction in GetInstructions().
+	inline std::size_t GetIndex() const
+		{ return index_; }
+
+private:
+	cell address_;
+	const std::vector<AmxInstruction> &instrs_;
+	std::size_t index_;
+};
+
+// An operand of a loop recognized by the JIT.
+struct LoopOperand {
+	enum Type {
+		CONSTANT,  // value
+		LOCAL,     // variable or array at FRM + value
+		GLOBAL,    // variable or array at value
+		LOCAL_REF  // array whose address is stored at FRM + value
+	};
+
+	LoopOperand(Type type = CONSTANT, cell value = 0)
+		: type(type), value(value)
+	{}
+
+	inline bool operator==(const LoopOperand &other) const
+		{ return type == other.type && value == other.value; }
+	inline bool operator!=(const LoopOperand &other) const
+		{ return !(*this == other); }
+
+	Type type;
+	cell value;
+};
+
+// A simple loop over an array that can be run with a single kernel call.
+// The loop runs while the loop variable is less than "count":
+//
+//   FILL:   array[i] = value
+//   COPY:   array[i] = source[i]
+//   SUM:    result += array[i]
+//   COUNT:  if (array[i] == value) result++
+//   MIN:    if (array[i] < result) result = array[i]
+//   MAX:    if (array[i] > result) result = array[i]
+//   FIND:   if (array[i] == value) break
+//
+// COUNT and FIND may also look for cells that are not equal to "value".
+struct LoopIdiom {
+	enum Kind {
+		FILL,
+		COPY,
+		SUM,
+		COUNT,
+		MIN,
+		MAX,
+		FIND
+	};
+
+	Kind kind;
+	cell index; // FRM offset of the loop variable
+	cell count;
+	LoopOperand array;
+	LoopOperand source;
+	LoopOperand value;
+	LoopOperand result;
+	bool equal;
+};
+
+// An instruction on a trace: a hot path around a loop that may go through
+// called functions, compiled as straight-line code. Jumps off the path and 
+// instructions the trace doesn't handle leave it for normal code at "exit".
+struct TraceStep {
+	enum Kind {
+		NORMAL,
+		TAKEN,          // conditional jump, taken on the trace
+		NOT_TAKEN,      // conditional jump, not taken on the trace
+		CALL,           // CALL to normal code
+		INLINED_CALL,   // CALL followed by the called function
+		INLINED_RETURN, // RET or RETN of an inlined function
+		EXIT
+	};
+
+	TraceStep(std::size_t index, Kind kind = NORMAL, cell exit = -1)
+		: index(index), kind(kind), exit(exit)
+	{}
+
+	std::size_t index;
+	Kind kind;
+	cell exit;
+};
+
+// Calls to a memoized function and how many of them were answered from its
+// cache.
+struct MemoStats {
+	cell function;
+	uint64_t calls;
+	uint64_t hits;
+};
+
 // Base class for JIT exceptions.
 class JitError {};
 
@@ -140,36 +256,35 @@ static inline bool operator<(const TaggedAddress &left, const TaggedAddress &rig
 	return left.GetTag() < right.GetTag();
 }
 
+// A stack for compiled code. Its lowest pages form a guard region that
+// faults on overflow; the rest is committed as it is touched.
 class StackBuffer {
 public:
 	StackBuffer() 
 		: ptr_(0)
 		, top_(0)
 		, size_(0)
+		, guard_size_(0)
 	{}
 
 	~StackBuffer() { Deallocate(); }
 
-	inline void Allocate(std::size_t size) {
-		if (ptr_ == 0) {
-			size_ = size;
-			ptr_ = std::malloc(size_);
-			top_ = reinterpret_cast<char*>(ptr_) + size_ - 4;
-		}
-	}
+	void Allocate(std::size_t size);
+	void Deallocate();
 
-	inline void Deallocate() {
-		if (ptr_ != 0) {
-			std::free(ptr_);
-			ptr_ = top_ = 0;
-			size_ = 0;
-		}
-	}
+	// (Re-)applies the guard protection. Windows lifts it on first touch.
+	void Protect();
 
 	inline bool IsReady() const { return ptr_ != 0; }
 	inline void *GetTop() const { return top_; }
 	inline void *GetPtr() const { return ptr_; }
 
+	inline bool IsGuardAddress(const void *address) const {
+		const char *ptr = reinterpret_cast<const char*>(ptr_);
+		const char *p = reinterpret_cast<const char*>(address);
+		return p >= ptr && p < ptr + guard_size_;
+	}
+
 private:
 	// Disable copying.
 	StackBuffer(const StackBuffer &);
@@ -178,6 +293,62 @@ private:
 	void *ptr_;
 	void *top_;
 	std::size_t size_;
+	std::size_t guard_size_;
+};
+
+class Jitter;
+
+// Per-thread state of running compiled code: the thread's own stack, the
+// number of calls into compiled code active on it, the Jitter whose code
+// is running (0 while switching between scripts) and the alternate signal
+// stack allocated for the thread, if any. Freed when the thread exits.
+struct ExecutionContext {
+	void *stack_top;
+	int call_depth;
+	Jitter *jitter;
+	bool overflowed;
+	void *signal_stack;
+	StackBuffer stack;
+};
+
+// Instruction set extensions that code generation may use.
+class TargetFeatures {
+public:
+	enum Feature {
+		CMOV   = 1 << 0,
+		SSE    = 1 << 1,
+		SSE2   = 1 << 2,
+		SSE3   = 1 << 3,
+		SSSE3  = 1 << 4,
+		SSE41  = 1 << 5,
+		SSE42  = 1 << 6,
+		POPCNT = 1 << 7,
+		LZCNT  = 1 << 8,
+		AVX    = 1 << 9
+	};
+
+	explicit TargetFeatures(int features = 0) : features_(features) {}
+
+	// Get features of the CPU we're running on.
+	static TargetFeatures GetHostFeatures();
+
+	// Get features of a baseline instruction set: "i386", "i686" (CMOV), 
+	// "sse", "sse2", "sse3", "ssse3", "sse4.1", "sse4.2" (and POPCNT) or 
+	// "avx". Returns false if the name is unknown.
+	static bool GetBaselineFeatures(const std::string &name, TargetFeatures &features);
+
+	inline bool Has(Feature feature) const 
+		{ return (features_ & feature) != 0; }
+	inline int GetFlags() const 
+		{ return features_; }
+	inline TargetFeatures operator&(const TargetFeatures &other) const 
+		{ return TargetFeatures(features_ & other.features_); }
+
+	// Get names of all features, separated by spaces.
+	std::string GetNames() const;
+
+private:
+	int features_;
 };
 
 class Jitter {
@@ -231,6 +402,16 @@ public:
 		return -1;
 	}
 
+	// Get address of an instruction relative to the start of the code section.
+	inline cell GetInstrAddress(const AmxInstruction &instr) const {
+		return reinterpret_cast<cell>(instr.GetIP()) - reinterpret_cast<cell>(GetAmxCode());
+	}
+
+	// Find the instruction at the specified address (relative to the start of
+	// the code section) in a sequence returned by ParseCode().
+	bool FindInstr(const std::vector<AmxInstruction> &instrs, cell address, 
+	               std::size_t &index) const;
+
 	// Turn raw AMX code into a sequence of AmxInstruction's.
 	void ParseCode(cell start, cell end, std::vector<AmxInstruction> &instructions) const;
 
@@ -247,9 +428,113 @@ public:
 	// Call a public function.
 	virtual int CallPublicFunction(int index, cell *retval);
 
-	// Set size of stack buffer used by JIT code. By default it's 1 MB.
+	// Same as amx_FindPublic() and amx_FindNative() but use hash tables
+	// built when the Jitter is created.
+	int FindPublic(const char *name, int *index) const;
+	int FindNative(const char *name, int *index) const;
+
+	// Call a public function that does nothing but return a constant without
+	// entering compiled code. Returns false if the function must be called
+	// with CallPublicFunction().
+	bool CallConstantPublic(int index, cell *retval);
+
+	// Get a hash of the script's code that identifies it in a profile.
+	uint32_t GetCodeHash() const;
+
+	// Lay out code according to a profile collected from an earlier run of 
+	// the same script. Returns false and ignores the profile if it was made 
+	// for different code. Must be called before Compile().
+	bool SetProfile(const Profile &profile);
+
+	// Make compiled code count calls, basic blocks and branches for
+	// GetProfile(). Must be called before Compile().
+	void EnableProfiling();
+
+	// Get the counts collected so far.
+	void GetProfile(Profile &profile) const;
+
+	// What the server loaded the script as. CallRemoteFunction() is only
+	// sped up while all scripts are known to be a gamemode or filterscript,
+	// as the server calls no others. Unknown by default.
+	enum ScriptKind {
+		SCRIPT_UNKNOWN,
+		SCRIPT_GAMEMODE,
+		SCRIPT_FILTERSCRIPT
+	};
+	void SetScriptKind(ScriptKind kind);
+
+	// Compile a trace of a loop that has become hot and get its address, or
+	// null if the loop can't be traced. Called from compiled code.
+	void *EnterTrace(cell header);
+
+	// Set size of stack buffers used by JIT code. Each thread that runs
+	// compiled code gets its own. By default it's 1 MB.
 	static void SetStackSize(std::size_t stack_size);
 
+	// Set what instruction set extensions compiled code may use. By default
+	// everything the host CPU supports is used.
+	static void SetTargetFeatures(const TargetFeatures &features);
+
+	// Get instruction set extensions used by compiled code.
+	static const TargetFeatures &GetTargetFeatures();
+
+	enum AlignFlags {
+		ALIGN_NONE      = 0,
+		ALIGN_FUNCTIONS = 1, // function entry points (PROC)
+		ALIGN_LOOPS     = 2, // targets of backward jumps
+		ALIGN_BOTH      = ALIGN_FUNCTIONS | ALIGN_LOOPS
+	};
+
+	// Set what code is aligned and to how many bytes (a power of two up to 
+	// 64). By default nothing is aligned. Returns false and leaves alignment
+	// off if the size is invalid.
+	static bool SetCodeAlignment(int flags, int size);
+
+	// Compile a second version of the code once the script has initialized,
+	// with globals that are not expected to change treated as constants.
+	// Off by default.
+	static void SetSpeculation(bool speculation);
+
+	// Set how many copies of functions specialized for constant arguments
+	// may be made. 16 by default, 0 disables this.
+	static void SetMaxClones(std::size_t max_clones);
+
+	// Cache results of functions that only compute a value from their
+	// arguments, found automatically if "automatic" is set or listed with
+	// SetMemoizedFunctions(). Off by default.
+	static void SetMemoization(bool automatic);
+
+	// Always memoize functions of this script listed in "include" and never
+	// those in "exclude". Functions are identified by their addresses. Must
+	// be called before Compile().
+	void SetMemoizedFunctions(const std::set<cell> &include, const std::set<cell> &exclude);
+
+	// Get the number of calls and cache hits of memoized functions.
+	void GetMemoStats(std::vector<MemoStats> &stats) const;
+
+	// Compile hot loops again as traces that follow the most likely path
+	// through the loop and the functions it calls. Off by default.
+	static void SetTracing(bool tracing);
+
+	// Called from speculated code after something may have been written to 
+	// [address, address + size) or after a native call. If a speculated 
+	// global has changed, generic code is used from now on.
+	void InvalidateGlobals(cell address, cell size);
+	void RevalidateGlobals();
+
+	// Get address of generic code for an AMX instruction, for leaving
+	// speculated code after it has been invalidated.
+	void *GetResumeAddress(cell cip);
+
+	// Makes a thread that faulted in compiled code continue at the halt path
+	// of the running script with the given error. eip, esp and ebp are the
+	// thread's registers. Returns false if no script was running. Faults in
+	// natives must not be passed here.
+	static bool HaltOnFault(cell error, void **eip, void **esp, void **ebp);
+
+	// Check if an address is in code compiled for this script.
+	bool IsCodeAddress(const void *address) const;
+
 private:
 	// Disable copying.
 	Jitter(const Jitter &);
@@ -269,32 +554,439 @@ private:
 	typedef std::map<TaggedAddress, AsmJit::Label> LabelMap;
 	LabelMap *label_map_;
 
+	// A compiled version of the script. code_, code_map_ and label_map_ 
+	// refer to the one in use.
+	struct CompiledCode {
+		CompiledCode() : code(0), code_map(0), label_map(0) {}
+		void *code;
+		CodeMap *code_map;
+		LabelMap *label_map;
+	};
+	CompiledCode generic_code_;
+	CompiledCode speculated_code_;
+
+	void UseCode(const CompiledCode &code);
+	void FreeCode(CompiledCode &code);
+
+	// Start and end of every block of compiled code of this script, including
+	// traces. Used to tell faults in compiled code from those in natives.
+	typedef std::map<const char*, const char*> CodeRanges;
+	CodeRanges code_ranges_;
+
+	void AddCodeRange(const void *code, std::size_t size);
+
+	// Open addressing hash table of public or native names. Slots hold
+	// indices plus one, 0 is an empty slot.
+	struct NameTable {
+		std::vector<uint32_t> hashes;
+		std::vector<int> slots;
+	};
+	NameTable public_names_;
+	NameTable native_names_;
+
+	void BuildNameTable(NameTable &table, bool natives);
+	int FindName(const NameTable &table, bool natives, const char *name, int *index) const;
+
+	// Entry points of public functions in the code in use, by index.
+	std::vector<void*> public_entries_;
+
+	// Switches to the JIT stack if not already on it, copies the parameters
+	// and calls compiled code: cell entry(void *start, const cell *params,
+	// ExecutionContext *context).
+	void *entry_;
+
+	// Call compiled code at "start" through the entry thunk.
+	void CallCode(void *start, cell *params, cell *retval);
+
+	// Call a public function with parameters that are already set up,
+	// params[0] being their size in bytes.
+	int CallPublic(int index, cell *params, cell *retval);
+
+	// Generate code for already analyzed instructions.
+	void Assemble(std::vector<AmxInstruction> &instrs, std::FILE *list_stream, 
+	              CompiledCode &result);
+
 	// Label code location. The label can optionally have a unique name.
 	AsmJit::Label &Label(AsmJit::Assembler &as, 
 	                     LabelMap *label_map, 
 	                     cell address, 
 	                     const std::string &name = std::string());
 
-	typedef void (Jitter::*NativeOverride)(AsmJit::Assembler &as);
+	// Addresses of all jump targets and function entry points.
+	std::set<cell> jump_targets_;
+
+	// Targets of backward jumps, and the last backward jump to each of them.
+	std::set<cell> loop_headers_;
+	std::map<cell, cell> loop_ends_;
+
+	// Get the headers of all loops whose code contains an address.
+	void GetEnclosingLoops(cell cip, std::vector<cell> &headers) const;
+
+	// Addresses of function entry points (including the code before the 
+	// first function) and of all basic blocks.
+	std::set<cell> functions_;
+	std::set<cell> blocks_;
+
+	// Data addresses used as operands, along with indices of the instructions,
+	// sorted by address.
+	typedef std::vector<std::pair<cell, std::size_t> > DataRefs;
+	DataRefs data_refs_;
+
+	// Collect jump targets and data references.
+	void AnalyzeCode(const std::vector<AmxInstruction> &instrs);
+
+	// Get the instruction that pushes the n-th argument (starting from 1) of
+	// a native call. Returns 0 if the argument isn't pushed by a single push
+	// immediately before the call.
+	const AmxInstruction *GetArgumentPush(const NativeCall &call, int n) const;
+
+	// Check if a string in the data section is never written to. The push
+	// at index "push" is ignored.
+	bool IsConstantString(const std::vector<AmxInstruction> &instrs, 
+	                      cell address, std::size_t push) const;
+
+	// Check if the FILL at the given index zeroes a local buffer that is
+	// then immediately passed to a native that overwrites all of it.
+	bool IsFilledBufferOverwritten(const std::vector<AmxInstruction> &instrs, 
+	                               std::size_t fill) const;
+
+	// Array loops that can be replaced with a kernel call, by index of the
+	// first instruction of the loop condition.
+	std::map<std::size_t, LoopIdiom> loops_;
+
+	// Try to recognize a loop that ends with a backward jump from "back" to
+	// "top". On success "test" is set to the index of the loop condition.
+	bool AnalyzeLoop(const std::vector<AmxInstruction> &instrs, std::size_t top,
+	                 std::size_t back, std::size_t &test, LoopIdiom &loop) const;
+
+	// Get memory operand for a LOCAL or GLOBAL loop operand.
+	AsmJit::Mem GetLoopOperandPtr(const LoopOperand &operand) const;
+
+	// A native override returns false if it didn't emit any code, in which
+	// case the native is called as usual.
+	typedef bool (Jitter::*NativeOverride)(AsmJit::Assembler &as, const NativeCall &call);
 	std::map<std::string, NativeOverride> native_overrides_;
 
 	// Native overrides for floating-point natives.
-	void native_float(AsmJit::Assembler &as);
-	void native_floatabs(AsmJit::Assembler &as);
-	void native_floatadd(AsmJit::Assembler &as);
-	void native_floatsub(AsmJit::Assembler &as);
-	void native_floatmul(AsmJit::Assembler &as);
-	void native_floatdiv(AsmJit::Assembler &as);
-	void native_floatsqroot(AsmJit::Assembler &as);
-	void native_floatlog(AsmJit::Assembler &as);
+	bool native_float(AsmJit::Assembler &as, const NativeCall &call);
+	bool native_floatabs(AsmJit::Assembler &as, const NativeCall &call);
+	bool native_floatadd(AsmJit::Assembler &as, const NativeCall &call);
+	bool native_floatsub(AsmJit::Assembler &as, const NativeCall &call);
+	bool native_floatmul(AsmJit::Assembler &as, const NativeCall &call);
+	bool native_floatdiv(AsmJit::Assembler &as, const NativeCall &call);
+	bool native_floatsqroot(AsmJit::Assembler &as, const NativeCall &call);
+	bool native_floatlog(AsmJit::Assembler &as, const NativeCall &call);
+
+	// Native overrides for string natives (SSE2 only).
+	bool native_strlen(AsmJit::Assembler &as, const NativeCall &call);
+	bool native_strcmp(AsmJit::Assembler &as, const NativeCall &call);
+	bool native_strfind(AsmJit::Assembler &as, const NativeCall &call);
+	bool native_strcat(AsmJit::Assembler &as, const NativeCall &call);
+	bool native_strmid(AsmJit::Assembler &as, const NativeCall &call);
+
+	// format() with a constant format string. Plans are collected in 
+	// new_format_plans_ while code is being emitted (except in the sizing 
+	// pass) and then kept in format_plans_ until the code is freed.
+	bool native_format(AsmJit::Assembler &as, const NativeCall &call);
+	std::list<FormatPlan> new_format_plans_;
+	std::map<const void*, std::list<FormatPlan> > format_plans_;
+
+	void KeepFormatPlans(const void *code);
+
+	// funcidx() and CallLocalFunction() with a constant function name.
+	bool native_funcidx(AsmJit::Assembler &as, const NativeCall &call);
+	bool native_CallLocalFunction(AsmJit::Assembler &as, const NativeCall &call);
+
+	// CallRemoteFunction() calls publics of other scripts directly when all
+	// arguments are passed by value, filterscripts first and the gamemode
+	// last like the server does. Targets are cached by function name and
+	// format until a script is loaded or unloaded.
+	bool native_CallRemoteFunction(AsmJit::Assembler &as, const NativeCall &call);
+	static cell CallRemoteFunction(AMX *amx, cell *params, AMX_NATIVE native);
+
+	// A public function called by the broadcast thunk, with pointers to
+	// its entry and the state of its Jitter that the call changes.
+	struct BroadcastTarget {
+		Jitter *jitter;
+		unsigned int serial;
+		int index;
+		void **entry;
+		void **halt_esp;
+		void **halt_ebp;
+		AMX *amx;
+	};
+
+	typedef std::map<std::pair<std::string, std::string>, 
+	                 std::vector<BroadcastTarget> > RemoteCache;
+	static RemoteCache remote_cache_;
+
+	// Calls a list of publics with the same parameters, switching stacks
+	// only once: int broadcast(const BroadcastTarget *targets, int count,
+	// const cell *params, cell *retvals, ExecutionContext *context,
+	// unsigned int version). Each AMX gets its own error code and each call
+	// its own copy of the parameters. Stops when instances_version_ is no
+	// longer "version" and returns the number of targets not called.
+	static void *broadcast_;
+
+	static std::vector<Jitter*> instances_;
+	static unsigned int next_serial_;
+
+	// Changed whenever a Jitter is created or deleted.
+	static unsigned int instances_version_;
+
+	// Filterscripts are called in the order of the server's slots. That
+	// is the order in instances_ until a filterscript other than the last
+	// one is unloaded.
+	static bool filterscript_order_known_;
+
+	// Check that a target's Jitter hasn't been deleted by an earlier call.
+	static bool IsLiveTarget(const BroadcastTarget &target);
+
+	// Protects instances_, remote_cache_ and the above from other threads.
+	static AsmJit::Lock instances_lock_;
+
+	// Get the calling thread's context, creating it on first use.
+	static ExecutionContext *GetExecutionContext();
+
+	// Get a constant unpacked string passed as the n-th argument of a native.
+	bool GetConstantArgument(const NativeCall &call, int n, std::string &s) const;
+
+	// Profile used by LayoutCode(), if any.
+	Profile profile_;
+	bool has_profile_;
+
+	// Indices of instructions in the order in which they are emitted. 
+	std::vector<std::size_t> layout_;
+
+	// Order functions by calls between them and basic blocks by how often 
+	// they are run, with blocks that were never run at the end of the code. 
+	// Without a profile instructions keep their original order.
+	void LayoutCode(const std::vector<AmxInstruction> &instrs);
+
+	// Counters incremented by instrumented code. Blocks have one counter
+	// each, CALLs have one counter and the called address, and conditional 
+	// jumps have two counters: number of runs and number of times the code
+	// after the jump has been reached. Jumps that were inverted by the layout
+	// are in inverted_branches_.
+	bool profiling_;
+	std::vector<uint64_t> counters_;
+	std::map<cell, std::size_t> block_counters_;
+	std::map<cell, std::pair<cell, std::size_t> > call_counters_;
+	std::map<cell, std::size_t> branch_counters_;
+	std::set<cell> inverted_branches_;
+
+	// Without profiling, branches are only counted to record traces: only
+	// those inside loops, and only until all loops around them have been 
+	// traced or given up on. By counter index: the number of such loops 
+	// left and the counting code, which is then jumped over. Sites are 
+	// collected by offset while code is being emitted.
+	struct BranchCountSite {
+		std::size_t counter;
+		sysint_t offset;
+		sysint_t size;
+	};
+	std::map<std::size_t, int> branch_loops_left_;
+	std::vector<BranchCountSite> new_branch_count_sites_;
+	std::multimap<std::size_t, std::pair<char*, sysint_t> > branch_count_sites_;
+
+	// Branch counters inside each loop, by trace counter index.
+	std::vector<std::vector<std::size_t> > loop_branches_;
+
+	void KeepBranchCountSites(void *code);
+	void RetireBranchCounts(std::size_t loop);
+
+	// Globals assumed to keep their values in speculated code, with the 
+	// values, and their address range. Globals that changed after all are
+	// never speculated on again. speculative_ is set while speculated code
+	// is being emitted.
+	std::map<cell, cell> speculated_;
+	cell speculated_min_;
+	cell speculated_max_;
+	std::set<cell> unspeculated_;
+	bool speculative_;
+
+	// Set when speculated code must be left at the next check.
+	int deoptimized_;
+
+	// Number of times speculated code has been compiled, and number of 
+	// public function calls in progress.
+	int speculation_rounds_;
+	int active_calls_;
+
+	// Get the value of a global if speculated code may assume it.
+	bool GetSpeculatedValue(cell address, cell &value) const;
+
+	// Pick globals that are only read or written directly and never have
+	// their address taken, read most often first.
+	void SelectSpeculatedGlobals(const std::vector<AmxInstruction> &instrs);
+
+	// Compile speculated code with current values of globals and use it.
+	// Must not be called while any code is running.
+	void Speculate();
+
+	// Check if an array loop kernel may write to a speculated global.
+	bool MayWriteSpeculated(const LoopIdiom &loop) const;
+
+	// A copy of a function for calls that pass it the same constant 
+	// arguments, which are folded into the copy. "args" maps FRM offsets of
+	// the arguments to their values.
+	struct Clone {
+		cell function;
+		std::size_t begin;
+		std::size_t end;
+		std::map<cell, cell> args;
+	};
+
+	// Clones, clones by address of CALLs that use them, and the clone that 
+	// is being emitted, if any.
+	std::vector<Clone> clones_;
+	std::map<cell, std::size_t> clone_calls_;
+	const Clone *clone_;
+
+	// What the script was loaded as, and a number that tells this Jitter
+	// apart from earlier ones at the same address.
+	ScriptKind script_kind_;
+	unsigned int serial_;
+
+	// Entry points of clones while code is being emitted.
+	std::vector<AsmJit::Label> clone_labels_;
+
+	// Find calls with constant arguments to functions that don't change 
+	// those arguments and pick the most used ones for cloning.
+	void SelectClones(const std::vector<AmxInstruction> &instrs);
+
+	// Get the value of an argument (by FRM offset) in the clone being 
+	// emitted.
+	bool GetClonedArgument(cell offset, cell &value) const;
+
+	// Results of public functions that only return a constant, by index.
+	std::vector<std::pair<bool, cell> > constant_publics_;
+
+	// Find public functions whose result is known at compile time.
+	void FindConstantPublics(const std::vector<AmxInstruction> &instrs);
+
+	// A function with a result cache. The cache is direct-mapped, each entry
+	// has a "valid" flag, the arguments and the result (8 cells in total).
+	// "cache" and "counters" are indices in memo_cache_ and memo_counters_
+	// (calls that missed and hit the cache).
+	struct Memo {
+		cell function;
+		int num_args;
+		std::size_t cache;
+		std::size_t counters;
+	};
+
+	std::vector<Memo> memos_;
+	std::set<cell> memo_include_;
+	std::set<cell> memo_exclude_;
+	std::map<cell, std::size_t> memo_functions_;
+	std::vector<cell> memo_cache_;
+	std::vector<uint64_t> memo_counters_;
+
+	// Thunks that look up results before calling the memoized functions,
+	// while code is being emitted.
+	std::vector<AsmJit::Label> memo_labels_;
+
+	// Check if a function has no effects and depends only on its arguments.
+	// "purity" is shared between calls: 0 - being checked, 1 - pure,
+	// 2 - not pure.
+	bool IsPureFunction(const std::vector<AmxInstruction> &instrs, cell address,
+	                    std::map<cell, int> &purity) const;
+
+	// Pick functions to memoize and allocate their caches.
+	void SelectMemoized(const std::vector<AmxInstruction> &instrs);
+
+	// Countdowns of loop headers to when their loops are traced, traces by
+	// loop header and offsets of code following each CALL in generic code.
+	// Loop headers jump straight to the entry in trace_slots_ once their
+	// trace is compiled.
+	std::vector<cell> trace_countdowns_;
+	std::vector<void*> trace_slots_;
+	std::map<cell, std::size_t> trace_counters_;
+	std::map<cell, void*> traces_;
+	std::map<cell, sysint_t> call_returns_;
+
+	// Follow the likely path from a loop header back to it, according to 
+	// the branch counters. Returns false if there's no such path.
+	bool RecordTrace(const std::vector<AmxInstruction> &instrs, cell header, 
+	                 std::vector<TraceStep> &trace) const;
+
+	// Check if a conditional jump has been taken more often than not.
+	bool IsLikelyTaken(cell cip) const;
+
+	// Emit code for all instructions, or for a trace. The sizing pass 
+	// assumes maximum alignment padding.
+	void EmitCode(AsmJit::Assembler &as, std::vector<AmxInstruction> &instrs, 
+	              CodeMap *code_map, LabelMap *label_map, bool sizing,
+	              const std::vector<TraceStep> *trace = 0);
+
+	// Labels of thunks that enter a trace (in generic code) or leave it for
+	// generic code (in a trace), by AMX address. Emitted by trace_thunks().
+	typedef std::map<cell, AsmJit::Label> TraceLabelMap;
+	TraceLabelMap trace_entries_;
+	TraceLabelMap trace_exits_;
+
+	AsmJit::Label &TraceLabel(AsmJit::Assembler &as, TraceLabelMap &labels, cell cip);
+
+	// Start offsets and targets of branches emitted by branch(), and whether
+	// each of them can be short (as found by the previous pass).
+	std::vector<std::pair<sysint_t, AsmJit::Label> > branches_;
+	std::vector<bool> short_branches_;
+
+	// Number of bytes saved by making branches short.
+	sysint_t short_branch_savings_;
+
+	// Whether the code being emitted is only measured (see Assemble()).
+	bool sizing_;
+
+	// Labels of halt thunks by error code. The thunks are emitted at the end
+	// of the code by halt_thunks().
+	typedef std::map<cell, AsmJit::Label> HaltLabelMap;
+	HaltLabelMap halt_labels_;
+
+	AsmJit::Label &HaltLabel(AsmJit::Assembler &as, cell error_code);
+
+	// Labels of thunks that leave speculated code and resume generic code
+	// at the given AMX address. The thunks are emitted by deopt_thunks().
+	typedef std::map<cell, AsmJit::Label> DeoptLabelMap;
+	DeoptLabelMap deopt_labels_;
+
+	AsmJit::Label &DeoptLabel(AsmJit::Assembler &as, cell cip);
 
 	// Code snippets.
+	void branch(AsmJit::Assembler &as, const AsmJit::Label &label);
+	void branch(AsmJit::Assembler &as, AsmJit::CONDITION cc, const AsmJit::Label &label);
 	void halt(AsmJit::Assembler &as, cell error_code);
+	void halt_thunks(AsmJit::Assembler &as);
+	void counter(AsmJit::Assembler &as, std::size_t index);
+	void branch_count(AsmJit::Assembler &as, std::size_t index, bool fall_through);
+	void guard_write(AsmJit::Assembler &as, const AmxInstruction &instr);
+	void guard_range(AsmJit::Assembler &as, const AsmJit::GPReg &address, cell size);
+	void revalidate(AsmJit::Assembler &as);
+	void deopt_check(AsmJit::Assembler &as, cell cip);
+	void deopt_thunks(AsmJit::Assembler &as);
+	void trace_check(AsmJit::Assembler &as, cell cip);
+	void trace_step(AsmJit::Assembler &as, const AmxInstruction &instr, const TraceStep &step);
+	void trace_thunks(AsmJit::Assembler &as);
+	void memo_thunks(AsmJit::Assembler &as, LabelMap *label_map);
+	void stack_probe(AsmJit::Assembler &as, cell size);
+	void sdiv(AsmJit::Assembler &as);
+	void entry_thunk(AsmJit::Assembler &as);
+	void broadcast_thunk(AsmJit::Assembler &as);
+	void call_replacement(AsmJit::Assembler &as, void *function, cell native);
+	void array_loop(AsmJit::Assembler &as, const LoopIdiom &loop);
+	void array_pointer(AsmJit::Assembler &as, const AsmJit::GPReg &reg, const LoopOperand &array);
 
 	// Static members.
-	static void *esp_;
-	static StackBuffer stack_;
-	static int call_depth_;
+	static std::size_t stack_size_;
+	static int align_flags_;
+	static int align_size_;
+	static TargetFeatures target_;
+	static bool has_target_;
+	static bool speculation_;
+	static bool tracing_;
+	static std::size_t max_clones_;
+	static bool memoization_;
 };
 
 } // namespace jit
@@ -14,6 +14,8 @@
 
 #include <cstring>
 
+#include <AsmJit/MemoryManager.h>
+
 #include "jump-x86.h"
 
 #if defined WIN32 || defined _WIN32
@@ -42,16 +44,88 @@ static void Unprotect(void *address, int size) {
 
 #endif
 
+// Returns the length of a ModR/M byte and what follows it (SIB, 
+// displacement).
+static int GetModRMLength(const unsigned char *code) {
+	int mod = code[0] >> 6;
+	int rm = code[0] & 7;
+	int length = 1;
+	if (mod != 3 && rm == 4) {
+		length++;
+		if (mod == 0 && (code[1] & 7) == 5) {
+			length += 4;
+		}
+	}
+	if (mod == 0 && rm == 5) {
+		length += 4;
+	} else if (mod == 1) {
+		length += 1;
+	} else if (mod == 2) {
+		length += 4;
+	}
+	return length;
+}
+
+// Returns the length of an instruction commonly found in function 
+// prologues, or 0 if it's not known or can't be moved elsewhere (short
+// and conditional jumps, ret).
+static int GetInstrLength(const unsigned char *code) {
+	int prefix = 0;
+	bool operand16 = false;
+	while (code[prefix] == 0x66 || code[prefix] == 0x64 || code[prefix] == 0x65) {
+		operand16 = operand16 || code[prefix] == 0x66;
+		prefix++;
+	}
+	const unsigned char *op = code + prefix;
+	int imm = operand16 ? 2 : 4;
+
+	if ((op[0] >= 0x50 && op[0] <= 0x5F) || op[0] == 0x90) {
+		return prefix + 1;                                // push/pop reg, nop
+	}
+	if (op[0] >= 0xB8 && op[0] <= 0xBF) {
+		return prefix + 1 + imm;                          // mov reg, imm
+	}
+	switch (op[0]) {
+		case 0x6A:                                        // push imm8
+			return prefix + 2;
+		case 0x68:                                        // push imm32
+		case 0xE8:                                        // call rel32
+		case 0xE9:                                        // jmp rel32
+			return prefix + 5;
+		case 0x01: case 0x03: case 0x09: case 0x0B:       // add, or
+		case 0x21: case 0x23: case 0x29: case 0x2B:       // and, sub
+		case 0x31: case 0x33: case 0x39: case 0x3B:       // xor, cmp
+		case 0x85: case 0x89: case 0x8B: case 0x8D:       // test, mov, lea
+		case 0xFF:                                        // inc, dec, push
+			return prefix + 1 + GetModRMLength(op + 1);
+		case 0x83:                                        // op r/m, imm8
+		case 0xC1:                                        // shift r/m, imm8
+			return prefix + 1 + GetModRMLength(op + 1) + 1;
+		case 0x81:                                        // op r/m, imm32
+		case 0xC7:                                        // mov r/m, imm32
+			return prefix + 1 + GetModRMLength(op + 1) + imm;
+		case 0x0F:
+			if (op[1] == 0xB6 || op[1] == 0xB7 || op[1] == 0xBE || op[1] == 0xBF) {
+				return prefix + 2 + GetModRMLength(op + 2);  // movzx, movsx
+			}
+			return 0;
+		default:
+			return 0;
+	}
+}
+
 JumpX86::JumpX86() 
 	: src_(0)
 	, dst_(0)
 	, installed_(false)
+	, trampoline_(0)
 {}
 
 JumpX86::JumpX86(void *src, void *dst) 
 	: src_(0)
 	, dst_(0)
 	, installed_(false)
+	, trampoline_(0)
 {
 	Install(src, dst);
 }
@@ -65,6 +139,10 @@ bool JumpX86::Install() {
 		return false;
 	}
 
+	if (trampoline_ == 0) {
+		MakeTrampoline();
+	}
+
 	// Set write permission
 	Unprotect(src_, kJmpInstrSize);
 
@@ -88,6 +166,9 @@ bool JumpX86::Install(void *src, void *dst) {
 		return false;
 	}
 
+	if (src != src_) {
+		trampoline_ = 0;
+	}
     src_ = src; 
 	dst_ = dst;
 	return Install();
@@ -116,4 +197,50 @@ void *JumpX86::GetTargetAddress(void *jmp) {
 		return reinterpret_cast<void*>(abs_addr);
 	}
 	return 0;
-}
\ No newline at end of file
+}
+
+void *JumpX86::GetTrampoline() const {
+	return trampoline_;
+}
+
+void JumpX86::MakeTrampoline() {
+	const unsigned char *code = reinterpret_cast<unsigned char*>(src_);
+	int length = 0;
+	while (length < kJmpInstrSize) {
+		// A relocated call would push a return address in the stub, which
+		// breaks code that reads it (e.g. PIC thunks: call next; pop reg).
+		int instr_length = GetInstrLength(code + length);
+		if (instr_length == 0 || code[length] == 0xE8) {
+			return;
+		}
+		length += instr_length;
+	}
+
+	// The stub is never freed: hooks live as long as the plugin.
+	unsigned char *stub = reinterpret_cast<unsigned char*>(
+		AsmJit::MemoryManager::getGlobal()->alloc(length + kJmpInstrSize, 
+		                                          AsmJit::MEMORY_ALLOC_PERMANENT));
+	if (stub == 0) {
+		return;
+	}
+	std::memcpy(stub, code, length);
+
+	// Relative jumps must still reach the same targets.
+	for (int i = 0; i < length; i += GetInstrLength(code + i)) {
+		if (code[i] == 0xE9) {
+			uint32_t rel_addr;
+			std::memcpy(&rel_addr, code + i + 1, kJmpInstrSize - 1);
+			uint32_t target = rel_addr + reinterpret_cast<uint32_t>(code + i + kJmpInstrSize);
+			uint32_t offset = target - (reinterpret_cast<uint32_t>(stub + i) + kJmpInstrSize);
+			std::memcpy(stub + i + 1, &offset, kJmpInstrSize - 1);
+		}
+	}
+
+	// Continue after the copied instructions.
+	stub[length] = 0xE9;
+	uint32_t offset = (reinterpret_cast<uint32_t>(code) + length) 
+	                - (reinterpret_cast<uint32_t>(stub) + length + kJmpInstrSize);
+	std::memcpy(stub + length + 1, &offset, kJmpInstrSize - 1);
+
+	trampoline_ = stub;
+}
@@ -36,6 +36,12 @@ public:
 	// Returns a E9 JMP destination as an aboluste address
 	static void *GetTargetAddress(void *jmp);
 
+	// Returns a stub that runs the instructions overwritten by the jump and
+	// continues in the original function, so it can be called while the jump
+	// is installed. Returns 0 if those instructions couldn't be relocated,
+	// which includes any relative call among them.
+	void *GetTrampoline() const;
+
 	// Temporary Remove()
 	class ScopedRemove {
 	public:
@@ -83,6 +89,9 @@ private:
 	void *dst_;
 	unsigned char code_[5];
 	bool installed_;
+	void *trampoline_;
+
+	void MakeTrampoline();
 };
 
 #endif
@@ -27,7 +27,10 @@
 #include <cstring>
 #include <fstream>
 #include <map>
+#include <set>
+#include <sstream>
 #include <string>
+#include <vector>
 
 #include "amxname.h"
 #include "configreader.h"
@@ -52,37 +55,127 @@ static logprintf_t logprintf;
 
 static std::map<AMX*, jit::Jitter*> jitters;
 
+// Scripts may be run from other threads while jitters is being changed.
+static AsmJit::Lock jitters_lock;
+
+// Jitters are also kept in one of the AMX's user data slots for quick
+// access, if there is a free one.
+static const long jitter_tag = AMX_USERTAG('J', 'I', 'T', '!');
+
 static JumpX86 amx_Exec_hook;
 static JumpX86 amx_GetAddr_hook;
+static JumpX86 amx_FindPublic_hook;
+static JumpX86 amx_FindNative_hook;
 
 static cell *opcode_list = 0;
 
 static ConfigReader server_cfg("server.cfg");
 
+// Whether profiles are collected and saved, and whether they are used.
+static bool collect_profiles = false;
+static bool use_profiles = false;
+
+// Paths of profile files to write when scripts are unloaded.
+static std::map<AMX*, std::string> profile_paths;
+
+// Functions to always or never memoize, by script name.
+typedef std::map<std::string, std::set<cell> > ScriptAddresses;
+static ScriptAddresses memo_include;
+static ScriptAddresses memo_exclude;
+
 static int AMXAPI amx_GetAddr_JIT(AMX *amx, cell amx_addr, cell **phys_addr) {
 	AMX_HEADER *hdr = reinterpret_cast<AMX_HEADER*>(amx->base);
 	*phys_addr = reinterpret_cast<cell*>(amx->base + hdr->dat + amx_addr);
 	return AMX_ERR_NONE;
 }
 
-static int AMXAPI amx_Exec_JIT(AMX *amx, cell *retval, int index) {
-	#if defined __GNUC__
-		if ((amx->flags & AMX_FLAG_BROWSE) == AMX_FLAG_BROWSE) {
-			// amx_BrowseRelocate() wants the opcode list.
-			assert(::opcode_list != 0);
-			*retval = reinterpret_cast<cell>(::opcode_list);
-			return AMX_ERR_NONE;
+static void AttachJitter(AMX *amx, jit::Jitter *jitter) {
+	for (int i = 0; i < AMX_USERNUM; i++) {
+		if (amx->usertags[i] == 0) {
+			amx->usertags[i] = jitter_tag;
+			amx->userdata[i] = jitter;
+			return;
 		}
-	#endif	
+	}
+}
+
+static void DetachJitter(AMX *amx) {
+	for (int i = 0; i < AMX_USERNUM; i++) {
+		if (amx->usertags[i] == jitter_tag) {
+			amx->usertags[i] = 0;
+			amx->userdata[i] = 0;
+		}
+	}
+}
+
+static jit::Jitter *GetJitter(AMX *amx) {
+	for (int i = 0; i < AMX_USERNUM; i++) {
+		if (amx->usertags[i] == jitter_tag) {
+			return static_cast<jit::Jitter*>(amx->userdata[i]);
+		}
+	}
+	AsmJit::AutoLock lock(jitters_lock);
 	std::map<AMX*, jit::Jitter*>::iterator iterator = jitters.find(amx);
 	if (iterator != jitters.end()) {
-		return iterator->second->CallPublicFunction(index, retval);
+		return iterator->second;
+	}
+	return 0;
+}
+
+static int AMXAPI amx_Exec_JIT(AMX *amx, cell *retval, int index) {
+	jit::Jitter *jitter = GetJitter(amx);
+	if (jitter != 0) {
+		if (jitter->CallConstantPublic(index, retval)) {
+			return AMX_ERR_NONE;
+		}
+		return jitter->CallPublicFunction(index, retval);
 	} else {
+		#if defined __GNUC__
+			if ((amx->flags & AMX_FLAG_BROWSE) == AMX_FLAG_BROWSE) {
+				// amx_BrowseRelocate() wants the opcode list.
+				assert(::opcode_list != 0);
+				*retval = reinterpret_cast<cell>(::opcode_list);
+				return AMX_ERR_NONE;
+			}
+		#endif	
+		void *original = amx_Exec_hook.GetTrampoline();
+		if (original != 0) {
+			typedef int (AMXAPI *amx_Exec_t)(AMX *amx, cell *retval, int index);
+			return reinterpret_cast<amx_Exec_t>(original)(amx, retval, index);
+		}
 		JumpX86::ScopedRemove r(&amx_Exec_hook);
 		return amx_Exec(amx, retval, index);
 	}
 }
 
+typedef int (AMXAPI *amx_FindName_t)(AMX *amx, const char *name, int *index);
+
+static int AMXAPI amx_FindPublic_JIT(AMX *amx, const char *name, int *index) {
+	jit::Jitter *jitter = GetJitter(amx);
+	if (jitter != 0) {
+		return jitter->FindPublic(name, index);
+	}
+	void *original = amx_FindPublic_hook.GetTrampoline();
+	if (original != 0) {
+		return reinterpret_cast<amx_FindName_t>(original)(amx, name, index);
+	}
+	JumpX86::ScopedRemove r(&amx_FindPublic_hook);
+	return amx_FindPublic(amx, name, index);
+}
+
+static int AMXAPI amx_FindNative_JIT(AMX *amx, const char *name, int *index) {
+	jit::Jitter *jitter = GetJitter(amx);
+	if (jitter != 0) {
+		return jitter->FindNative(name, index);
+	}
+	void *original = amx_FindNative_hook.GetTrampoline();
+	if (original != 0) {
+		return reinterpret_cast<amx_FindName_t>(original)(amx, name, index);
+	}
+	JumpX86::ScopedRemove r(&amx_FindNative_hook);
+	return amx_FindNative(amx, name, index);
+}
+
 static std::string GetModuleNameBySymbol(void *symbol) {
 	char module[FILENAME_MAX] = "";
 	if (symbol != 0) {
@@ -107,6 +200,83 @@ static std::string GetFileName(const std::string &path) {
 	return path;
 }
 
+// Get path of a file named after the AMX file but with another extension.
+// Returns an empty string if the AMX path is unknown.
+static std::string GetAmxFilePath(AMX *amx, const char *extension) {
+	std::string amx_path = GetAmxName(amx);
+	if (amx_path.empty()) {
+		return amx_path;
+	}
+	std::string path;
+	std::string::size_type dot = amx_path.find_last_of(".");
+	if (dot != std::string::npos 
+			&& std::strcmp(amx_path.c_str() + dot, ".amx") == 0) {
+		// Strip extension.
+		path.assign(amx_path.begin(), amx_path.begin() + dot);
+	} else {
+		path.assign(amx_path);
+	}
+	path.append(extension);
+	return path;
+}
+
+static void SaveProfile(AMX *amx, jit::Jitter *jitter) {
+	std::map<AMX*, std::string>::iterator it = profile_paths.find(amx);
+	if (it != profile_paths.end()) {
+		jit::Profile profile;
+		jitter->GetProfile(profile);
+		if (!profile.IsEmpty() && !profile.Save(it->second)) {
+			logprintf("[jit] Could not write profile to %s", it->second.c_str());
+		}
+		profile_paths.erase(it);
+	}
+}
+
+static void PrintMemoStats(jit::Jitter *jitter) {
+	std::vector<jit::MemoStats> stats;
+	jitter->GetMemoStats(stats);
+	for (std::size_t i = 0; i < stats.size(); i++) {
+		logprintf("[jit] Function %08x: %lu calls, %.1f%% cache hits", 
+			stats[i].function, static_cast<unsigned long>(stats[i].calls), 
+			stats[i].calls > 0 ? 100.0 * stats[i].hits / stats[i].calls : 0.0);
+	}
+}
+
+// Get the name of a script: its file name without directory and extension.
+static std::string GetScriptName(AMX *amx) {
+	std::string name = GetFileName(GetAmxName(amx));
+	std::string::size_type dot = name.find_last_of(".");
+	if (dot != std::string::npos) {
+		name.erase(dot);
+	}
+	return name;
+}
+
+// Parses a list of script:address pairs separated by spaces, where address 
+// is hexadecimal, e.g. "lvdm:00001a2c". Entries without a script name are
+// ignored.
+static ScriptAddresses ParseScriptAddresses(const char *option) {
+	ScriptAddresses addresses;
+	std::istringstream stream(server_cfg.GetOption(option, std::string()));
+	std::string entry;
+	while (stream >> entry) {
+		std::string::size_type colon = entry.find_last_of(":");
+		std::istringstream address_stream(colon != std::string::npos ? entry.substr(colon + 1) : "");
+		cell address;
+		if (colon == 0 || colon == std::string::npos || !(address_stream >> std::hex >> address)) {
+			logprintf("  JIT: Invalid %s entry: %s (must be script:address)", option, entry.c_str());
+			continue;
+		}
+		addresses[entry.substr(0, colon)].insert(address);
+	}
+	return addresses;
+}
+
+static std::set<cell> GetScriptAddresses(const ScriptAddresses &addresses, const std::string &script) {
+	ScriptAddresses::const_iterator it = addresses.find(script);
+	return it != addresses.end() ? it->second : std::set<cell>();
+}
+
 PLUGIN_EXPORT unsigned int PLUGIN_CALL Supports() {
 	return SUPPORTS_VERSION | SUPPORTS_AMX_NATIVES;
 }
@@ -129,12 +299,65 @@ PLUGIN_EXPORT bool PLUGIN_CALL Load(void **ppData) {
 		jit::Jitter::SetStackSize(stack_size);
 	}
 
+	std::string align = server_cfg.GetOption("jit_align", std::string("none"));
+	int align_flags = jit::Jitter::ALIGN_NONE;
+	if (align == "functions") {
+		align_flags = jit::Jitter::ALIGN_FUNCTIONS;
+	} else if (align == "loops") {
+		align_flags = jit::Jitter::ALIGN_LOOPS;
+	} else if (align == "both") {
+		align_flags = jit::Jitter::ALIGN_BOTH;
+	} else if (align != "none") {
+		logprintf("  JIT: Unknown jit_align value: %s", align.c_str());
+	}
+	int align_size = server_cfg.GetOption("jit_align_size", 16);
+	if (!jit::Jitter::SetCodeAlignment(align_flags, align_size)) {
+		logprintf("  JIT: Invalid jit_align_size value: %d (must be a power of two up to 64), "
+		          "code is not aligned", align_size);
+	}
+
+	std::string isa = server_cfg.GetOption("jit_isa", std::string("native"));
+	if (isa != "native") {
+		jit::TargetFeatures features;
+		if (jit::TargetFeatures::GetBaselineFeatures(isa, features)) {
+			// Never use anything the CPU doesn't have.
+			jit::TargetFeatures host = jit::TargetFeatures::GetHostFeatures();
+			if ((features & host).GetFlags() != features.GetFlags()) {
+				logprintf("  JIT: CPU doesn't support all of %s", isa.c_str());
+			}
+			jit::Jitter::SetTargetFeatures(features & host);
+		} else {
+			logprintf("  JIT: Unknown jit_isa value: %s", isa.c_str());
+		}
+	}
+
+	std::string profile = server_cfg.GetOption("jit_profile", std::string("none"));
+	if (profile == "collect") {
+		collect_profiles = true;
+	} else if (profile == "use") {
+		use_profiles = true;
+	} else if (profile == "both") {
+		collect_profiles = true;
+		use_profiles = true;
+	} else if (profile != "none") {
+		logprintf("  JIT: Unknown jit_profile value: %s", profile.c_str());
+	}
+
+	jit::Jitter::SetSpeculation(server_cfg.GetOption("jit_speculate", false));
+	jit::Jitter::SetTracing(server_cfg.GetOption("jit_trace", false));
+	jit::Jitter::SetMaxClones(server_cfg.GetOption("jit_max_clones", 16));
+	jit::Jitter::SetMemoization(server_cfg.GetOption("jit_memoize", false));
+	memo_include = ParseScriptAddresses("jit_memoize_include");
+	memo_exclude = ParseScriptAddresses("jit_memoize_exclude");
+
 	logprintf("  JIT plugin v%s is OK.", PLUGIN_VERSION_STRING);
 	return true;
 }
 
 PLUGIN_EXPORT void PLUGIN_CALL Unload() {
 	for (std::map<AMX*, jit::Jitter*>::iterator it = jitters.begin(); it != jitters.end(); ++it) {
+		SaveProfile(it->first, it->second);
+		PrintMemoStats(it->second);
 		delete it->second;
 	}
 }
@@ -148,6 +371,9 @@ PLUGIN_EXPORT int PLUGIN_CALL AmxLoad(AMX *amx) {
 	typedef int (AMXAPI *amx_GetAddr_t)(AMX *amx, cell amx_addr, cell **phys_addr);
 	amx_GetAddr_t amx_GetAddr = (amx_GetAddr_t)((void**)pAMXFunctions)[PLUGIN_AMX_EXPORT_GetAddr];
 
+	amx_FindName_t amx_FindPublic = (amx_FindName_t)((void**)pAMXFunctions)[PLUGIN_AMX_EXPORT_FindPublic];
+	amx_FindName_t amx_FindNative = (amx_FindName_t)((void**)pAMXFunctions)[PLUGIN_AMX_EXPORT_FindNative];
+
 	typedef uint16_t *(AMXAPI *amx_Align16_t)(uint16_t *v);
 	((void**)pAMXFunctions)[PLUGIN_AMX_EXPORT_Align16] = (amx_Align16_t)dummy;
 
@@ -173,33 +399,68 @@ PLUGIN_EXPORT int PLUGIN_CALL AmxLoad(AMX *amx) {
 			(void*)amx_GetAddr,
 			(void*)amx_GetAddr_JIT);
 	}	
+	if (!amx_FindPublic_hook.IsInstalled()) {
+		amx_FindPublic_hook.Install(
+			(void*)amx_FindPublic,
+			(void*)amx_FindPublic_JIT);
+	}
+	if (!amx_FindNative_hook.IsInstalled()) {
+		amx_FindNative_hook.Install(
+			(void*)amx_FindNative,
+			(void*)amx_FindNative_JIT);
+	}
 
 	try {
 		// Prepare a file for assembly listing if "jit_listing" option is activated.		
 		std::FILE *stream = 0;
 		if (::server_cfg.GetOption("jit_listing", false)) {
-			std::string amx_path = GetAmxName(amx);
-			if (!amx_path.empty()) {
-				std::string asm_path;
-				std::string::size_type dot = amx_path.find_last_of(".");
-				if (dot != std::string::npos 
-						&& std::strcmp(amx_path.c_str() + dot, ".amx") == 0) {
-					// Strip extension.
-					asm_path.assign(amx_path.begin(), amx_path.begin() + dot);
-				} else {
-					asm_path.assign(amx_path);					
-				}
-				asm_path.append(".asm");
+			std::string asm_path = GetAmxFilePath(amx, ".asm");
+			if (!asm_path.empty()) {
 				stream = std::fopen(asm_path.c_str(), "w");
 				if (stream != 0) {
-					std::fprintf(stream, "; Assembly code generated from %s\n\n", amx_path.c_str());
+					std::fprintf(stream, "; Assembly code generated from %s\n\n", GetAmxName(amx).c_str());
 				}
 			}
 		}		
 
-		// Create a new Jitter instance and compile the script.
+		// Create a new Jitter instance.
 		jit::Jitter *jitter = new jit::Jitter(amx, ::opcode_list);
-		jitters.insert(std::make_pair(amx, jitter));
+		{
+			AsmJit::AutoLock lock(jitters_lock);
+			jitters.insert(std::make_pair(amx, jitter));
+		}
+		AttachJitter(amx, jitter);
+
+		// Use the profile from the previous run and/or collect a new one if
+		// "jit_profile" option is set.
+		if (::collect_profiles || ::use_profiles) {
+			std::string profile_path = GetAmxFilePath(amx, ".profile");
+			if (!profile_path.empty()) {
+				jit::Profile profile;
+				if (::use_profiles && profile.Load(profile_path) && !jitter->SetProfile(profile)) {
+					logprintf("[jit] Profile %s is for a different version of the script, ignoring it", 
+					          profile_path.c_str());
+				}
+				if (::collect_profiles) {
+					jitter->EnableProfiling();
+					profile_paths[amx] = profile_path;
+				}
+			}
+		}
+
+		// Scripts are only found in the server's directories.
+		std::string amx_path = GetAmxName(amx);
+		if (amx_path.compare(0, 10, "gamemodes/") == 0 || amx_path.compare(0, 10, "gamemodes\\") == 0) {
+			jitter->SetScriptKind(jit::Jitter::SCRIPT_GAMEMODE);
+		} else if (amx_path.compare(0, 14, "filterscripts/") == 0 || amx_path.compare(0, 14, "filterscripts\\") == 0) {
+			jitter->SetScriptKind(jit::Jitter::SCRIPT_FILTERSCRIPT);
+		}
+
+		std::string script = GetScriptName(amx);
+		jitter->SetMemoizedFunctions(GetScriptAddresses(memo_include, script), 
+		                             GetScriptAddresses(memo_exclude, script));
+
+		// Compile the script.
 		jitter->Compile(stream);
 
 		// Close listing file.
@@ -241,10 +502,21 @@ PLUGIN_EXPORT int PLUGIN_CALL AmxLoad(AMX *amx) {
 }
 
 PLUGIN_EXPORT int PLUGIN_CALL AmxUnload(AMX *amx) {
-	std::map<AMX*, jit::Jitter*>::iterator it = jitters.find(amx);
-	if (it != jitters.end()) {
-		delete it->second;
-		jitters.erase(it);		
+	DetachJitter(amx);
+
+	jit::Jitter *jitter = 0;
+	{
+		AsmJit::AutoLock lock(jitters_lock);
+		std::map<AMX*, jit::Jitter*>::iterator it = jitters.find(amx);
+		if (it != jitters.end()) {
+			jitter = it->second;
+			jitters.erase(it);
+		}
+	}
+	if (jitter != 0) {
+		SaveProfile(amx, jitter);
+		PrintMemoStats(jitter);
+		delete jitter;
 	}
 	return AMX_ERR_NONE;
 }
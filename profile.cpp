@@ -0,0 +1,207 @@
+// Copyright (c) 2012, Sergey Zolotarev
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met: 
+//
+// 1. Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer. 
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution. 
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// // LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include <fstream>
+#include <ios>
+#include <iomanip>
+#include <sstream>
+
+#include "profile.h"
+
+namespace {
+
+// Bump this when the meaning of the recorded data changes.
+const int kProfileVersion = 1;
+
+} // anonymous namespace
+
+namespace jit {
+
+Profile::Profile()
+	: hash_(0)
+{
+}
+
+void Profile::AddFunction(cell address, uint64_t calls) {
+	functions_[address] += calls;
+}
+
+void Profile::AddBlock(cell address, uint64_t count) {
+	blocks_[address] += count;
+}
+
+void Profile::AddCall(cell caller, cell callee, uint64_t count) {
+	calls_[std::make_pair(caller, callee)] += count;
+}
+
+void Profile::AddBranch(cell address, uint64_t taken, uint64_t not_taken) {
+	std::pair<uint64_t, uint64_t> &counts = branches_[address];
+	counts.first += taken;
+	counts.second += not_taken;
+}
+
+uint64_t Profile::GetCount(cell address) const {
+	CountMap::const_iterator iterator = functions_.find(address);
+	if (iterator != functions_.end()) {
+		return iterator->second;
+	}
+	iterator = blocks_.find(address);
+	if (iterator != blocks_.end()) {
+		return iterator->second;
+	}
+	return 0;
+}
+
+bool Profile::GetBranch(cell address, uint64_t &taken, uint64_t &not_taken) const {
+	BranchMap::const_iterator iterator = branches_.find(address);
+	if (iterator != branches_.end()) {
+		taken = iterator->second.first;
+		not_taken = iterator->second.second;
+		return true;
+	}
+	return false;
+}
+
+bool Profile::IsEmpty() const {
+	return functions_.empty() && blocks_.empty() && calls_.empty() && branches_.empty();
+}
+
+// The file is plain text, one record per line. Addresses and the hash are
+// hexadecimal, counts are decimal:
+//
+//   version <version>
+//   hash <hash>
+//   function <address> <calls>
+//   block <address> <count>
+//   call <caller> <callee> <count>
+//   branch <address> <taken> <not taken>
+//
+// Lines starting with '#' are comments.
+bool Profile::Load(const std::string &path) {
+	std::ifstream stream(path.c_str());
+	if (!stream.is_open()) {
+		return false;
+	}
+
+	Profile profile;
+	bool have_version = false;
+	bool have_hash = false;
+
+	std::string line;
+	while (std::getline(stream, line)) {
+		if (line.empty() || line[0] == '#') {
+			continue;
+		}
+
+		std::istringstream line_stream(line);
+		std::string kind;
+		line_stream >> kind;
+
+		if (kind == "version") {
+			int version;
+			line_stream >> version;
+			if (!line_stream || version != kProfileVersion) {
+				return false;
+			}
+			have_version = true;
+		} else if (kind == "hash") {
+			line_stream >> std::hex >> profile.hash_;
+			have_hash = true;
+		} else if (kind == "function") {
+			cell address;
+			uint64_t calls;
+			line_stream >> std::hex >> address >> std::dec >> calls;
+			profile.AddFunction(address, calls);
+		} else if (kind == "block") {
+			cell address;
+			uint64_t count;
+			line_stream >> std::hex >> address >> std::dec >> count;
+			profile.AddBlock(address, count);
+		} else if (kind == "call") {
+			cell caller, callee;
+			uint64_t count;
+			line_stream >> std::hex >> caller >> callee >> std::dec >> count;
+			profile.AddCall(caller, callee, count);
+		} else if (kind == "branch") {
+			cell address;
+			uint64_t taken, not_taken;
+			line_stream >> std::hex >> address >> std::dec >> taken >> not_taken;
+			profile.AddBranch(address, taken, not_taken);
+		} else {
+			return false;
+		}
+
+		if (!line_stream) {
+			return false;
+		}
+	}
+
+	if (!have_version || !have_hash) {
+		return false;
+	}
+
+	*this = profile;
+	return true;
+}
+
+bool Profile::Save(const std::string &path) const {
+	std::ofstream stream(path.c_str());
+	if (!stream.is_open()) {
+		return false;
+	}
+
+	stream << "# JIT profile\n";
+	stream << "version " << kProfileVersion << "\n";
+	stream << "hash " << std::hex << std::setw(8) << std::setfill('0') << hash_ << "\n";
+
+	for (CountMap::const_iterator iterator = functions_.begin(); 
+			iterator != functions_.end(); ++iterator) {
+		stream << "function " 
+		       << std::hex << std::setw(8) << iterator->first << " "
+		       << std::dec << iterator->second << "\n";
+	}
+	for (CountMap::const_iterator iterator = blocks_.begin(); 
+			iterator != blocks_.end(); ++iterator) {
+		stream << "block " 
+		       << std::hex << std::setw(8) << iterator->first << " "
+		       << std::dec << iterator->second << "\n";
+	}
+	for (CallMap::const_iterator iterator = calls_.begin(); 
+			iterator != calls_.end(); ++iterator) {
+		stream << "call " 
+		       << std::hex << std::setw(8) << iterator->first.first << " "
+		       << std::setw(8) << iterator->first.second << " "
+		       << std::dec << iterator->second << "\n";
+	}
+	for (BranchMap::const_iterator iterator = branches_.begin(); 
+			iterator != branches_.end(); ++iterator) {
+		stream << "branch " 
+		       << std::hex << std::setw(8) << iterator->first << " "
+		       << std::dec << iterator->second.first << " " 
+		       << iterator->second.second << "\n";
+	}
+
+	return stream.good();
+}
+
+} // namespace jit
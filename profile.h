@@ -0,0 +1,94 @@
+// Copyright (c) 2012, Sergey Zolotarev
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met: 
+//
+// 1. Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer. 
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution. 
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// // LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <map>
+#include <string>
+#include <utility>
+
+#include "amx/amx.h"
+
+namespace jit {
+
+// Execution counts of a script collected by instrumented JIT code. A profile
+// is saved when the script is unloaded and used to lay out code the next
+// time the same script is compiled.
+//
+// All addresses are relative to the start of the code section.
+class Profile {
+public:
+	typedef std::map<std::pair<cell, cell>, uint64_t> CallMap;
+
+	Profile();
+
+	// Hash of the code the profile was collected for.
+	inline uint32_t GetHash() const { return hash_; }
+	inline void SetHash(uint32_t hash) { hash_ = hash; }
+
+	// Add to the number of times a function was called.
+	void AddFunction(cell address, uint64_t calls);
+
+	// Add to the number of times a basic block was entered.
+	void AddBlock(cell address, uint64_t count);
+
+	// Add to the number of calls from one function to another.
+	void AddCall(cell caller, cell callee, uint64_t count);
+
+	// Add to the number of times a conditional jump was and wasn't taken.
+	void AddBranch(cell address, uint64_t taken, uint64_t not_taken);
+
+	// Get the number of times the function or block at the given address was
+	// run.
+	uint64_t GetCount(cell address) const;
+
+	// Get branch counts of a conditional jump. Returns false if the jump has
+	// never been run.
+	bool GetBranch(cell address, uint64_t &taken, uint64_t &not_taken) const;
+
+	// Get call counts by (caller, callee) pair.
+	inline const CallMap &GetCalls() const { return calls_; }
+
+	// Check if nothing has been recorded.
+	bool IsEmpty() const;
+
+	// Read and write a profile file. Load() fails if the file is missing or
+	// malformed.
+	bool Load(const std::string &path);
+	bool Save(const std::string &path) const;
+
+private:
+	typedef std::map<cell, uint64_t> CountMap;
+	typedef std::map<cell, std::pair<uint64_t, uint64_t> > BranchMap;
+
+	uint32_t hash_;
+	CountMap functions_;
+	CountMap blocks_;
+	CallMap calls_;
+	BranchMap branches_;
+};
+
+} // namespace jit
+
+#endif // !PROFILE_H
@@ -0,0 +1,464 @@
+// Copyright (c) 2012, Sergey Zolotarev
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met: 
+//
+// 1. Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer. 
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution. 
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// // LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include <algorithm>
+#include <cctype>
+#include <cstddef>
+#include <cstring>
+
+#include <emmintrin.h>
+
+#if defined _MSC_VER
+	#include <intrin.h>
+#endif
+
+#include "simd.h"
+
+namespace {
+
+inline unsigned char *GetAmxData(AMX *amx) {
+	AMX_HEADER *hdr = reinterpret_cast<AMX_HEADER*>(amx->base);
+	return amx->data != 0 ? amx->data : amx->base + hdr->dat;
+}
+
+inline cell *GetAddress(AMX *amx, cell address) {
+	return reinterpret_cast<cell*>(GetAmxData(amx) + address);
+}
+
+inline int FindFirstSet(unsigned int mask) {
+	#if defined _MSC_VER
+		unsigned long index;
+		_BitScanForward(&index, mask);
+		return static_cast<int>(index);
+	#else
+		return __builtin_ctz(mask);
+	#endif
+}
+
+inline bool IsPacked(const cell *string) {
+	return static_cast<ucell>(*string) > static_cast<ucell>(UNPACKEDMAX);
+}
+
+// Character "index" of a packed or unpacked string. Packed strings store the
+// first character in the high-order byte of a cell.
+inline cell CharAt(const cell *string, bool packed, int index) {
+	if (packed) {
+		ucell c = string[index / sizeof(cell)];
+		return (c >> ((sizeof(cell) - 1 - index % sizeof(cell)) * 8)) & 0xff;
+	}
+	return string[index];
+}
+
+// Converts 'a'..'z' to upper case in each cell, like toupper() does in the
+// "C" locale.
+inline __m128i FoldCase32(__m128i x) {
+	__m128i lower = _mm_and_si128(_mm_cmpgt_epi32(x, _mm_set1_epi32('a' - 1)),
+	                              _mm_cmpgt_epi32(_mm_set1_epi32('z' + 1), x));
+	return _mm_sub_epi32(x, _mm_and_si128(lower, _mm_set1_epi32('a' - 'A')));
+}
+
+// Same as above but for each byte of a packed string.
+inline __m128i FoldCase8(__m128i x) {
+	__m128i lower = _mm_and_si128(_mm_cmpgt_epi8(x, _mm_set1_epi8('a' - 1)),
+	                              _mm_cmpgt_epi8(_mm_set1_epi8('z' + 1), x));
+	return _mm_sub_epi8(x, _mm_and_si128(lower, _mm_set1_epi8('a' - 'A')));
+}
+
+// Returns the offset in bytes of the first zero cell (or zero byte if "bytes"
+// is true) in a string.
+std::size_t FindZero(const cell *string, bool bytes) {
+	// Start from the 16-byte block containing the string. Aligned loads never
+	// cross a page boundary, so reading a few cells around the string is safe.
+	std::size_t skip = reinterpret_cast<std::size_t>(string) & 15;
+	const char *block = reinterpret_cast<const char*>(string) - skip;
+	const __m128i zero = _mm_setzero_si128();
+
+	for (std::size_t offset = 0; ; offset += 16) {
+		__m128i data = _mm_load_si128(reinterpret_cast<const __m128i*>(block + offset));
+		unsigned int mask = _mm_movemask_epi8(bytes ? _mm_cmpeq_epi8(data, zero)
+		                                            : _mm_cmpeq_epi32(data, zero));
+		if (offset == 0) {
+			mask >>= skip;
+			if (mask != 0) {
+				return FindFirstSet(mask);
+			}
+		} else if (mask != 0) {
+			return offset - skip + FindFirstSet(mask);
+		}
+	}
+}
+
+// Returns the number of cells preceding the first zero cell.
+inline int UnpackedLength(const cell *string) {
+	return FindZero(string, false) / sizeof(cell);
+}
+
+// Works exactly like amx_StrLen() does for packed strings: finds the first
+// cell that has a zero byte and then counts the characters in that cell from
+// the high-order byte.
+int PackedLength(const cell *string) {
+	int index = FindZero(string, true) / sizeof(cell);
+	ucell c = string[index];
+	int length = index * sizeof(cell);
+	while ((c & 0xff000000u) != 0) {
+		length++;
+		c <<= 8;
+	}
+	return length;
+}
+
+inline int Length(const cell *string, bool packed) {
+	return packed ? PackedLength(string) : UnpackedLength(string);
+}
+
+// Returns the number of leading characters that are certainly equal in both
+// strings. The rest is left for the scalar loop in Compare().
+int MatchingPrefix(const cell *string1, bool packed1, const cell *string2, 
+                   bool packed2, bool ignorecase, int length, int offset1) 
+{
+	if (packed1 != packed2) {
+		return 0;
+	}
+	if (!packed1) {
+		string1 += offset1;
+		int index = 0;
+		for (; index + 4 <= length; index += 4) {
+			__m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(string1 + index));
+			__m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(string2 + index));
+			if (ignorecase) {
+				a = FoldCase32(a);
+				b = FoldCase32(b);
+			}
+			if (_mm_movemask_epi8(_mm_cmpeq_epi32(a, b)) != 0xffff) {
+				break;
+			}
+		}
+		return index;
+	} else {
+		if (offset1 % sizeof(cell) != 0) {
+			return 0;
+		}
+		string1 += offset1 / sizeof(cell);
+		int cells = length / sizeof(cell);
+		int index = 0;
+		for (; index + 4 <= cells; index += 4) {
+			__m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(string1 + index));
+			__m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(string2 + index));
+			if (ignorecase) {
+				a = FoldCase8(a);
+				b = FoldCase8(b);
+			}
+			if (_mm_movemask_epi8(_mm_cmpeq_epi8(a, b)) != 0xffff) {
+				break;
+			}
+		}
+		return index * sizeof(cell);
+	}
+}
+
+// Same as compare() from amxstring.c.
+cell Compare(const cell *string1, bool packed1, const cell *string2, bool packed2,
+             bool ignorecase, int length, int offset1)
+{
+	int index = MatchingPrefix(string1, packed1, string2, packed2, 
+	                           ignorecase, length, offset1);
+	cell c1 = 0;
+	cell c2 = 0;
+	for (; index < length; index++) {
+		c1 = CharAt(string1, packed1, index + offset1);
+		c2 = CharAt(string2, packed2, index);
+		if (ignorecase) {
+			c1 = std::toupper(c1);
+			c2 = std::toupper(c2);
+		}
+		if (c1 != c2) {
+			break;
+		}
+	}
+	return c1 - c2;
+}
+
+// Returns the first index in [from, to] at which an unpacked string has the
+// specified character or to + 1 if there is none.
+int FindChar(const cell *string, int from, int to, cell c, bool ignorecase) {
+	const __m128i value = _mm_set1_epi32(c);
+	int index = from;
+	for (; index + 4 <= to + 1; index += 4) {
+		__m128i data = _mm_loadu_si128(reinterpret_cast<const __m128i*>(string + index));
+		if (ignorecase) {
+			data = FoldCase32(data);
+		}
+		unsigned int mask = _mm_movemask_epi8(_mm_cmpeq_epi32(data, value));
+		if (mask != 0) {
+			return index + FindFirstSet(mask) / sizeof(cell);
+		}
+	}
+	for (; index <= to; index++) {
+		cell x = string[index];
+		if ((ignorecase ? std::toupper(x) : x) == c) {
+			break;
+		}
+	}
+	return index;
+}
+
+inline bool Overlap(const cell *dest, int dest_length, const cell *source, int source_length) {
+	return dest < source + source_length && source < dest + dest_length;
+}
+
+} // anonymous namespace
+
+namespace jit {
+
+cell StrLen(AMX *amx, cell *params, AMX_NATIVE native) {
+	if (params[0] < static_cast<cell>(sizeof(cell))) {
+		return native(amx, params);
+	}
+	const cell *string = GetAddress(amx, params[1]);
+	return Length(string, IsPacked(string));
+}
+
+cell StrCmp(AMX *amx, cell *params, AMX_NATIVE native) {
+	if (params[0] < static_cast<cell>(4 * sizeof(cell))) {
+		return native(amx, params);
+	}
+
+	const cell *string1 = GetAddress(amx, params[1]);
+	const cell *string2 = GetAddress(amx, params[2]);
+	bool packed1 = IsPacked(string1);
+	bool packed2 = IsPacked(string2);
+
+	int length1 = Length(string1, packed1);
+	int length2 = Length(string2, packed2);
+	int length = std::min(length1, length2);
+	if (length > params[4]) {
+		length = params[4];
+	}
+	if (length == 0) {
+		return 0;
+	}
+
+	cell result = Compare(string1, packed1, string2, packed2, params[3] != 0, length, 0);
+	if (result == 0 && length != params[4]) {
+		result = length1 - length2;
+	}
+	return result;
+}
+
+cell StrFind(AMX *amx, cell *params, AMX_NATIVE native) {
+	if (params[0] < static_cast<cell>(4 * sizeof(cell)) || params[4] < 0) {
+		return native(amx, params);
+	}
+
+	const cell *string = GetAddress(amx, params[1]);
+	const cell *sub = GetAddress(amx, params[2]);
+	bool packed = IsPacked(string);
+	bool subpacked = IsPacked(sub);
+
+	int length = Length(string, packed);
+	int sublength = Length(sub, subpacked);
+	if (sublength == 0) {
+		return -1;
+	}
+
+	bool ignorecase = params[3] != 0;
+	cell first = CharAt(sub, subpacked, 0);
+	if (ignorecase) {
+		first = std::toupper(first);
+	}
+
+	int last = length - sublength;
+	for (int offset = params[4]; offset <= last; offset++) {
+		if (!packed) {
+			offset = FindChar(string, offset, last, first, ignorecase);
+			if (offset > last) {
+				break;
+			}
+		}
+		cell c = CharAt(string, packed, offset);
+		if (ignorecase) {
+			c = std::toupper(c);
+		}
+		if (c != first) {
+			continue;
+		}
+		if (Compare(string, packed, sub, subpacked, ignorecase, sublength, offset) == 0) {
+			return offset;
+		}
+	}
+	return -1;
+}
+
+cell StrCat(AMX *amx, cell *params, AMX_NATIVE native) {
+	if (params[0] < static_cast<cell>(3 * sizeof(cell))) {
+		return native(amx, params);
+	}
+
+	cell *dest = GetAddress(amx, params[1]);
+	const cell *source = GetAddress(amx, params[2]);
+	if (IsPacked(dest) || IsPacked(source)) {
+		return native(amx, params);
+	}
+
+	int dest_length = UnpackedLength(dest);
+	int source_length = UnpackedLength(source);
+	cell maxlength = params[3];
+	if (dest_length >= maxlength) {
+		return native(amx, params);
+	}
+
+	int count = std::min<cell>(source_length, maxlength - 1 - dest_length);
+	if (Overlap(dest, dest_length + count + 1, source, source_length + 1)) {
+		return native(amx, params);
+	}
+
+	std::memcpy(dest + dest_length, source, count * sizeof(cell));
+	dest[dest_length + count] = 0;
+	return dest_length + count;
+}
+
+cell StrMid(AMX *amx, cell *params, AMX_NATIVE native) {
+	if (params[0] < static_cast<cell>(5 * sizeof(cell))) {
+		return native(amx, params);
+	}
+
+	cell *dest = GetAddress(amx, params[1]);
+	const cell *source = GetAddress(amx, params[2]);
+	if (IsPacked(source)) {
+		return native(amx, params);
+	}
+
+	int length = UnpackedLength(source);
+	cell start = params[3];
+	cell end = params[4];
+	cell maxlength = params[5];
+	if (start < 0 || end < start || end > length || maxlength < 1) {
+		return native(amx, params);
+	}
+
+	int count = std::min<cell>(end - start, maxlength - 1);
+	if (Overlap(dest, count + 1, source, length + 1)) {
+		return native(amx, params);
+	}
+
+	std::memcpy(dest, source + start, count * sizeof(cell));
+	dest[count] = 0;
+	return count;
+}
+
+cell FindCell(const cell *array, cell count, cell value, cell equal) {
+	const __m128i x = _mm_set1_epi32(value);
+	unsigned int flip = equal ? 0 : 0xffff;
+	cell i = 0;
+	for (; i + 4 <= count; i += 4) {
+		__m128i data = _mm_loadu_si128(reinterpret_cast<const __m128i*>(array + i));
+		unsigned int mask = _mm_movemask_epi8(_mm_cmpeq_epi32(data, x)) ^ flip;
+		if (mask != 0) {
+			return i + FindFirstSet(mask) / sizeof(cell);
+		}
+	}
+	for (; i < count; i++) {
+		if ((array[i] == value) == (equal != 0)) {
+			break;
+		}
+	}
+	return i;
+}
+
+cell CountCells(const cell *array, cell count, cell value) {
+	const __m128i x = _mm_set1_epi32(value);
+	__m128i sum = _mm_setzero_si128();
+	cell i = 0;
+	for (; i + 4 <= count; i += 4) {
+		__m128i data = _mm_loadu_si128(reinterpret_cast<const __m128i*>(array + i));
+		sum = _mm_sub_epi32(sum, _mm_cmpeq_epi32(data, x)); // -(-1) for each match
+	}
+	cell lanes[4];
+	_mm_storeu_si128(reinterpret_cast<__m128i*>(lanes), sum);
+	cell result = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+	for (; i < count; i++) {
+		if (array[i] == value) {
+			result++;
+		}
+	}
+	return result;
+}
+
+cell SumCells(const cell *array, cell count) {
+	__m128i sum = _mm_setzero_si128();
+	cell i = 0;
+	for (; i + 4 <= count; i += 4) {
+		sum = _mm_add_epi32(sum, _mm_loadu_si128(reinterpret_cast<const __m128i*>(array + i)));
+	}
+	cell lanes[4];
+	_mm_storeu_si128(reinterpret_cast<__m128i*>(lanes), sum);
+	// Unsigned arithmetic wraps around just like the AMX does.
+	ucell result = static_cast<ucell>(lanes[0]) + lanes[1] + lanes[2] + lanes[3];
+	for (; i < count; i++) {
+		result += array[i];
+	}
+	return static_cast<cell>(result);
+}
+
+namespace {
+
+// SSE2 has no signed 32-bit min/max, so select with a compare mask.
+inline __m128i Select(__m128i mask, __m128i a, __m128i b) {
+	return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+}
+
+} // anonymous namespace
+
+cell MinCell(const cell *array, cell count, cell initial) {
+	__m128i min = _mm_set1_epi32(initial);
+	cell i = 0;
+	for (; i + 4 <= count; i += 4) {
+		__m128i data = _mm_loadu_si128(reinterpret_cast<const __m128i*>(array + i));
+		min = Select(_mm_cmplt_epi32(data, min), data, min);
+	}
+	cell lanes[4];
+	_mm_storeu_si128(reinterpret_cast<__m128i*>(lanes), min);
+	cell result = std::min(std::min(lanes[0], lanes[1]), std::min(lanes[2], lanes[3]));
+	for (; i < count; i++) {
+		result = std::min(result, array[i]);
+	}
+	return result;
+}
+
+cell MaxCell(const cell *array, cell count, cell initial) {
+	__m128i max = _mm_set1_epi32(initial);
+	cell i = 0;
+	for (; i + 4 <= count; i += 4) {
+		__m128i data = _mm_loadu_si128(reinterpret_cast<const __m128i*>(array + i));
+		max = Select(_mm_cmpgt_epi32(data, max), data, max);
+	}
+	cell lanes[4];
+	_mm_storeu_si128(reinterpret_cast<__m128i*>(lanes), max);
+	cell result = std::max(std::max(lanes[0], lanes[1]), std::max(lanes[2], lanes[3]));
+	for (; i < count; i++) {
+		result = std::max(result, array[i]);
+	}
+	return result;
+}
+
+} // namespace jit
@@ -0,0 +1,63 @@
+// Copyright (c) 2012, Sergey Zolotarev
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met: 
+//
+// 1. Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer. 
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution. 
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// // LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#ifndef SIMD_H
+#define SIMD_H
+
+#include "amx/amx.h"
+
+namespace jit {
+
+// SSE2 versions of the string natives. They take the same arguments as the
+// natives they replace plus a pointer to the original native which they call
+// for anything they can't handle with identical results (missing optional
+// arguments, overlapping buffers, clamped ranges and so on).
+//
+// These must only be called if the CPU supports SSE2.
+
+cell StrLen(AMX *amx, cell *params, AMX_NATIVE native);
+cell StrCmp(AMX *amx, cell *params, AMX_NATIVE native);
+cell StrFind(AMX *amx, cell *params, AMX_NATIVE native);
+cell StrCat(AMX *amx, cell *params, AMX_NATIVE native);
+cell StrMid(AMX *amx, cell *params, AMX_NATIVE native);
+
+// Kernels for array loops recognized by the JIT. All of them look at "count"
+// cells starting from "array".
+
+// Returns the index of the first cell that is equal (or not equal if "equal"
+// is 0) to "value", or "count" if there is no such cell.
+cell FindCell(const cell *array, cell count, cell value, cell equal);
+
+// Returns the number of cells equal to "value".
+cell CountCells(const cell *array, cell count, cell value);
+
+// Returns the sum of all cells (modulo 2^32).
+cell SumCells(const cell *array, cell count);
+
+// Return the smallest/largest of "initial" and all cells.
+cell MinCell(const cell *array, cell count, cell initial);
+cell MaxCell(const cell *array, cell count, cell initial);
+
+} // namespace jit
+
+#endif // !SIMD_H